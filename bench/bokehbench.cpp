@@ -0,0 +1,1187 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+
+#include <FL/Fl.H>
+#include <FL/Fl_Image.H>
+#include <FL/Fl_RGB_Image.H>
+#include <FL/Fl_PNG_Image.H>
+#include <FL/Fl_JPEG_Image.H>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <dirent.h>
+
+#include "libbokeh.h"
+#include "rawimage.h"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmark of libbokeh engines :
+//   sources   : synthetic frames of megapixels, and images of a directory.
+//   apertures : disc, polygon and ring of pixel sizes, and mask images.
+//   runs      : every engine for every source, aperture and thread count,
+//               after warm-up, repeated for median and 95th percentile.
+// Results go to stdout, JSON and CSV. CSV of an earlier run is baseline,
+// medians slower than it over threshold are regressions, exit code 2.
+////////////////////////////////////////////////////////////////////////////////
+
+#define BENCH_VERSION_STR       "0.1.0"
+
+static string           file_me;
+static string           path_images = "testimgs";
+static string           file_json;
+static string           file_csv;
+static string           file_base;
+static vector<float>    opt_sizes;
+static vector<unsigned> opt_apsizes;
+static vector<string>   opt_shapes;
+static vector<string>   opt_engines;
+static vector<unsigned> opt_threads;
+static unsigned         opt_warmup    = 1;
+static unsigned         opt_reps      = 5;
+static float            opt_threshold = 10.f;
+static double           opt_budget    = 5e10;
+static bool             opt_synth     = true;
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct BenchSource
+{
+    string          name;
+    unsigned        w;
+    unsigned        h;
+    unsigned        d;
+    vector<uchar>   pixels;
+};
+
+struct BenchAperture
+{
+    string          name;
+    unsigned        size;   /// larger side.
+    unsigned        w;
+    unsigned        h;
+    vector<uchar>   mask;
+};
+
+// Everything an engine reads, prepared out of timing.
+struct BenchCase
+{
+    const BenchSource*      src;
+    const BenchAperture*    ap;
+    BokehKernel*            kernel;
+    BokehContext*           context;
+    vector<uchar>           canvas;     /// full frame mask of ProcessBokeh().
+    vector<uchar>           output;     /// caller buffer of context.
+};
+
+// An engine allocates outptr, or writes into output of case.
+typedef bool (*BenchRun)( BenchCase &bc, uchar* &outptr );
+
+struct BenchEngine
+{
+    const char* name;
+    bool        direct;     /// cost grows by taps of mask.
+    BenchRun    run;
+};
+
+struct BenchResult
+{
+    string      engine;
+    string      source;
+    unsigned    w;
+    unsigned    h;
+    string      aperture;
+    unsigned    size;
+    unsigned    taps;
+    unsigned    threads;
+    unsigned    reps;
+    double      median;     /// ms
+    double      p95;
+    double      minimum;
+    double      mean;
+    double      mpps;       /// mega pixels per second of median.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool runLegacy( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                         &bc.canvas[0], outptr );
+}
+
+static bool runFast( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessFastBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                             &bc.ap->mask[0], bc.ap->w, bc.ap->h, outptr );
+}
+
+static bool runGather( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessGatherBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                               &bc.ap->mask[0], bc.ap->w, bc.ap->h, outptr );
+}
+
+static bool runKernel( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessKernelBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                               bc.kernel, outptr );
+}
+
+static bool runFixed( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessFixedBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                              bc.kernel, outptr );
+}
+
+static bool runBorder( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessBorderBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                               bc.kernel, BOKEH_BORDER_CLAMP, outptr );
+}
+
+static bool readBenchRow( unsigned y, unsigned char* row, void* param )
+{
+    BenchCase* bc = (BenchCase*)param;
+    size_t     rb = (size_t)bc->src->w * bc->src->d;
+
+    memcpy( row, &bc->src->pixels[ rb * y ], rb );
+
+    return true;
+}
+
+static bool writeBenchRow( unsigned y, const unsigned char* row, void* param )
+{
+    BenchCase* bc = (BenchCase*)param;
+    size_t     rb = (size_t)bc->src->w * 3;
+
+    memcpy( &bc->output[ rb * y ], row, rb );
+
+    return true;
+}
+
+static bool runStream( BenchCase &bc, uchar* & )
+{
+    return ProcessStreamBokeh( bc.src->w, bc.src->h, bc.src->d,
+                               readBenchRow, &bc, bc.kernel,
+                               writeBenchRow, &bc );
+}
+
+static bool runContext( BenchCase &bc, uchar* & )
+{
+    return ProcessBokehContext( bc.context,
+                                &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d, 0,
+                                &bc.output[0], 0, 3 );
+}
+
+static bool runFFT( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessFFTBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                            &bc.ap->mask[0], bc.ap->w, bc.ap->h, outptr );
+}
+
+static bool runSeparable( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessSeparableBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                                  &bc.ap->mask[0], bc.ap->w, bc.ap->h, outptr );
+}
+
+static bool runPyramid( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessPyramidBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                                &bc.ap->mask[0], bc.ap->w, bc.ap->h, outptr );
+}
+
+static bool runHybrid( BenchCase &bc, uchar* &outptr )
+{
+    return ProcessHybridBokeh( &bc.src->pixels[0], bc.src->w, bc.src->h, bc.src->d,
+                               &bc.ap->mask[0], bc.ap->w, bc.ap->h, outptr );
+}
+
+static const BenchEngine bench_engines[] =
+{
+    { "legacy",     true,   runLegacy },
+    { "fast",       true,   runFast },
+    { "gather",     true,   runGather },
+    { "kernel",     true,   runKernel },
+    { "fixed",      true,   runFixed },
+    { "border",     true,   runBorder },
+    { "stream",     true,   runStream },
+    { "context",    true,   runContext },
+    { "fft",        false,  runFFT },
+    { "separable",  false,  runSeparable },
+    { "pyramid",    false,  runPyramid },
+    { "hybrid",     false,  runHybrid },
+};
+
+static const unsigned bench_engines_count = sizeof( bench_engines ) / sizeof( BenchEngine );
+
+////////////////////////////////////////////////////////////////////////////////
+
+static vector<string> splitList( const string &s, char sep = ',' )
+{
+    vector<string> toks;
+    size_t         pos = 0;
+
+    while( pos <= s.size() )
+    {
+        size_t next = s.find( sep, pos );
+
+        if ( next == string::npos )
+        {
+            next = s.size();
+        }
+
+        if ( next > pos )
+        {
+            toks.push_back( s.substr( pos, next - pos ) );
+        }
+
+        pos = next + 1;
+    }
+
+    return toks;
+}
+
+static bool hasEnding( const string &s, const char* ext )
+{
+    size_t n = strlen( ext );
+
+    if ( s.size() < n )
+        return false;
+
+    for( size_t cnt=0; cnt<n; cnt++ )
+    {
+        if ( tolower( s[ s.size() - n + cnt ] ) != ext[cnt] )
+            return false;
+    }
+
+    return true;
+}
+
+// Noise over gradient, with sparse highlights for boosted pixels.
+// Same seed makes same frame, for baselines.
+static void makeSynthSource( float mp, BenchSource &src )
+{
+    double   px = (double)mp * 1000000.0;
+    unsigned w  = (unsigned)( sqrt( px * 1.5 ) + 0.5 );
+    unsigned h  = (unsigned)( px / w + 0.5 );
+    unsigned rs = 12345;
+    char     name[32] = {0};
+
+    snprintf( name, 32, "synth-%gmp", mp );
+
+    src.name = name;
+    src.w    = max( w, 1u );
+    src.h    = max( h, 1u );
+    src.d    = 3;
+    src.pixels.resize( (size_t)src.w * src.h * 3 );
+
+    for( unsigned y=0; y<src.h; y++ )
+    {
+        uchar* row = &src.pixels[ (size_t)y * src.w * 3 ];
+
+        for( unsigned x=0; x<src.w; x++ )
+        {
+            rs = rs * 1103515245u + 12345u;
+
+            unsigned noise = ( rs >> 16 ) & 0x3F;
+            bool     light = ( ( rs >> 8 ) & 0x3FF ) == 0;
+
+            row[ x * 3 + 0 ] = light ? 255 : (uchar)( x * 160 / src.w + noise );
+            row[ x * 3 + 1 ] = light ? 250 : (uchar)( y * 160 / src.h + noise );
+            row[ x * 3 + 2 ] = light ? 245 : (uchar)( 96 + noise );
+        }
+    }
+}
+
+// disc, polygon ( hexagon ) or ring of n x n, empty for unknown shape.
+static bool makeAperture( const string &shape, unsigned n, BenchAperture &ap )
+{
+    const float pi = 3.14159265f;
+
+    ap.name = shape;
+    ap.size = n;
+    ap.w    = n;
+    ap.h    = n;
+    ap.mask.assign( (size_t)n * n, 0 );
+
+    float c = ( n - 1 ) * 0.5f;
+    float r = n * 0.5f;
+
+    for( unsigned y=0; y<n; y++ )
+    {
+        for( unsigned x=0; x<n; x++ )
+        {
+            float dx = x - c;
+            float dy = y - c;
+            float d  = sqrt( dx * dx + dy * dy );
+            bool  in = false;
+
+            if ( shape == "disc" )
+            {
+                in = d <= r;
+            }
+            else
+            if ( shape == "ring" )
+            {
+                in = ( d <= r ) && ( d >= r * 0.7f );
+            }
+            else
+            if ( shape == "polygon" )
+            {
+                // inside of all edges of hexagon.
+                in = true;
+
+                for( unsigned e=0; e<6; e++ )
+                {
+                    float a = pi / 3.f * e;
+
+                    if ( dx * cos( a ) + dy * sin( a ) > r * 0.866f )
+                    {
+                        in = false;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                return false;
+            }
+
+            ap.mask[ (size_t)y * n + x ] = in ? 255 : 0;
+        }
+    }
+
+    return true;
+}
+
+static Fl_RGB_Image* loadFlImage( const string &fpath )
+{
+    Fl_RGB_Image* img = NULL;
+
+    if ( hasEnding( fpath, ".jpg" ) || hasEnding( fpath, ".jpeg" ) )
+    {
+        img = new Fl_JPEG_Image( fpath.c_str() );
+    }
+    else
+    if ( hasEnding( fpath, ".png" ) )
+    {
+        img = new Fl_PNG_Image( fpath.c_str() );
+    }
+
+    if ( ( img != NULL ) && ( ( img->w() == 0 ) || ( img->h() == 0 )
+                              || ( img->d() == 0 ) ) )
+    {
+        delete img;
+        img = NULL;
+    }
+
+    return img;
+}
+
+// JPEG, PNG and 8 bit PPM, PGM of directory. Files named *mask* are
+// apertures, others are sources.
+static void loadImages( const string &path, vector<BenchSource> &srcs,
+                        vector<BenchAperture> &aps )
+{
+    DIR* dir = opendir( path.c_str() );
+
+    if ( dir == NULL )
+        return;
+
+    vector<string> names;
+    struct dirent* ent = NULL;
+
+    while( ( ent = readdir( dir ) ) != NULL )
+    {
+        names.push_back( ent->d_name );
+    }
+
+    closedir( dir );
+
+    // same order on any file system.
+    sort( names.begin(), names.end() );
+
+    for( size_t cnt=0; cnt<names.size(); cnt++ )
+    {
+        string fpath = path + "/" + names[cnt];
+        BenchSource img;
+
+        if ( rawimage::isRawFile( fpath.c_str() ) == true )
+        {
+            rawimage::Mapped m;
+
+            if ( rawimage::mapFile( fpath.c_str(), m ) == false )
+                continue;
+
+            const BokehRaster &r = m.raster;
+
+            if ( r.format == BOKEH_RASTER_U8 )
+            {
+                img.w = r.w;
+                img.h = r.h;
+                img.d = r.d;
+                img.pixels.resize( (size_t)r.w * r.h * r.d );
+
+                for( unsigned y=0; y<r.h; y++ )
+                {
+                    memcpy( &img.pixels[ (size_t)y * r.w * r.d ],
+                            (const uchar*)r.pixels + (ptrdiff_t)y * r.rowstride,
+                            (size_t)r.w * r.d );
+                }
+            }
+
+            rawimage::unmap( m );
+        }
+        else
+        {
+            Fl_RGB_Image* fl = loadFlImage( fpath );
+
+            if ( fl != NULL )
+            {
+                const uchar* p  = (const uchar*)fl->data()[0];
+                unsigned     ld = fl->ld() > 0 ? fl->ld() : fl->w() * fl->d();
+
+                img.w = fl->w();
+                img.h = fl->h();
+                img.d = fl->d();
+                img.pixels.resize( (size_t)img.w * img.h * img.d );
+
+                for( unsigned y=0; y<img.h; y++ )
+                {
+                    memcpy( &img.pixels[ (size_t)y * img.w * img.d ],
+                            p + (size_t)y * ld, (size_t)img.w * img.d );
+                }
+
+                delete fl;
+            }
+        }
+
+        if ( ( img.pixels.size() == 0 ) || ( ( img.d != 1 ) && ( img.d != 3 )
+                                             && ( img.d != 4 ) ) )
+            continue;
+
+        if ( names[cnt].find( "mask" ) != string::npos )
+        {
+            BenchAperture ap;
+
+            ap.name = names[cnt];
+            ap.w    = img.w;
+            ap.h    = img.h;
+            ap.size = max( img.w, img.h );
+            ap.mask.resize( (size_t)img.w * img.h );
+
+            // channels averaged, as mono mask of bokehtest.
+            for( size_t pos=0; pos<ap.mask.size(); pos++ )
+            {
+                unsigned sum = 0;
+
+                for( unsigned c=0; c<min( img.d, 3u ); c++ )
+                {
+                    sum += img.pixels[ pos * img.d + c ];
+                }
+
+                ap.mask[pos] = sum / min( img.d, 3u );
+            }
+
+            aps.push_back( ap );
+        }
+        else
+        {
+            img.name = names[cnt];
+            srcs.push_back( img );
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double nowMs()
+{
+    return chrono::duration<double, milli>(
+               chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Nearest rank of sorted samples.
+static double percentile( const vector<double> &sorted, double p )
+{
+    size_t rank = (size_t)ceil( p / 100.0 * sorted.size() );
+
+    rank = min( max( rank, (size_t)1 ), sorted.size() );
+
+    return sorted[ rank - 1 ];
+}
+
+static bool benchCase( const BenchEngine &eng, BenchCase &bc, unsigned threads,
+                       BenchResult &res )
+{
+    vector<double> times;
+
+    for( unsigned cnt=0; cnt<opt_warmup+opt_reps; cnt++ )
+    {
+        uchar* outptr = NULL;
+
+        double t0   = nowMs();
+        bool   retb = eng.run( bc, outptr );
+        double t1   = nowMs();
+
+        delete[] outptr;
+
+        if ( retb == false )
+            return false;
+
+        if ( cnt >= opt_warmup )
+        {
+            times.push_back( t1 - t0 );
+        }
+    }
+
+    sort( times.begin(), times.end() );
+
+    double sum = 0.0;
+
+    for( size_t cnt=0; cnt<times.size(); cnt++ )
+    {
+        sum += times[cnt];
+    }
+
+    res.engine   = eng.name;
+    res.source   = bc.src->name;
+    res.w        = bc.src->w;
+    res.h        = bc.src->h;
+    res.aperture = bc.ap->name;
+    res.size     = bc.ap->size;
+    res.taps     = BokehKernelTaps( bc.kernel );
+    res.threads  = threads;
+    res.reps     = times.size();
+    res.median   = percentile( times, 50.0 );
+    res.p95      = percentile( times, 95.0 );
+    res.minimum  = times.front();
+    res.mean     = sum / times.size();
+    res.mpps     = (double)bc.src->w * bc.src->h / 1000.0 / max( res.median, 1e-6 );
+
+    return true;
+}
+
+static string resultKey( const string &engine, const string &source,
+                         const string &aperture, unsigned size, unsigned threads )
+{
+    char tail[32] = {0};
+
+    snprintf( tail, 32, "|%u|%u", size, threads );
+
+    return engine + "|" + source + "|" + aperture + tail;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Quoted when having comma, quote or line break, quotes doubled.
+static string csvField( const string &s )
+{
+    if ( s.find_first_of( ",\"\r\n" ) == string::npos )
+        return s;
+
+    string out = "\"";
+
+    for( size_t cnt=0; cnt<s.size(); cnt++ )
+    {
+        if ( s[cnt] == '"' )
+        {
+            out += '"';
+        }
+
+        out += s[cnt];
+    }
+
+    return out + "\"";
+}
+
+// Fields of a CSV line, quoted ones unquoted. Empty fields are kept.
+static vector<string> csvSplit( const string &s )
+{
+    vector<string> toks( 1 );
+    bool           quoted = false;
+
+    for( size_t cnt=0; cnt<s.size(); cnt++ )
+    {
+        if ( quoted == true )
+        {
+            if ( s[cnt] != '"' )
+            {
+                toks.back() += s[cnt];
+            }
+            else
+            if ( ( cnt + 1 < s.size() ) && ( s[cnt + 1] == '"' ) )
+            {
+                toks.back() += '"';
+                cnt++;
+            }
+            else
+            {
+                quoted = false;
+            }
+        }
+        else
+        if ( s[cnt] == '"' )
+        {
+            quoted = true;
+        }
+        else
+        if ( s[cnt] == ',' )
+        {
+            toks.push_back( string() );
+        }
+        else
+        {
+            toks.back() += s[cnt];
+        }
+    }
+
+    return toks;
+}
+
+static const char* csv_header =
+    "engine,source,width,height,aperture,size,taps,threads,reps,"
+    "median_ms,p95_ms,min_ms,mean_ms,mpix_per_s";
+
+static bool writeCSV( const string &fpath, const vector<BenchResult> &results )
+{
+    FILE* fp = fopen( fpath.c_str(), "w" );
+
+    if ( fp == NULL )
+        return false;
+
+    fprintf( fp, "%s\n", csv_header );
+
+    for( size_t cnt=0; cnt<results.size(); cnt++ )
+    {
+        const BenchResult &r = results[cnt];
+
+        fprintf( fp, "%s,%s,%u,%u,%s,%u,%u,%u,%u,%.4f,%.4f,%.4f,%.4f,%.3f\n",
+                 csvField( r.engine ).c_str(), csvField( r.source ).c_str(), r.w, r.h,
+                 csvField( r.aperture ).c_str(), r.size, r.taps, r.threads, r.reps,
+                 r.median, r.p95, r.minimum, r.mean, r.mpps );
+    }
+
+    fclose( fp );
+
+    return true;
+}
+
+static string jsonString( const string &s )
+{
+    string out = "\"";
+
+    for( size_t cnt=0; cnt<s.size(); cnt++ )
+    {
+        if ( ( s[cnt] == '"' ) || ( s[cnt] == '\\' ) )
+        {
+            out += '\\';
+        }
+
+        out += s[cnt];
+    }
+
+    return out + "\"";
+}
+
+static bool writeJSON( const string &fpath, const vector<BenchResult> &results )
+{
+    FILE* fp = fopen( fpath.c_str(), "w" );
+
+    if ( fp == NULL )
+        return false;
+
+    fprintf( fp, "{\n" );
+    fprintf( fp, "  \"version\": \"%s\",\n", BENCH_VERSION_STR );
+    fprintf( fp, "  \"simd\": \"%s\",\n", GetBokehSIMD() );
+    fprintf( fp, "  \"cores\": %u,\n", max( 1u, thread::hardware_concurrency() ) );
+    fprintf( fp, "  \"warmup\": %u,\n", opt_warmup );
+    fprintf( fp, "  \"reps\": %u,\n", opt_reps );
+    fprintf( fp, "  \"results\": [\n" );
+
+    for( size_t cnt=0; cnt<results.size(); cnt++ )
+    {
+        const BenchResult &r = results[cnt];
+
+        fprintf( fp, "    { \"engine\": %s, \"source\": %s, \"width\": %u, \"height\": %u, "
+                     "\"aperture\": %s, \"size\": %u, \"taps\": %u, \"threads\": %u, "
+                     "\"reps\": %u, \"median_ms\": %.4f, \"p95_ms\": %.4f, "
+                     "\"min_ms\": %.4f, \"mean_ms\": %.4f, \"mpix_per_s\": %.3f }%s\n",
+                 jsonString( r.engine ).c_str(), jsonString( r.source ).c_str(),
+                 r.w, r.h, jsonString( r.aperture ).c_str(), r.size, r.taps,
+                 r.threads, r.reps, r.median, r.p95, r.minimum, r.mean, r.mpps,
+                 cnt + 1 < results.size() ? "," : "" );
+    }
+
+    fprintf( fp, "  ]\n}\n" );
+    fclose( fp );
+
+    return true;
+}
+
+// Medians of CSV written by earlier run, by key of case.
+static bool readBaseline( const string &fpath, map<string,double> &medians )
+{
+    FILE* fp = fopen( fpath.c_str(), "r" );
+
+    if ( fp == NULL )
+        return false;
+
+    char           line[1024] = {0};
+    vector<string> cols;
+
+    while( fgets( line, sizeof( line ), fp ) != NULL )
+    {
+        string s = line;
+
+        while( ( s.size() > 0 ) && ( ( s.back() == '\n' ) || ( s.back() == '\r' ) ) )
+        {
+            s.pop_back();
+        }
+
+        vector<string> toks = csvSplit( s );
+
+        if ( cols.size() == 0 )
+        {
+            cols = toks;
+            continue;
+        }
+
+        map<string,string> row;
+
+        for( size_t cnt=0; ( cnt<cols.size() ) && ( cnt<toks.size() ); cnt++ )
+        {
+            row[ cols[cnt] ] = toks[cnt];
+        }
+
+        if ( row.count( "median_ms" ) == 0 )
+            continue;
+
+        string key = resultKey( row[ "engine" ], row[ "source" ], row[ "aperture" ],
+                                atoi( row[ "size" ].c_str() ),
+                                atoi( row[ "threads" ].c_str() ) );
+
+        medians[ key ] = atof( row[ "median_ms" ].c_str() );
+    }
+
+    fclose( fp );
+
+    return medians.size() > 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool parseArgs( int argc, char** argv )
+{
+    for( int cnt=0; cnt<argc; cnt++ )
+    {
+        string strtmp = argv[ cnt ];
+
+        if ( cnt == 0 )
+        {
+            size_t fpos = strtmp.find_last_of( "\\/" );
+
+            file_me = fpos != string::npos ? strtmp.substr( fpos + 1 ) : strtmp;
+            continue;
+        }
+
+        bool hasnext = cnt + 1 < argc;
+
+        if ( ( strtmp == "--help" ) || ( strtmp == "-h" ) )
+        {
+            return false;
+        }
+        else
+        if ( ( ( strtmp == "--sizes" ) || ( strtmp == "-s" ) ) && hasnext )
+        {
+            vector<string> toks = splitList( argv[ ++cnt ] );
+
+            opt_sizes.clear();
+
+            for( size_t tcnt=0; tcnt<toks.size(); tcnt++ )
+            {
+                opt_sizes.push_back( atof( toks[tcnt].c_str() ) );
+            }
+        }
+        else
+        if ( ( ( strtmp == "--apertures" ) || ( strtmp == "-a" ) ) && hasnext )
+        {
+            vector<string> toks = splitList( argv[ ++cnt ] );
+
+            opt_apsizes.clear();
+
+            for( size_t tcnt=0; tcnt<toks.size(); tcnt++ )
+            {
+                opt_apsizes.push_back( atoi( toks[tcnt].c_str() ) );
+            }
+        }
+        else
+        if ( ( ( strtmp == "--shapes" ) || ( strtmp == "-p" ) ) && hasnext )
+        {
+            opt_shapes = splitList( argv[ ++cnt ] );
+        }
+        else
+        if ( ( ( strtmp == "--engines" ) || ( strtmp == "-e" ) ) && hasnext )
+        {
+            opt_engines = splitList( argv[ ++cnt ] );
+        }
+        else
+        if ( ( ( strtmp == "--threads" ) || ( strtmp == "-j" ) ) && hasnext )
+        {
+            vector<string> toks = splitList( argv[ ++cnt ] );
+
+            opt_threads.clear();
+
+            for( size_t tcnt=0; tcnt<toks.size(); tcnt++ )
+            {
+                opt_threads.push_back( atoi( toks[tcnt].c_str() ) );
+            }
+        }
+        else
+        if ( ( ( strtmp == "--warmup" ) || ( strtmp == "-w" ) ) && hasnext )
+        {
+            opt_warmup = atoi( argv[ ++cnt ] );
+        }
+        else
+        if ( ( ( strtmp == "--reps" ) || ( strtmp == "-r" ) ) && hasnext )
+        {
+            opt_reps = max( 1, atoi( argv[ ++cnt ] ) );
+        }
+        else
+        if ( ( ( strtmp == "--images" ) || ( strtmp == "-i" ) ) && hasnext )
+        {
+            path_images = argv[ ++cnt ];
+        }
+        else
+        if ( ( strtmp == "--nosynth" ) || ( strtmp == "-n" ) )
+        {
+            opt_synth = false;
+        }
+        else
+        if ( ( strtmp == "--json" ) && hasnext )
+        {
+            file_json = argv[ ++cnt ];
+        }
+        else
+        if ( ( ( strtmp == "--csv" ) || ( strtmp == "-c" ) ) && hasnext )
+        {
+            file_csv = argv[ ++cnt ];
+        }
+        else
+        if ( ( ( strtmp == "--baseline" ) || ( strtmp == "-b" ) ) && hasnext )
+        {
+            file_base = argv[ ++cnt ];
+        }
+        else
+        if ( ( ( strtmp == "--threshold" ) || ( strtmp == "-T" ) ) && hasnext )
+        {
+            opt_threshold = atof( argv[ ++cnt ] );
+        }
+        else
+        if ( ( ( strtmp == "--budget" ) || ( strtmp == "-B" ) ) && hasnext )
+        {
+            opt_budget = atof( argv[ ++cnt ] );
+        }
+        else
+        {
+            printf( "- Unknown option : %s\n", strtmp.c_str() );
+            return false;
+        }
+    }
+
+    if ( opt_sizes.size() == 0 )
+    {
+        opt_sizes.push_back( 1.f );
+        opt_sizes.push_back( 4.f );
+    }
+
+    if ( opt_apsizes.size() == 0 )
+    {
+        opt_apsizes.push_back( 8 );
+        opt_apsizes.push_back( 32 );
+        opt_apsizes.push_back( 64 );
+    }
+
+    if ( opt_shapes.size() == 0 )
+    {
+        opt_shapes = splitList( "disc,polygon,ring" );
+    }
+
+    // 1, 2, 4 .. and all of cores.
+    if ( opt_threads.size() == 0 )
+    {
+        unsigned cores = max( 1u, thread::hardware_concurrency() );
+
+        for( unsigned n=1; n<cores; n*=2 )
+        {
+            opt_threads.push_back( n );
+        }
+
+        opt_threads.push_back( cores );
+    }
+
+    return true;
+}
+
+void printUsage()
+{
+    printf( "  usage:\n" );
+    printf( "      %s (option)\n", file_me.c_str() );
+    printf( "\n" );
+    printf( "  option:\n" );
+    printf( "      --sizes | -s L      : synthetic sources in megapixels, 1 to 100 ( 1,4 ).\n" );
+    printf( "      --apertures | -a L  : aperture sizes in pixels, 8 to 256 ( 8,32,64 ).\n" );
+    printf( "      --shapes | -p L     : disc, polygon, ring ( all ).\n" );
+    printf( "      --engines | -e L    : engines to run ( all ) of :\n" );
+    printf( "                            " );
+
+    for( unsigned cnt=0; cnt<bench_engines_count; cnt++ )
+    {
+        printf( "%s%s", bench_engines[cnt].name,
+                cnt + 1 < bench_engines_count ? ", " : "\n" );
+    }
+
+    printf( "      --threads | -j L    : thread counts ( 1, 2, 4 .. cores ).\n" );
+    printf( "      --warmup | -w N     : runs not measured before each case ( 1 ).\n" );
+    printf( "      --reps | -r N       : measured runs of each case ( 5 ).\n" );
+    printf( "      --images | -i D     : JPEG, PNG, PPM images of directory ( testimgs ),\n" );
+    printf( "                            files named *mask* are apertures.\n" );
+    printf( "      --nosynth | -n      : images of directory only.\n" );
+    printf( "      --budget | -B F     : skips engines of per tap cost over F operations\n" );
+    printf( "                            ( taps x pixels x 3, default 5e10 ).\n" );
+    printf( "      --json F            : writes results to JSON file F.\n" );
+    printf( "      --csv | -c F        : writes results to CSV file F.\n" );
+    printf( "      --baseline | -b F   : compares medians to CSV of earlier run,\n" );
+    printf( "      --threshold | -T P  : slower over P %% is regression ( 10 ), exit code 2.\n" );
+    printf( "\n" );
+    printf( "  L is comma separated list.\n" );
+    printf( "\n" );
+}
+
+static bool engineSelected( const char* name )
+{
+    if ( opt_engines.size() == 0 )
+        return true;
+
+    return find( opt_engines.begin(), opt_engines.end(), string( name ) )
+           != opt_engines.end();
+}
+
+int main( int argc, char** argv )
+{
+    bool parsed = parseArgs( argc, argv );
+
+    printf( "%s : libbokeh benchmark, ver %s\n\n", file_me.c_str(), BENCH_VERSION_STR );
+
+    if ( parsed == false )
+    {
+        printUsage();
+        return -1;
+    }
+
+    vector<BenchSource>   srcs;
+    vector<BenchAperture> aps;
+
+    if ( opt_synth == true )
+    {
+        for( size_t cnt=0; cnt<opt_sizes.size(); cnt++ )
+        {
+            BenchSource src;
+
+            makeSynthSource( opt_sizes[cnt], src );
+            srcs.push_back( src );
+        }
+    }
+
+    for( size_t cnt=0; cnt<opt_shapes.size(); cnt++ )
+    {
+        for( size_t scnt=0; scnt<opt_apsizes.size(); scnt++ )
+        {
+            BenchAperture ap;
+
+            if ( makeAperture( opt_shapes[cnt], opt_apsizes[scnt], ap ) == true )
+            {
+                aps.push_back( ap );
+            }
+            else
+            {
+                printf( "- Unknown shape %s, skipped.\n", opt_shapes[cnt].c_str() );
+                break;
+            }
+        }
+    }
+
+    loadImages( path_images, srcs, aps );
+
+    printf( "- SIMD : %s, cores : %u, %u sources, %u apertures, %u warm-up + %u runs\n",
+            GetBokehSIMD(), max( 1u, thread::hardware_concurrency() ),
+            (unsigned)srcs.size(), (unsigned)aps.size(), opt_warmup, opt_reps );
+    printf( "  %-10s %-22s %-16s %5s %3s %10s %10s %9s\n",
+            "engine", "source", "aperture", "taps", "thr", "median ms", "p95 ms", "MP/s" );
+    fflush( stdout );
+
+    vector<BenchResult> results;
+
+    for( size_t scnt=0; scnt<srcs.size(); scnt++ )
+    {
+        for( size_t acnt=0; acnt<aps.size(); acnt++ )
+        {
+            const BenchSource   &src = srcs[scnt];
+            const BenchAperture &ap  = aps[acnt];
+
+            if ( ( src.w < ap.w ) || ( src.h < ap.h ) )
+                continue;
+
+            BenchCase bc;
+
+            bc.src     = &src;
+            bc.ap      = &ap;
+            bc.kernel  = CompileBokehKernel( &ap.mask[0], ap.w, ap.h );
+            bc.context = NULL;
+
+            if ( bc.kernel == NULL )
+                continue;
+
+            double cost = (double)BokehKernelTaps( bc.kernel ) * src.w * src.h * 3;
+
+            for( size_t tcnt=0; tcnt<opt_threads.size(); tcnt++ )
+            {
+                SetBokehThreads( opt_threads[tcnt] );
+
+                for( unsigned ecnt=0; ecnt<bench_engines_count; ecnt++ )
+                {
+                    const BenchEngine &eng = bench_engines[ecnt];
+
+                    if ( engineSelected( eng.name ) == false )
+                        continue;
+
+                    if ( ( eng.direct == true ) && ( cost > opt_budget ) )
+                        continue;
+
+                    // buffers of engines are prepared once, out of timing.
+                    if ( ( eng.run == runLegacy ) && ( bc.canvas.size() == 0 ) )
+                    {
+                        bc.canvas.assign( (size_t)src.w * src.h, 0 );
+
+                        for( unsigned y=0; y<ap.h; y++ )
+                        {
+                            memcpy( &bc.canvas[ (size_t)( src.h - ap.h + y ) * src.w ],
+                                    &ap.mask[ (size_t)y * ap.w ], ap.w );
+                        }
+                    }
+
+                    if ( ( ( eng.run == runContext ) || ( eng.run == runStream ) )
+                         && ( bc.output.size() == 0 ) )
+                    {
+                        bc.output.resize( (size_t)src.w * src.h * 3 );
+                    }
+
+                    if ( ( eng.run == runContext ) && ( bc.context == NULL ) )
+                    {
+                        BokehConfig config;
+
+                        InitBokehConfig( config );
+
+                        config.anchorx = 0;
+                        config.anchory = ap.h;
+                        bc.context     = CreateBokehContext( config, &ap.mask[0],
+                                                             ap.w, ap.h );
+
+                        if ( bc.context == NULL )
+                            continue;
+                    }
+
+                    BenchResult res;
+
+                    if ( benchCase( eng, bc, opt_threads[tcnt], res ) == false )
+                    {
+                        printf( "  %-10s %-22s %-16s : failure.\n",
+                                eng.name, src.name.c_str(), ap.name.c_str() );
+                        continue;
+                    }
+
+                    char apname[64] = {0};
+
+                    snprintf( apname, 64, "%s %ux%u", ap.name.c_str(), ap.w, ap.h );
+
+                    printf( "  %-10s %-22s %-16s %5u %3u %10.2f %10.2f %9.2f\n",
+                            res.engine.c_str(), res.source.c_str(), apname,
+                            res.taps, res.threads, res.median, res.p95, res.mpps );
+                    fflush( stdout );
+
+                    results.push_back( res );
+                }
+            }
+
+            DiscardBokehContext( bc.context );
+            DiscardBokehKernel( bc.kernel );
+        }
+    }
+
+    if ( ( file_csv.size() > 0 ) && ( writeCSV( file_csv, results ) == false ) )
+    {
+        printf( "- Failed to write %s\n", file_csv.c_str() );
+    }
+
+    if ( ( file_json.size() > 0 ) && ( writeJSON( file_json, results ) == false ) )
+    {
+        printf( "- Failed to write %s\n", file_json.c_str() );
+    }
+
+    if ( file_base.size() == 0 )
+        return 0;
+
+    map<string,double> base;
+
+    if ( readBaseline( file_base, base ) == false )
+    {
+        printf( "- Failed to read baseline %s\n", file_base.c_str() );
+        return -1;
+    }
+
+    unsigned compared    = 0;
+    unsigned regressions = 0;
+
+    printf( "- Baseline %s, threshold %.1f %% :\n", file_base.c_str(), opt_threshold );
+
+    for( size_t cnt=0; cnt<results.size(); cnt++ )
+    {
+        const BenchResult &r = results[cnt];
+        map<string,double>::const_iterator it;
+
+        it = base.find( resultKey( r.engine, r.source, r.aperture, r.size, r.threads ) );
+
+        if ( ( it == base.end() ) || ( it->second <= 0.0 ) )
+            continue;
+
+        double change = ( r.median / it->second - 1.0 ) * 100.0;
+
+        compared++;
+
+        if ( change > opt_threshold )
+        {
+            regressions++;
+
+            printf( "  REGRESSION %-10s %-22s %s %u, %u threads : %.2f -> %.2f ms ( %+.1f %% )\n",
+                    r.engine.c_str(), r.source.c_str(), r.aperture.c_str(), r.size,
+                    r.threads, it->second, r.median, change );
+        }
+    }
+
+    printf( "  %u of %u cases compared, %u regressions.\n",
+            compared, (unsigned)results.size(), regressions );
+    fflush( stdout );
+
+    return regressions > 0 ? 2 : 0;
+}
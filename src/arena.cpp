@@ -0,0 +1,270 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__linux__)
+    #include <sys/mman.h>
+#endif /// of __linux__
+
+#include "arena.h"
+#include "perf.h"
+
+#ifndef nullptr
+    #define nullptr     NULL
+#endif
+
+using namespace std;
+
+namespace
+{
+    const size_t kAlign     = 64;
+    const size_t kHugePage  = 2 * 1024 * 1024;
+
+    // kept just before each buffer, 64 bytes aligned too.
+    struct Header
+    {
+        arena::Arena*   owner;
+        void*           base;
+        size_t          cls;
+        size_t          pad[5];
+    };
+
+    // rounds up to 3 significant bits, as 8, 9, .. 15, 16, 18, .. 30, 32 ..
+    size_t sizeClass( size_t bytes )
+    {
+        size_t cls = max( bytes, (size_t)256 );
+        size_t top = 1;
+
+        while( ( top << 1 ) <= cls )
+        {
+            top <<= 1;
+        }
+
+        size_t step = max( top / 8, (size_t)1 );
+
+        return ( cls + step - 1 ) / step * step;
+    }
+
+    Header* headerOf( void* ptr )
+    {
+        return (Header*)ptr - 1;
+    }
+
+    thread_local arena::Arena* tls_current = nullptr;
+
+    class __ARENA
+    {
+        public:
+            __ARENA()
+            {
+                const char* env = getenv( "BOKEH_HUGEPAGES" );
+
+                if ( ( env != nullptr ) && ( atoi( env ) > 0 ) )
+                {
+                    procarena.setHugePages( true );
+                }
+            }
+
+        public:
+            arena::Arena    procarena;
+    };
+
+    __ARENA arenas;
+}
+
+namespace arena {
+
+Arena::Arena()
+ : limit( (size_t)1024 * 1024 * 1024 ),
+   huge( false )
+{
+    memset( &st, 0, sizeof( Stats ) );
+
+    const char* env = getenv( "BOKEH_ARENA_MB" );
+
+    if ( env != nullptr )
+    {
+        limit = (size_t)atoi( env ) * 1024 * 1024;
+    }
+}
+
+Arena::~Arena()
+{
+    trim();
+}
+
+void* Arena::acquire( size_t bytes )
+{
+    size_t cls = sizeClass( bytes );
+
+    {
+        lock_guard<mutex> lock( mtx );
+
+        st.requests++;
+
+        map< size_t, vector<void*> >::iterator it = freelists.find( cls );
+
+        if ( ( it != freelists.end() ) && ( it->second.size() > 0 ) )
+        {
+            void* ptr = it->second.back();
+            it->second.pop_back();
+
+            st.reuses++;
+            st.cached -= cls;
+            st.inuse  += cls;
+            st.peak    = max( st.peak, st.inuse );
+
+            return ptr;
+        }
+    }
+
+    // huge pages need 2 MB aligned range of 2 MB multiples.
+    bool   usehuge = ( huge == true ) && ( cls >= kHugePage );
+    size_t align   = usehuge ? kHugePage : kAlign;
+    void*  base    = malloc( cls + align + sizeof( Header ) );
+
+    if ( base == nullptr )
+        return nullptr;
+
+    size_t addr = (size_t)base + sizeof( Header );
+    addr = ( addr + align - 1 ) & ~( align - 1 );
+
+    void*   ptr = (void*)addr;
+    Header* hdr = headerOf( ptr );
+
+    hdr->owner = this;
+    hdr->base  = base;
+    hdr->cls   = cls;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if ( usehuge == true )
+    {
+        if ( madvise( ptr, cls & ~( kHugePage - 1 ), MADV_HUGEPAGE ) != 0 )
+        {
+            usehuge = false;
+        }
+    }
+#else
+    usehuge = false;
+#endif /// of __linux__
+
+    perf::addBytes( cls );
+
+    lock_guard<mutex> lock( mtx );
+
+    st.allocs++;
+    st.inuse += cls;
+    st.peak   = max( st.peak, st.inuse );
+
+    if ( usehuge == true )
+    {
+        st.huge += cls & ~( kHugePage - 1 );
+    }
+
+    return ptr;
+}
+
+void Arena::recycle( void* ptr, size_t cls )
+{
+    {
+        lock_guard<mutex> lock( mtx );
+
+        st.inuse -= cls;
+
+        if ( st.cached + cls <= limit )
+        {
+            freelists[ cls ].push_back( ptr );
+            st.cached += cls;
+
+            return;
+        }
+    }
+
+    free( headerOf( ptr )->base );
+}
+
+void Arena::trim()
+{
+    lock_guard<mutex> lock( mtx );
+
+    map< size_t, vector<void*> >::iterator it = freelists.begin();
+
+    for( ; it != freelists.end(); ++it )
+    {
+        for( size_t cnt=0; cnt<it->second.size(); cnt++ )
+        {
+            free( headerOf( it->second[cnt] )->base );
+        }
+    }
+
+    freelists.clear();
+    st.cached = 0;
+}
+
+void Arena::setCacheLimit( size_t bytes )
+{
+    limit = bytes;
+
+    if ( st.cached > limit )
+    {
+        trim();
+    }
+}
+
+void Arena::setHugePages( bool enable )
+{
+    huge = enable;
+}
+
+Stats Arena::stats()
+{
+    lock_guard<mutex> lock( mtx );
+
+    return st;
+}
+
+void Arena::resetStats()
+{
+    lock_guard<mutex> lock( mtx );
+
+    st.requests = 0;
+    st.allocs   = 0;
+    st.reuses   = 0;
+    st.peak     = st.inuse;
+}
+
+Arena& global()
+{
+    return arenas.procarena;
+}
+
+Arena& current()
+{
+    if ( tls_current != nullptr )
+        return *tls_current;
+
+    return arenas.procarena;
+}
+
+void release( void* ptr )
+{
+    if ( ptr == nullptr )
+        return;
+
+    Header* hdr = headerOf( ptr );
+
+    hdr->owner->recycle( ptr, hdr->cls );
+}
+
+Scope::Scope( Arena &a )
+ : prev( tls_current )
+{
+    tls_current = &a;
+}
+
+Scope::~Scope()
+{
+    tls_current = prev;
+}
+
+}; /// of namespace arena
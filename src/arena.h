@@ -0,0 +1,85 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <cstddef>
+#include <map>
+#include <vector>
+#include <mutex>
+
+/// Recycling allocator of pixel buffers of libbokeh.
+/// Released buffers are kept in free lists by size class, and given
+/// again to next request of same class, so temporary images of each
+/// frame do not go to malloc and page faults again.
+/// Size classes are rounded up by 1/8 steps, wasting 12.5% at most.
+/// Environment variable BOKEH_HUGEPAGES=1 backs buffers over 2 MB by
+/// transparent huge pages ( Linux ), BOKEH_ARENA_MB limits bytes kept
+/// in free lists of each arena ( default 1024 ).
+namespace arena {
+
+struct Stats
+{
+    unsigned long long  requests;   /// count of acquire().
+    unsigned long long  allocs;     /// requests allocated from system.
+    unsigned long long  reuses;     /// requests given from free lists.
+    size_t              inuse;      /// bytes of buffers given out now.
+    size_t              peak;       /// max of inuse.
+    size_t              cached;     /// bytes kept in free lists.
+    size_t              huge;       /// bytes advised for huge pages.
+};
+
+class Arena
+{
+    public:
+        Arena();
+        /// Frees cached buffers, all buffers must be released before.
+        ~Arena();
+
+    public:
+        /// 64 bytes aligned buffer of bytes at least, nullptr on failure.
+        void* acquire( size_t bytes );
+        /// Frees all of cached buffers to system.
+        void  trim();
+        /// 0 keeps nothing in free lists.
+        void  setCacheLimit( size_t bytes );
+        void  setHugePages( bool enable );
+        bool  hugePages() const { return huge; }
+        Stats stats();
+        /// Counters to zero, peak to bytes in use now.
+        void  resetStats();
+
+    private:
+        Arena( const Arena& );
+        Arena& operator = ( const Arena& );
+
+        friend void release( void* ptr );
+        void  recycle( void* base, size_t cls );
+
+    private:
+        std::mutex                              mtx;
+        std::map< size_t, std::vector<void*> >  freelists;
+        size_t                                  limit;
+        bool                                    huge;
+        Stats                                   st;
+};
+
+/// Arena of process, used unless other one is current.
+Arena& global();
+/// Arena of calling thread.
+Arena& current();
+/// Buffer of any arena, nullptr is ignored.
+void release( void* ptr );
+
+/// Makes an arena current for calling thread, until end of scope.
+class Scope
+{
+    public:
+        Scope( Arena &a );
+        ~Scope();
+
+    private:
+        Arena*  prev;
+};
+
+}; /// of namespace arena
+
+#endif /// of __ARENA_H__
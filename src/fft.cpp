@@ -0,0 +1,467 @@
+#include <cmath>
+#include <algorithm>
+
+#include "fft.h"
+#include "pool.h"
+
+using namespace std;
+
+namespace fft {
+
+////////////////////////////////////////////////////////////////////////////////
+
+static cpx twiddle( unsigned long long k, unsigned long long n )
+{
+    double phase = -2.0 * M_PI * (double)k / (double)n;
+
+    return cpx( (float)cos( phase ), (float)sin( phase ) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Plan::Plan( unsigned _n )
+ : n( _n ),
+   bsplan( NULL )
+{
+    if ( n <= 1 )
+        return;
+
+    unsigned rem = n;
+
+    while( ( rem % 2 ) == 0 ) rem /= 2;
+    while( ( rem % 3 ) == 0 ) rem /= 3;
+    while( ( rem % 5 ) == 0 ) rem /= 5;
+
+    if ( rem == 1 )
+    {
+        // Mixed radix, as pairs of ( radix, remained length ).
+        // radix 4 first, it is cheapest per point.
+        const unsigned radixes[] = { 4, 2, 3, 5 };
+
+        rem = n;
+
+        for( unsigned cnt=0; cnt<4; cnt++ )
+        {
+            unsigned p = radixes[cnt];
+
+            while( ( rem % p ) == 0 )
+            {
+                rem /= p;
+                factors.push_back( p );
+                factors.push_back( rem );
+            }
+        }
+
+        twiddles.resize( n );
+
+        for( unsigned cnt=0; cnt<n; cnt++ )
+        {
+            twiddles[cnt] = twiddle( cnt, n );
+        }
+    }
+    else
+    {
+        // Bluestein : length n goes to circular convolution of length m.
+        unsigned m = 1;
+
+        while( m < ( 2 * n - 1 ) ) m <<= 1;
+
+        bsplan = new Plan( m );
+
+        chirp.resize( n );
+        chirpfft.resize( m );
+
+        for( unsigned cnt=0; cnt<n; cnt++ )
+        {
+            // exp( -i pi k^2 / n ), k^2 reduced to avoid precision loss.
+            unsigned long long ksq = (unsigned long long)cnt * cnt;
+            chirp[cnt] = twiddle( ksq % ( 2ULL * n ), 2ULL * n );
+        }
+
+        vector<cpx> b( m, cpx( 0.f ) );
+
+        b[0] = conj( chirp[0] );
+
+        for( unsigned cnt=1; cnt<n; cnt++ )
+        {
+            b[cnt]     = conj( chirp[cnt] );
+            b[m - cnt] = conj( chirp[cnt] );
+        }
+
+        bsplan->forward( &b[0], &chirpfft[0], NULL );
+    }
+}
+
+Plan::~Plan()
+{
+    if ( bsplan != NULL )
+    {
+        delete bsplan;
+    }
+}
+
+unsigned Plan::scratchSize() const
+{
+    unsigned sz = n;
+
+    if ( bsplan != NULL )
+    {
+        // chirped input, its spectrum and inner inverse scratch.
+        sz += bsplan->size() * 3;
+    }
+
+    return sz;
+}
+
+void Plan::forward( const cpx* in, cpx* out, cpx* scratch ) const
+{
+    if ( n <= 1 )
+    {
+        if ( n == 1 )
+            out[0] = in[0];
+        return;
+    }
+
+    if ( bsplan == NULL )
+    {
+        work( out, in, 1, &factors[0] );
+        return;
+    }
+
+    unsigned m  = bsplan->size();
+    cpx*     ba = scratch;
+    cpx*     bf = scratch + m;
+
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        ba[cnt] = in[cnt] * chirp[cnt];
+    }
+
+    std::fill( ba + n, ba + m, cpx( 0.f ) );
+
+    bsplan->forward( ba, bf, NULL );
+
+    for( unsigned cnt=0; cnt<m; cnt++ )
+    {
+        bf[cnt] *= chirpfft[cnt];
+    }
+
+    bsplan->inverse( bf, ba, scratch + m * 2 );
+
+    float scale = 1.f / (float)m;
+
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        out[cnt] = ba[cnt] * chirp[cnt] * scale;
+    }
+}
+
+void Plan::inverse( const cpx* in, cpx* out, cpx* scratch ) const
+{
+    // inverse( x ) = conj( forward( conj( x ) ) )
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        scratch[cnt] = conj( in[cnt] );
+    }
+
+    forward( scratch, out, scratch + n );
+
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        out[cnt] = conj( out[cnt] );
+    }
+}
+
+void Plan::work( cpx* out, const cpx* in, unsigned fstride,
+                 const unsigned* facts ) const
+{
+    const unsigned p   = facts[0];
+    const unsigned m   = facts[1];
+    cpx*           beg = out;
+    cpx*           end = out + p * m;
+
+    if ( m == 1 )
+    {
+        do
+        {
+            *out = *in;
+            in += fstride;
+        }
+        while( ++out != end );
+    }
+    else
+    {
+        do
+        {
+            work( out, in, fstride * p, facts + 2 );
+            in += fstride;
+        }
+        while( ( out += m ) != end );
+    }
+
+    switch( p )
+    {
+        case 2: bfly2( beg, fstride, m ); break;
+        case 3: bfly3( beg, fstride, m ); break;
+        case 4: bfly4( beg, fstride, m ); break;
+        default: bflyGeneric( beg, fstride, m, p ); break;
+    }
+}
+
+void Plan::bfly2( cpx* out, unsigned fstride, unsigned m ) const
+{
+    cpx*       out2 = out + m;
+    const cpx* tw   = &twiddles[0];
+
+    for( unsigned cnt=0; cnt<m; cnt++ )
+    {
+        cpx t = out2[cnt] * *tw;
+        tw += fstride;
+        out2[cnt] = out[cnt] - t;
+        out[cnt] += t;
+    }
+}
+
+void Plan::bfly3( cpx* out, unsigned fstride, unsigned m ) const
+{
+    const unsigned m2   = m * 2;
+    const cpx*     tw1  = &twiddles[0];
+    const cpx*     tw2  = &twiddles[0];
+    const float    epi3 = twiddles[ fstride * m ].imag();
+
+    for( unsigned cnt=0; cnt<m; cnt++, out++ )
+    {
+        cpx s1 = out[m]  * *tw1;
+        cpx s2 = out[m2] * *tw2;
+        cpx s3 = s1 + s2;
+        cpx s0 = ( s1 - s2 ) * epi3;
+
+        tw1 += fstride;
+        tw2 += fstride * 2;
+
+        out[m] = out[0] - s3 * 0.5f;
+        out[0] += s3;
+
+        out[m2] = cpx( out[m].real() + s0.imag(), out[m].imag() - s0.real() );
+        out[m]  = cpx( out[m].real() - s0.imag(), out[m].imag() + s0.real() );
+    }
+}
+
+void Plan::bfly4( cpx* out, unsigned fstride, unsigned m ) const
+{
+    const unsigned m2  = m * 2;
+    const unsigned m3  = m * 3;
+    const cpx*     tw1 = &twiddles[0];
+    const cpx*     tw2 = &twiddles[0];
+    const cpx*     tw3 = &twiddles[0];
+
+    for( unsigned cnt=0; cnt<m; cnt++, out++ )
+    {
+        cpx s0 = out[m]  * *tw1;
+        cpx s1 = out[m2] * *tw2;
+        cpx s2 = out[m3] * *tw3;
+        cpx s5 = out[0] - s1;
+
+        out[0] += s1;
+
+        cpx s3 = s0 + s2;
+        cpx s4 = s0 - s2;
+
+        out[m2] = out[0] - s3;
+        out[0] += s3;
+
+        tw1 += fstride;
+        tw2 += fstride * 2;
+        tw3 += fstride * 3;
+
+        out[m]  = cpx( s5.real() + s4.imag(), s5.imag() - s4.real() );
+        out[m3] = cpx( s5.real() - s4.imag(), s5.imag() + s4.real() );
+    }
+}
+
+void Plan::bflyGeneric( cpx* out, unsigned fstride, unsigned m,
+                        unsigned p ) const
+{
+    // only radix 5 comes here.
+    cpx scratch[5];
+
+    for( unsigned u=0; u<m; u++ )
+    {
+        unsigned k = u;
+
+        for( unsigned q1=0; q1<p; q1++, k+=m )
+        {
+            scratch[q1] = out[k];
+        }
+
+        k = u;
+
+        for( unsigned q1=0; q1<p; q1++, k+=m )
+        {
+            unsigned twidx = 0;
+
+            out[k] = scratch[0];
+
+            for( unsigned q=1; q<p; q++ )
+            {
+                twidx += fstride * k;
+
+                if ( twidx >= n )
+                    twidx -= n;
+
+                out[k] += scratch[q] * twiddles[twidx];
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+RealPlan2D::RealPlan2D( unsigned _w, unsigned _h )
+ : w( _w ),
+   h( _h ),
+   rowplan( _w ),
+   colplan( _h )
+{
+}
+
+void RealPlan2D::forward( const float* src, unsigned rowstride, cpx* spec ) const
+{
+    const unsigned cw    = spectrumWidth();
+    const unsigned pairs = ( h + 1 ) / 2;
+
+    // Two real rows are transformed at once as real and imaginary part,
+    // then separated by hermitian symmetry.
+    // Scratch is allocated per chunk of rows, cheap against transforms.
+    pool::parallelFor( pairs, (double)w * 20,
+                       [&]( unsigned p0, unsigned p1, unsigned )
+    {
+        vector<cpx> zin( w );
+        vector<cpx> zout( w );
+        vector<cpx> scr( rowplan.scratchSize() );
+
+        for( unsigned pr=p0; pr<p1; pr++ )
+        {
+            unsigned     y0   = pr * 2;
+            bool         has1 = ( y0 + 1 ) < h;
+            const float* r0   = &src[ (size_t)y0 * rowstride ];
+            const float* r1   = r0 + rowstride;
+
+            for( unsigned x=0; x<w; x++ )
+            {
+                zin[x] = cpx( r0[x], has1 ? r1[x] : 0.f );
+            }
+
+            rowplan.forward( &zin[0], &zout[0], &scr[0] );
+
+            cpx* s0 = &spec[ (size_t)y0 * cw ];
+            cpx* s1 = s0 + cw;
+
+            for( unsigned k=0; k<cw; k++ )
+            {
+                cpx zk  = zout[k];
+                cpx znk = conj( zout[ ( w - k ) % w ] );
+
+                s0[k] = ( zk + znk ) * 0.5f;
+
+                if ( has1 == true )
+                {
+                    s1[k] = ( zk - znk ) * cpx( 0.f, -0.5f );
+                }
+            }
+        }
+    } );
+
+    columns( spec, false );
+}
+
+void RealPlan2D::inverse( cpx* spec, float* dst, unsigned rowstride ) const
+{
+    const unsigned cw    = spectrumWidth();
+    const unsigned pairs = ( h + 1 ) / 2;
+    const float    scale = 1.f / ( (float)w * (float)h );
+
+    columns( spec, true );
+
+    pool::parallelFor( pairs, (double)w * 20,
+                       [&]( unsigned p0, unsigned p1, unsigned )
+    {
+        vector<cpx> zin( w );
+        vector<cpx> zout( w );
+        vector<cpx> scr( rowplan.scratchSize() );
+
+        for( unsigned pr=p0; pr<p1; pr++ )
+        {
+            unsigned   y0   = pr * 2;
+            bool       has1 = ( y0 + 1 ) < h;
+            const cpx* s0   = &spec[ (size_t)y0 * cw ];
+            const cpx* s1   = s0 + cw;
+
+            for( unsigned k=0; k<w; k++ )
+            {
+                cpx a = ( k < cw ) ? s0[k] : conj( s0[ w - k ] );
+                cpx b = 0.f;
+
+                if ( has1 == true )
+                {
+                    b = ( k < cw ) ? s1[k] : conj( s1[ w - k ] );
+                }
+
+                // a + i * b
+                zin[k] = cpx( a.real() - b.imag(), a.imag() + b.real() );
+            }
+
+            rowplan.inverse( &zin[0], &zout[0], &scr[0] );
+
+            float* r0 = &dst[ (size_t)y0 * rowstride ];
+            float* r1 = r0 + rowstride;
+
+            for( unsigned x=0; x<w; x++ )
+            {
+                r0[x] = zout[x].real() * scale;
+
+                if ( has1 == true )
+                {
+                    r1[x] = zout[x].imag() * scale;
+                }
+            }
+        }
+    } );
+}
+
+void RealPlan2D::columns( cpx* spec, bool inv ) const
+{
+    const unsigned cw = spectrumWidth();
+
+    pool::parallelFor( cw, (double)h * 10,
+                       [&]( unsigned k0, unsigned k1, unsigned )
+    {
+        vector<cpx> cin( h );
+        vector<cpx> cbuf( h );
+        vector<cpx> scr( colplan.scratchSize() );
+
+        for( unsigned k=k0; k<k1; k++ )
+        {
+            for( unsigned y=0; y<h; y++ )
+            {
+                cin[y] = spec[ (size_t)y * cw + k ];
+            }
+
+            if ( inv == true )
+            {
+                colplan.inverse( &cin[0], &cbuf[0], &scr[0] );
+            }
+            else
+            {
+                colplan.forward( &cin[0], &cbuf[0], &scr[0] );
+            }
+
+            for( unsigned y=0; y<h; y++ )
+            {
+                spec[ (size_t)y * cw + k ] = cbuf[y];
+            }
+        }
+    } );
+}
+
+}; /// of namespace fft
@@ -0,0 +1,83 @@
+#ifndef __FFT_H__
+#define __FFT_H__
+
+#include <complex>
+#include <vector>
+
+namespace fft {
+
+typedef std::complex<float> cpx;
+
+/// 1D complex FFT plan of any length.
+/// Lengths with only 2, 3 and 5 factors are done by mixed radix,
+/// others are done by Bluestein's chirp-z over a power of 2 plan.
+/// A plan is read-only after construction, so it can be shared by
+/// threads as long as each thread uses its own scratch.
+class Plan
+{
+    public:
+        Plan( unsigned n );
+        ~Plan();
+
+    public:
+        unsigned size() const { return n; }
+        /// required count of cpx for scratch of forward() and inverse().
+        unsigned scratchSize() const;
+        /// out[k] = sum( in[j] * exp( -2 pi i j k / n ) ), in != out.
+        void forward( const cpx* in, cpx* out, cpx* scratch ) const;
+        /// not normalized, in != out.
+        void inverse( const cpx* in, cpx* out, cpx* scratch ) const;
+
+    private:
+        Plan( const Plan& );
+        Plan& operator = ( const Plan& );
+
+        void work( cpx* out, const cpx* in, unsigned fstride,
+                   const unsigned* factors ) const;
+        void bfly2( cpx* out, unsigned fstride, unsigned m ) const;
+        void bfly3( cpx* out, unsigned fstride, unsigned m ) const;
+        void bfly4( cpx* out, unsigned fstride, unsigned m ) const;
+        void bflyGeneric( cpx* out, unsigned fstride, unsigned m,
+                          unsigned p ) const;
+
+    private:
+        unsigned            n;
+        std::vector<unsigned> factors;
+        std::vector<cpx>    twiddles;
+        // Bluestein
+        Plan*               bsplan;
+        std::vector<cpx>    chirp;
+        std::vector<cpx>    chirpfft;
+};
+
+/// 2D real to complex transform of w x h planes.
+/// Spectrum is ( w / 2 + 1 ) x h complex, row major.
+/// Real planes are accessed with row stride in floats, so padded rows
+/// of planar images are transformed in place.
+class RealPlan2D
+{
+    public:
+        RealPlan2D( unsigned w, unsigned h );
+
+    public:
+        unsigned width() const  { return w; }
+        unsigned height() const { return h; }
+        unsigned spectrumWidth() const { return w / 2 + 1; }
+        unsigned spectrumSize() const { return spectrumWidth() * h; }
+        void forward( const float* src, unsigned rowstride, cpx* spec ) const;
+        /// spec will be destroyed, dst is scaled by 1 / ( w * h ).
+        void inverse( cpx* spec, float* dst, unsigned rowstride ) const;
+
+    private:
+        void columns( cpx* spec, bool inv ) const;
+
+    private:
+        unsigned    w;
+        unsigned    h;
+        Plan        rowplan;
+        Plan        colplan;
+};
+
+}; /// of namespace fft
+
+#endif /// of __FFT_H__
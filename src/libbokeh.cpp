@@ -3,15 +3,23 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <cmath>
 
 #include <algorithm>
 #include <cassert>
 #include <exception>
 #include <vector>
+#include <map>
+#include <chrono>
 
-#ifndef NOOPENMP
-#include <omp.h>
-#endif /// of NOOPENMP
+#include <mutex>
+
+#include "libbokeh.h"
+#include "fft.h"
+#include "simd.h"
+#include "pool.h"
+#include "arena.h"
+#include "perf.h"
 
 #ifndef nullptr
     #define nullptr     NULL
@@ -19,7 +27,20 @@
 
 using namespace std;
 
-class Image
+// Lazy pixel expression of images, evaluated per output pixel by
+// saveToMemory(), without intermediate images.
+// E has width(), height() and at( x, y ) of a pixel.
+template <class E>
+class ImageExpr
+{
+    public:
+        const E& self() const { return static_cast<const E&>( *this ); }
+};
+
+// Interleaved RGB float image,
+// only kept for legacy engines, ProcessBokeh() and ProcessFastBokeh().
+// Other engines use PlanarImage.
+class Image : public ImageExpr<Image>
 {
     public:
         
@@ -39,7 +60,7 @@ class Image
             
             bool operator != (const RGBf &c) const 
             { 
-                return c.r != r && c.g != g && c.b != b; 
+                return c.r != r || c.g != g || c.b != b; 
             }
             
             RGBf& operator *= (const RGBf &RGBf) 
@@ -79,22 +100,24 @@ class Image
         Image(const unsigned int &_w, const unsigned int &_h, const RGBf &c = RGBf(0) ) 
         : w(_w), h(_h), pixels(nullptr)
         {
-            pixels = new RGBf[w * h];
+            pixels = (RGBf*)arena::current().acquire( sizeof(RGBf) * w * h );
             
             if ( pixels != nullptr )
             {
-                #pragma omp parallel for
-                for (int i = 0; i < w * h; ++i) 
+                pool::parallelFor( w * h, 1, [&]( unsigned b, unsigned e, unsigned )
                 {
-                    pixels[i] = c;
-                }
+                    for (unsigned i = b; i < e; ++i) 
+                    {
+                        pixels[i] = c;
+                    }
+                } );
             }
         }
         
         Image(const Image &img) 
         : w(img.w), h(img.h), pixels(nullptr)
         {
-            pixels = new RGBf[w * h];
+            pixels = (RGBf*)arena::current().acquire( sizeof(RGBf) * w * h );
             
             if ( pixels != NULL )
             {
@@ -102,38 +125,42 @@ class Image
             }
         }
         
-        // move constructor
-        Image(Image* &img) 
-        : w(0), h(0), pixels(nullptr)
+        Image(Image &&img) 
+        : w(img.w), h(img.h), pixels(img.pixels)
         {
-            w       = img->w;
-            h       = img->h;
-            pixels  = img->pixels;
+            img.pixels = nullptr;
+            img.w      = 0;
+            img.h      = 0;
+        }
 
-            img->pixels = nullptr;
-            img->w      = 0;
-            img->h      = 0;
+        Image& operator = (const Image &img)
+        {
+            if (this != &img) 
+            {
+                Image tmp(img);
+                swap(tmp);
+            }
+            
+            return *this;
         }
 
-        // move assignment operator
-        Image& operator = (Image &img)
+        Image& operator = (Image &&img)
         {
             if (this != &img) 
             {
-                if (pixels != nullptr) 
-                    delete [] pixels;
-                
-                w       = img.w;
-                h       = img.h;
-                pixels  = img.pixels;
-                img.pixels = nullptr;
-                img.w   = 0;
-                img.h   = 0;
+                swap(img);
             }
             
             return *this;
         }
 
+        void swap(Image &img)
+        {
+            std::swap( w, img.w );
+            std::swap( h, img.h );
+            std::swap( pixels, img.pixels );
+        }
+
         RGBf& operator () (const unsigned &x, const unsigned int &y) const
         {
             //assert(x < w && y < h);
@@ -142,84 +169,42 @@ class Image
         
         Image& operator *= (const RGBf &RGBf)
         {
-            #pragma omp parallel for
-            for (int i = 0; i < w * h; ++i)
-            {
-                pixels[i] *= RGBf;
-            }
-            
-            return *this;
-        }
-        
-        Image& operator += (const Image &img)
-        {
-            #pragma omp parallel for
-            for (int i = 0; i < w * h; ++i) 
+            pool::parallelFor( w * h, 3, [&]( unsigned b, unsigned e, unsigned )
             {
-                pixels[i] += img[i];
-            }
+                for (unsigned i = b; i < e; ++i)
+                {
+                    pixels[i] *= RGBf;
+                }
+            } );
             
             return *this;
         }
         
         Image& operator /= (const float &div)
         {
-            float invDiv = 1 / div;
+            float    invDiv = 1 / div;
+            float*   fpix   = &pixels[0].r;
             
-            #pragma omp parallel for
-            for (int i = 0; i < w * h; ++i) 
+            // RGBf is 3 floats without padding, so it is a float array.
+            pool::parallelFor( h, w * 3, [&]( unsigned b, unsigned e, unsigned )
             {
-                pixels[i] *= invDiv;
-            }
+                for (unsigned i = b; i < e; ++i) 
+                {
+                    simd::scale( &fpix[ (size_t)i * w * 3 ], invDiv, w * 3 );
+                }
+            } );
             
             return *this;
         }
         
-        friend Image operator * (const RGBf &RGBf, const Image &img)
-        {
-            Image tmp(img); 
-            tmp *= RGBf;
-            return tmp;
-        }
-        
-        Image operator * (const Image &img)
-        {
-            Image tmp(*this);
-            
-            // multiply pixels together
-            #pragma omp parallel for
-            for (int i = 0; i < w * h; ++i)
-            {
-                tmp[i] *= img[i];
-            }
-            
-            return tmp;
-        }
-        
-        static Image circshift(const Image &img, unsigned shftx, unsigned shfty )
+        // as expression.
+        unsigned width() const  { return w; }
+        unsigned height() const { return h; }
+        const RGBf& at( unsigned x, unsigned y ) const
         {
-            Image tmp(img.w, img.h);
-            
-            unsigned w = img.w;
-            unsigned h = img.h;
-            unsigned x;
-            unsigned y;
-            
-            #pragma omp parallel for private(x)
-            for ( y = 0; y<h; y++ )
-            {
-                unsigned ymod = ( y + shfty ) % h;
-              
-                for ( x = 0; x < w; x++ ) 
-                {
-                    unsigned xmod = ( x + shftx ) % w;
-                    tmp[ ymod * w + xmod ] = img[ y * w + x ];
-                }    
-            }
-            
-            return tmp;
+            return pixels[ y * w + x ];
         }
-        
+
         const RGBf& operator [] (const unsigned int &i) const 
         { 
             return pixels[i]; 
@@ -232,10 +217,7 @@ class Image
         
         ~Image() 
         { 
-            if (pixels != nullptr) 
-            {
-                delete[] pixels; 
-            }
+            arena::release( pixels );
         }
 
     public:
@@ -245,22 +227,281 @@ class Image
         
 };
 
+// Images in expression are referred, other nodes are copied as values.
+template <class E> struct ExprOperand        { typedef const E      type; };
+template <>        struct ExprOperand<Image> { typedef const Image& type; };
+
+// Divided by multiply of reciprocal, same as Image::operator /=.
+template <class E>
+class DivExpr : public ImageExpr< DivExpr<E> >
+{
+    public:
+        DivExpr( const E &_e, float div ) : e( _e ), inv( 1 / div ) {}
+
+    public:
+        unsigned width() const  { return e.width(); }
+        unsigned height() const { return e.height(); }
+        Image::RGBf at( unsigned x, unsigned y ) const
+        {
+            Image::RGBf pix = e.at( x, y );
+
+            return Image::RGBf( pix.r * inv, pix.g * inv, pix.b * inv );
+        }
+
+    private:
+        typename ExprOperand<E>::type e;
+        float inv;
+};
+
+template <class E>
+inline DivExpr<E> operator / ( const ImageExpr<E> &e, float div )
+{
+    return DivExpr<E>( e.self(), div );
+}
+//////////////////////////////////////////////////
+
+// Planar float image : R, G and B in separated planes.
+// Every row starts 64 bytes aligned, and padded to multiple of 16 floats,
+// so vector units run full width without remainders nor split lines.
+// Padding is kept zero.
+class PlanarImage
+{
+    public:
+        static const unsigned kAlign = 64;
+        static const unsigned kLanes = kAlign / sizeof(float);
+
+    public:
+        PlanarImage()
+        : w(0), h(0), stride(0), buffer(nullptr)
+        {
+            planes[0] = planes[1] = planes[2] = nullptr;
+        }
+
+        PlanarImage( unsigned _w, unsigned _h )
+        : w(0), h(0), stride(0), buffer(nullptr)
+        {
+            planes[0] = planes[1] = planes[2] = nullptr;
+
+            size_t pstride = ( _w + kLanes - 1 ) / kLanes * kLanes;
+            size_t planesz = pstride * _h;
+            size_t bytes   = planesz * 3 * sizeof(float);
+
+            // arena gives kAlign aligned buffers.
+            buffer = arena::current().acquire( bytes );
+
+            if ( buffer != nullptr )
+            {
+                planes[0] = (float*)buffer;
+                planes[1] = planes[0] + planesz;
+                planes[2] = planes[1] + planesz;
+
+                w      = _w;
+                h      = _h;
+                stride = pstride;
+
+                clear();
+            }
+        }
+
+        PlanarImage( PlanarImage &&img )
+        : w(img.w), h(img.h), stride(img.stride), buffer(img.buffer)
+        {
+            for( unsigned c=0; c<3; c++ )
+            {
+                planes[c]     = img.planes[c];
+                img.planes[c] = nullptr;
+            }
+
+            img.buffer = nullptr;
+            img.w      = 0;
+            img.h      = 0;
+            img.stride = 0;
+        }
+
+        PlanarImage& operator = ( PlanarImage &&img )
+        {
+            if ( this != &img )
+            {
+                swap( img );
+            }
+
+            return *this;
+        }
+
+        ~PlanarImage()
+        {
+            arena::release( buffer );
+        }
+
+    public:
+        bool empty() const
+        {
+            return buffer == nullptr;
+        }
+
+        float* row( unsigned c, unsigned y )
+        {
+            return planes[c] + (size_t)y * stride;
+        }
+
+        const float* row( unsigned c, unsigned y ) const
+        {
+            return planes[c] + (size_t)y * stride;
+        }
+
+        void clear()
+        {
+            if ( buffer != nullptr )
+            {
+                memset( planes[0], 0, (size_t)stride * h * 3 * sizeof(float) );
+            }
+        }
+
+        void swap( PlanarImage &img )
+        {
+            std::swap( w, img.w );
+            std::swap( h, img.h );
+            std::swap( stride, img.stride );
+            std::swap( buffer, img.buffer );
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                std::swap( planes[c], img.planes[c] );
+            }
+        }
+
+    private:
+        PlanarImage( const PlanarImage& );
+        PlanarImage& operator = ( const PlanarImage& );
+
+    public:
+        unsigned w;
+        unsigned h;
+        unsigned stride;    /// floats per row.
+        float*   planes[3];
+
+    private:
+        void*    buffer;
+};
+
+// Scratch of loops from current arena. Taken by calling thread before
+// loop, so next call gets same buffer recycled instead of heap.
+template <class T>
+class ScratchBuffer
+{
+    public:
+        ScratchBuffer( size_t n )
+        : data( (T*)arena::current().acquire( max( n, (size_t)1 ) * sizeof(T) ) )
+        {
+        }
+
+        ~ScratchBuffer()
+        {
+            arena::release( data );
+        }
+
+    private:
+        ScratchBuffer( const ScratchBuffer& );
+        ScratchBuffer& operator = ( const ScratchBuffer& );
+
+    public:
+        T*  data;
+};
+
 //////////////////////////////////////////////////
 
-static float intensity = 0.9f;
+// Highlight test of source pixels : all channels over level are
+// multiplied by boost. Contexts make their own current for thread
+// processing, others use defaults of process.
+struct HighlightSetting
+{
+    float   level;
+    float   boost;
+};
+
+static HighlightSetting highlight_default = { 0.9f, 3.f };
+static thread_local const HighlightSetting* highlight_current = NULL;
+
+// Read by calling thread before loops, workers of pool have no context.
+static inline HighlightSetting highlights()
+{
+    if ( highlight_current != NULL )
+        return *highlight_current;
+
+    return highlight_default;
+}
+
+class HighlightScope
+{
+    public:
+        HighlightScope( const HighlightSetting &hs )
+         : prev( highlight_current )
+        {
+            highlight_current = &hs;
+        }
+
+        ~HighlightScope()
+        {
+            highlight_current = prev;
+        }
+
+    private:
+        const HighlightSetting* prev;
+};
+
+// output tile of tiled gather, 0 width goes to whole rows.
+static unsigned tile_w = 256;
+static unsigned tile_h = 32;
 
 //////////////////////////////////////////////////
 
+PlanarImage loadPlanarFromMemory( const unsigned char* buff, 
+                                  unsigned w, unsigned h, unsigned d )
+{   
+    perf::Timer timer( perf::UNPACK );
+
+    if ( ( buff == NULL ) || ( w == 0 ) || ( h == 0 ) || ( d == 0 ) )
+        return PlanarImage();
+
+    // It may be failed to allocate memory,
+    // Caller must be check image is empty.
+    PlanarImage img( w, h );
+
+    if ( img.empty() == true )
+        return img;
+    
+    // convert bytes to floats by rows,
+    // multiply by boost when all of pixel values over intesity.
+    // advanced to color distornation.
+    const HighlightSetting light = highlights();
+
+    pool::parallelFor( h, w * 4, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            simd::unpackRGB( &buff[ (size_t)y * w * d ], d,
+                             img.row( 0, y ), img.row( 1, y ), img.row( 2, y ), w,
+                             light.level, light.boost );
+        }
+    } );
+
+    return img;
+}
+
+// Compatibility for legacy engines, pixels converted same as planar.
 Image loadFromMemory( const unsigned char* buff, unsigned w, unsigned h, unsigned d )
 {   
-    Image img;
+    perf::Timer timer( perf::UNPACK );
+
+    Image       img;
+    PlanarImage pimg = loadPlanarFromMemory( buff, w, h, d );
     
-    if ( ( buff == NULL ) || ( w == 0 ) || ( h == 0 ) || ( d == 0 ) )
+    if ( pimg.empty() == true )
         return img;
     
     img.w = w; 
     img.h = h;
-    img.pixels = new Image::RGBf[w * h];
+    img.pixels = (Image::RGBf*)arena::current().acquire( sizeof(Image::RGBf) * w * h );
 
     if ( img.pixels == nullptr )
     {
@@ -270,126 +511,51 @@ Image loadFromMemory( const unsigned char* buff, unsigned w, unsigned h, unsigne
         img.h = 0;
         return img; 
     }
-    
-    // read each pixel one by one and convert bytes to floats
-    #pragma omp parallel for
-    for ( unsigned cnt=0; cnt<w*h; cnt++ ) 
-    {
-        float    pix[3] = {0.f};
-        unsigned pixque = cnt * d;
-        
-        switch( d )
-        {
-            case 1:
-                pix[0] = (float)buff[ pixque ];
-                pix[1] = pix[0];
-                pix[2] = pix[0];
-                break;
-                
-            case 3:
-                pix[0] = (float)buff[ pixque + 0 ];
-                pix[1] = (float)buff[ pixque + 1 ];
-                pix[2] = (float)buff[ pixque + 2 ];
-                break;
-                
-            case 4:
-                {
-                    float af = (float)buff[ pixque + 4 ] / 255.f;
-                    
-                    pix[0] = (float)buff[ pixque + 0 ] * af;
-                    pix[1] = (float)buff[ pixque + 1 ] * af;
-                    pix[2] = (float)buff[ pixque + 2 ] * af;
-                }
-                break;
-        }
-        
-        img.pixels[cnt].r = pix[0] / 255.f;
-        img.pixels[cnt].g = pix[1] / 255.f;
-        img.pixels[cnt].b = pix[2] / 255.f;
-        
-        // Multiply by 3 when pixel value overs intesity.
-        // advanced to color distornation.
-        float mp_r = img.pixels[cnt].r;
-        float mp_g = img.pixels[cnt].g;
-        float mp_b = img.pixels[cnt].b;
-        unsigned mp_s = 0;
-
-        if ( img.pixels[cnt].r > intensity ) 
-        {
-            mp_r *= 3.f;
-            mp_s ++;
-        }
-
-        if ( img.pixels[cnt].g > intensity )
-        {
-            mp_g *= 3.f;
-            mp_s ++;
-        }
 
-        if ( img.pixels[cnt].b > intensity )
+    pool::parallelFor( h, w * 3, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
         {
-            mp_b *= 3.f;
-            mp_s ++;
-        }
+            for ( unsigned x=0; x<w; x++ ) 
+            {
+                Image::RGBf &pix = img.pixels[ y * w + x ];
 
-        if ( mp_s > 2 )
-        {
-            img.pixels[cnt].r = mp_r;
-            img.pixels[cnt].g = mp_g;
-            img.pixels[cnt].b = mp_b;
+                pix.r = pimg.row( 0, y )[x];
+                pix.g = pimg.row( 1, y )[x];
+                pix.b = pimg.row( 2, y )[x];
+            }
         }
-    }
+    } );
 
     return img;
 }
 
-bool ProcessBokeh( const unsigned char* srcptr, 
-                   unsigned srcw, unsigned srch, unsigned srcd,
-                   const unsigned char* bokeh,  
-                   unsigned char* &outptr )
+// Packs to 8 bit RGB in buffer of caller.
+static void packPlanar( const PlanarImage &img, unsigned char* outptr )
 {
-    Image srcf  = loadFromMemory( srcptr, srcw, srch, srcd );   
-    Image maskf = loadFromMemory( bokeh, srcw, srch, 1 );
-    Image outf( srcw, srch );
-
-    float total = 0;
-    Image::RGBf kBlack = Image::RGBf(0);
-   
-    unsigned x = 0;
-    unsigned y = 0;
+    perf::Timer timer( perf::PACK );
 
-    for ( y=0; y<srch; y++ ) 
+    pool::parallelFor( img.h, img.w * 3,
+                       [&]( unsigned y0, unsigned y1, unsigned )
     {
-        #pragma omp parallel for reduction(+:total) shared(outf)
-        for ( x=0; x<srcw; x++ ) 
+        for( unsigned y=y0; y<y1; y++ )
         {
-            if ( maskf(x, y) != kBlack ) 
-            {
-                #pragma omp task
-                outf  += maskf(x, y) * Image::circshift( srcf, x, y );
-                total += maskf(x, y);
-            }
+            // FFT and other approximated engines may leave tiny negatives,
+            // clamped to [0,1].
+            simd::packRGB( img.row( 0, y ), img.row( 1, y ), img.row( 2, y ),
+                           &outptr[ (size_t)y * img.w * 3 ], img.w );
         }
-    }
-    
-    outf /= total;
-        
-    unsigned outsz = srcw * srch;
+    } );
+}
+
+bool savePlanarToMemory( const PlanarImage &img, unsigned char* &outptr )
+{
+    unsigned outsz = img.w * img.h;
     outptr = new unsigned char[ outsz * 3 ];
     
     if ( outptr != NULL )
     {
-        #pragma omp parallel for
-        for( unsigned cnt=0; cnt<outsz; cnt++ )
-        {
-            unsigned char uc_rgb[3] = {0,0,0};
-            
-            uc_rgb[0] = min( 1.f, outf.pixels[cnt].r ) * 255.f;
-            uc_rgb[1] = min( 1.f, outf.pixels[cnt].g ) * 255.f;
-            uc_rgb[2] = min( 1.f, outf.pixels[cnt].b ) * 255.f;
-
-            memcpy( &outptr[ cnt * 3 ], uc_rgb, 3 );
-        }
+        packPlanar( img, outptr );
         
         return true;
     }
@@ -397,67 +563,4068 @@ bool ProcessBokeh( const unsigned char* srcptr,
     return false;
 }
 
-bool ProcessFastBokeh( const unsigned char* srcptr, 
-                       unsigned srcw, unsigned srch, unsigned srcd,
-                       const unsigned char* bokeh,  
-                       unsigned bkw, unsigned bkh,
-                       unsigned char* &outptr )
+bool saveToMemory( const Image &img, unsigned char* &outptr )
 {
-    // check mask size.
-    if ( ( srcw < bkw ) || ( srch < bkh ) ) 
-        return false;
-
-    Image srcf  = loadFromMemory( srcptr, srcw, srch, srcd );   
-    Image maskf = loadFromMemory( bokeh, bkw, bkh, 1 );
-    Image outf( srcw, srch );
+    perf::Timer timer( perf::PACK );
 
-    float total = 0;
-    Image::RGBf kBlack = Image::RGBf(0);
-   
-    unsigned x = 0;
-    unsigned y = 0;
-    unsigned msk_x = bkw;
-    unsigned msk_y = srch - bkh;
-
-    // Don't need to all size of image, just repeats for mask size.
-    for( y=msk_y; y<srch; y++ )
+    unsigned outsz = img.w * img.h;
+    outptr = new unsigned char[ outsz * 3 ];
+    
+    if ( outptr != NULL )
     {
-        #pragma omp parallel for reduction(+:total) shared(outf)
-        for( x=0; x<msk_x; x++ )
-        {
-            unsigned mx = x;
-            unsigned my = y - msk_y;
+        const float* fpix = &img.pixels[0].r;
 
-            if ( maskf(mx, my) != kBlack ) 
+        // interleaved floats are packed as is.
+        pool::parallelFor( img.h, img.w * 3,
+                           [&]( unsigned y0, unsigned y1, unsigned )
+        {
+            for( unsigned y=y0; y<y1; y++ )
             {
-                #pragma omp task
-                outf  += maskf(mx, my) * Image::circshift( srcf, x, y );
-                total += maskf(mx, my);
+                simd::packBytes( &fpix[ (size_t)y * img.w * 3 ],
+                                 &outptr[ (size_t)y * img.w * 3 ], img.w * 3 );
             }
-        }
+        } );
+        
+        return true;
     }
     
-    outf /= total;
-        
-    unsigned outsz = srcw * srch;
-    outptr = new unsigned char[ outsz * 3 ];
+    return false;
+}
+
+// Expression is evaluated by rows into a small buffer and packed,
+// so output of a chain costs one pass without float image.
+template <class E>
+bool saveToMemory( const ImageExpr<E> &expr, unsigned char* &outptr )
+{
+    perf::Timer timer( perf::PACK );
+
+    const E &e = expr.self();
+    unsigned w = e.width();
+    unsigned h = e.height();
+
+    outptr = new unsigned char[ (size_t)w * h * 3 ];
     
     if ( outptr != NULL )
     {
-        #pragma omp parallel for
-        for( unsigned cnt=0; cnt<outsz; cnt++ )
-        {
-            unsigned char uc_rgb[3] = {0,0,0};
-            
-            uc_rgb[0] = min( 1.f, outf.pixels[cnt].r ) * 255.f;
-            uc_rgb[1] = min( 1.f, outf.pixels[cnt].g ) * 255.f;
-            uc_rgb[2] = min( 1.f, outf.pixels[cnt].b ) * 255.f;
+        // a row per worker, loops allocate nothing.
+        ScratchBuffer<Image::RGBf> lines( (size_t)w * pool::threads() );
 
-            memcpy( &outptr[ cnt * 3 ], uc_rgb, 3 );
+        if ( lines.data == nullptr )
+        {
+            delete[] outptr;
+            outptr = NULL;
+            return false;
         }
-        
+
+        pool::parallelFor( h, w * 3, [&]( unsigned y0, unsigned y1, unsigned wk )
+        {
+            Image::RGBf* line = &lines.data[ (size_t)wk * w ];
+
+            for( unsigned y=y0; y<y1; y++ )
+            {
+                for( unsigned x=0; x<w; x++ )
+                {
+                    line[x] = e.at( x, y );
+                }
+
+                simd::packBytes( &line[0].r, &outptr[ (size_t)y * w * 3 ], w * 3 );
+            }
+        } );
+        
         return true;
     }
     
     return false;
 }
+
+// Gray mask weight of a pixel, as average of channels.
+static inline float maskWeight( const PlanarImage &maskf, unsigned x, unsigned y )
+{
+    return ( maskf.row( 0, y )[x] 
+             + maskf.row( 1, y )[x] 
+             + maskf.row( 2, y )[x] ) / 3.f;
+}
+
+// Mask compiled once to list of non-zero taps.
+// A tap reads source at ( ( x - dx ) % w, ( y + dy ) % h ), that is
+// same as circshift( src, mx, h - bkh + my ) of ProcessFastBokeh().
+class BokehKernel
+{
+    public:
+        struct Tap
+        {
+            unsigned    dx;
+            unsigned    dy;
+            float       weight; /// already divided by total.
+        };
+
+    public:
+        // Run of taps [x0,x1) in a mask row, for flat masks.
+        struct Span
+        {
+            unsigned    x0;
+            unsigned    x1;
+            unsigned    dy;
+        };
+
+    public:
+        BokehKernel() : w(0), h(0), total(0), flat(false), flatweight(0),
+                        qtotal(0), qrecip(0)
+        {
+        }
+
+    public:
+        unsigned    w;
+        unsigned    h;
+        float       total;
+        vector<Tap> taps;   /// sorted by dy, then dx.
+        // Every tap has same weight, as disc or polygon apertures.
+        bool        flat;
+        float       flatweight;
+        vector<Span> spans;
+        // Fixed point weights of taps, same order of taps.
+        // qtotal is sum of qweights, qrecip is 2^40 / qtotal rounded up.
+        vector<short> qweights;
+        unsigned    qtotal;
+        unsigned long long qrecip;
+};
+
+// Bits of quantized weight sum, 765 x 2^22 still fits in 32 bit.
+static const unsigned fixed_bits  = 22;
+// Largest 16 bit sample, 255 boosted by 3.
+static const unsigned fixed_smax  = 765;
+
+// Weights quantized to integers of sum about 2^fixed_bits, 
+// each one limited to 15 bits for 16 bit multiply-add.
+static void quantizeKernel( BokehKernel &kernel )
+{
+    const vector<BokehKernel::Tap> &taps = kernel.taps;
+    float    wmax = 0.f;
+    unsigned bits = fixed_bits;
+
+    for( size_t cnt=0; cnt<taps.size(); cnt++ )
+    {
+        wmax = max( wmax, taps[cnt].weight );
+    }
+
+    while( ( bits > 0 ) && ( wmax * (float)( 1u << bits ) > 32767.f ) )
+    {
+        bits--;
+    }
+
+    for( ;; )
+    {
+        unsigned long long qsum  = 0;
+        const float        scale = (float)( 1u << bits );
+
+        kernel.qweights.resize( taps.size() );
+
+        for( size_t cnt=0; cnt<taps.size(); cnt++ )
+        {
+            kernel.qweights[cnt] = (short)( taps[cnt].weight * scale + 0.5f );
+            qsum += kernel.qweights[cnt];
+        }
+
+        // rounding may exceed 32 bit accumulator with huge masks.
+        if ( ( qsum * fixed_smax < 0xFFFFFFFFull ) || ( bits == 0 ) )
+        {
+            kernel.qtotal = (unsigned)qsum;
+            break;
+        }
+
+        bits--;
+    }
+
+    if ( kernel.qtotal > 0 )
+    {
+        kernel.qrecip = ( ( 1ull << 40 ) + kernel.qtotal - 1 ) / kernel.qtotal;
+    }
+    else
+    {
+        kernel.qrecip = 0;
+    }
+}
+
+static bool compileKernel( const PlanarImage &maskf, BokehKernel &kernel )
+{
+    perf::Timer timer( perf::KERNEL );
+
+    float total = 0;
+
+    kernel.w = maskf.w;
+    kernel.h = maskf.h;
+    kernel.taps.clear();
+
+    for( unsigned my=0; my<maskf.h; my++ )
+    {
+        for( unsigned mx=0; mx<maskf.w; mx++ )
+        {
+            float wgt = maskWeight( maskf, mx, my );
+
+            if ( wgt != 0.f )
+            {
+                BokehKernel::Tap tap;
+                
+                tap.dx     = mx;
+                tap.dy     = maskf.h - my;
+                tap.weight = wgt;
+
+                kernel.taps.push_back( tap );
+                total += wgt;
+            }
+        }
+    }
+
+    kernel.total = total;
+
+    if ( total <= 0.f )
+        return false;
+
+    // taps reading same source row are kept together.
+    stable_sort( kernel.taps.begin(), kernel.taps.end(), 
+                 []( const BokehKernel::Tap &l, const BokehKernel::Tap &r )
+                 { return l.dy < r.dy; } );
+
+    for( size_t cnt=0; cnt<kernel.taps.size(); cnt++ )
+    {
+        kernel.taps[cnt].weight /= total;
+    }
+
+    // Check flat weights, and encode taps to spans.
+    const vector<BokehKernel::Tap> &taps = kernel.taps;
+
+    kernel.flat       = true;
+    kernel.flatweight = taps[0].weight;
+    kernel.spans.clear();
+
+    for( size_t cnt=0; cnt<taps.size(); cnt++ )
+    {
+        if ( fabs( taps[cnt].weight - kernel.flatweight ) 
+             > kernel.flatweight * 1e-5f )
+        {
+            kernel.flat = false;
+            kernel.spans.clear();
+            break;
+        }
+
+        if ( ( kernel.spans.size() > 0 ) 
+             && ( kernel.spans.back().dy == taps[cnt].dy )
+             && ( kernel.spans.back().x1 == taps[cnt].dx ) )
+        {
+            kernel.spans.back().x1++;
+        }
+        else
+        {
+            BokehKernel::Span span;
+
+            span.x0 = taps[cnt].dx;
+            span.x1 = taps[cnt].dx + 1;
+            span.dy = taps[cnt].dy;
+
+            kernel.spans.push_back( span );
+        }
+    }
+
+    quantizeKernel( kernel );
+
+    return true;
+}
+
+// Each output pixel gathered directly from source by taps.
+// Every output row is owned by one thread, nothing allocated per tap.
+static void gatherConvolve( const PlanarImage &srcf, const BokehKernel &kernel,
+                            PlanarImage &outf )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    const unsigned            srcw  = srcf.w;
+    const unsigned            srch  = srcf.h;
+    const unsigned            ntaps = kernel.taps.size();
+    const BokehKernel::Tap*   taps  = ntaps > 0 ? &kernel.taps[0] : nullptr;
+
+    perf::addTaps( (unsigned long long)ntaps * srcw * srch );
+
+    pool::parallelFor( srch, (double)ntaps * srcw * 3,
+                       [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            for( unsigned c=0; c<3; c++ )
+            {
+                float* dst = outf.row( c, y );
+
+                for( unsigned cnt=0; cnt<ntaps; cnt++ )
+                {
+                    const unsigned mx  = taps[cnt].dx;
+                    const float    wgt = taps[cnt].weight;
+                    const float*   src = srcf.row( c, ( y + taps[cnt].dy ) % srch );
+
+                    // wrapped part of row, then straight part.
+                    simd::axpy( dst, &src[ srcw - mx ], wgt, mx );
+                    simd::axpy( dst + mx, src, wgt, srcw - mx );
+                }
+            }
+        }
+    } );
+}
+
+// Copies n pixels of a row from x0, wrapping around width w.
+static void copyWrapped( const float* src, unsigned w, unsigned x0,
+                         float* dst, unsigned n )
+{
+    while( n > 0 )
+    {
+        unsigned run = min( n, w - x0 );
+
+        memcpy( dst, &src[x0], run * sizeof(float) );
+
+        dst += run;
+        n   -= run;
+        x0   = 0;
+    }
+}
+
+// Output in tiles : each tile pulls its source region with halo of
+// kernel size into a thread local contiguous buffer, applies all taps,
+// then written back once. Wrap-around is resolved while copying halo,
+// so tap loops have no modulo.
+static void tiledConvolve( const PlanarImage &srcf, const BokehKernel &kernel,
+                           PlanarImage &outf, unsigned tilew, unsigned tileh )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    const unsigned            srcw  = srcf.w;
+    const unsigned            srch  = srcf.h;
+    const unsigned            ntaps = kernel.taps.size();
+    const BokehKernel::Tap*   taps  = ntaps > 0 ? &kernel.taps[0] : nullptr;
+
+    if ( ntaps == 0 )
+        return;
+
+    perf::addTaps( (unsigned long long)ntaps * srcw * srch );
+
+    unsigned dymin = taps[0].dy;
+    unsigned dymax = taps[0].dy;
+    unsigned dxmax = 0;
+
+    for( unsigned cnt=0; cnt<ntaps; cnt++ )
+    {
+        dymin = min( dymin, taps[cnt].dy );
+        dymax = max( dymax, taps[cnt].dy );
+        dxmax = max( dxmax, taps[cnt].dx );
+    }
+
+    tilew = min( max( tilew, 1u ), srcw );
+    tileh = min( max( tileh, 1u ), srch );
+
+    const unsigned tilesx = ( srcw + tilew - 1 ) / tilew;
+    const unsigned tilesy = ( srch + tileh - 1 ) / tileh;
+    const unsigned halow  = tilew + dxmax;
+    const unsigned haloh  = tileh + dymax - dymin;
+
+    // halo and tile per worker.
+    const size_t            perworker = (size_t)halow * haloh + (size_t)tilew * tileh;
+    ScratchBuffer<float>    scratch( perworker * pool::threads() );
+
+    if ( scratch.data == nullptr )
+        return;
+
+    pool::parallelFor( tilesx * tilesy, (double)ntaps * tilew * tileh * 3,
+                       [&]( unsigned t0, unsigned t1, unsigned worker )
+    {
+        float* halo = scratch.data + perworker * worker;
+        float* tile = halo + (size_t)halow * haloh;
+
+        for( unsigned tcnt=t0; tcnt<t1; tcnt++ )
+        {
+            unsigned tx = ( tcnt % tilesx ) * tilew;
+            unsigned ty = ( tcnt / tilesx ) * tileh;
+            unsigned tw = min( tilew, srcw - tx );
+            unsigned th = min( tileh, srch - ty );
+            unsigned hw = tw + dxmax;
+            unsigned hh = th + dymax - dymin;
+            unsigned hx = ( tx + srcw - dxmax ) % srcw;
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                for( unsigned hy=0; hy<hh; hy++ )
+                {
+                    unsigned sy = ( ty + dymin + hy ) % srch;
+                    copyWrapped( srcf.row( c, sy ), srcw, hx, 
+                                 &halo[ (size_t)hy * hw ], hw );
+                }
+
+                fill( tile, tile + (size_t)tw * th, 0.f );
+
+                for( unsigned y=0; y<th; y++ )
+                {
+                    float* dst = &tile[ (size_t)y * tw ];
+
+                    for( unsigned cnt=0; cnt<ntaps; cnt++ )
+                    {
+                        const float* src = &halo[ (size_t)( y + taps[cnt].dy - dymin ) * hw
+                                                  + dxmax - taps[cnt].dx ];
+
+                        simd::axpy( dst, src, taps[cnt].weight, tw );
+                    }
+                }
+
+                for( unsigned y=0; y<th; y++ )
+                {
+                    memcpy( outf.row( c, ty + y ) + tx, &tile[ (size_t)y * tw ],
+                            tw * sizeof(float) );
+                }
+            }
+        }
+    } );
+}
+
+// 16 bit planar source of fixed point engine, in 8 bit levels.
+// Highlight boost makes 3 x 255 at most, kept in 16 bit headroom.
+// Planes are from current arena, as PlanarImage.
+class FixedImage
+{
+    public:
+        FixedImage( unsigned w_, unsigned h_ )
+          : w( w_ ), h( h_ ), stride( ( w_ + 31 ) & ~31u ),
+            data( (size_t)stride * h_ * 3 )
+        {
+        }
+
+    public:
+        bool empty() const { return ( w == 0 ) || ( h == 0 ) || ( data.data == nullptr ); }
+
+        unsigned short* row( unsigned c, unsigned y )
+        {
+            return &data.data[ ( (size_t)c * h + y ) * stride ];
+        }
+
+        const unsigned short* row( unsigned c, unsigned y ) const
+        {
+            return &data.data[ ( (size_t)c * h + y ) * stride ];
+        }
+
+    public:
+        unsigned w;
+        unsigned h;
+        unsigned stride;
+        ScratchBuffer<unsigned short> data;
+};
+
+// img must be sized w x h.
+static bool loadFixedFromMemory( const unsigned char* buff, 
+                                 unsigned w, unsigned h, unsigned d,
+                                 FixedImage &img )
+{
+    perf::Timer timer( perf::UNPACK );
+
+    if ( ( buff == NULL ) || ( w == 0 ) || ( h == 0 ) 
+         || ( ( d != 1 ) && ( d != 3 ) && ( d != 4 ) ) )
+        return false;
+
+    if ( ( img.empty() == true ) || ( img.w != w ) || ( img.h != h ) )
+        return false;
+
+    // same highlight test of loadPlanarFromMemory(), by integers.
+    // boost is fixed to 3 for range of samples.
+    const float level = highlights().level;
+
+    pool::parallelFor( h, w * 4, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for ( unsigned y=y0; y<y1; y++ ) 
+        {
+            const unsigned char* src = &buff[ (size_t)y * w * d ];
+            unsigned short*      r   = img.row( 0, y );
+            unsigned short*      g   = img.row( 1, y );
+            unsigned short*      b   = img.row( 2, y );
+
+            for( unsigned x=0; x<w; x++ )
+            {
+                unsigned pix[3];
+
+                switch( d )
+                {
+                    case 1:
+                        pix[0] = pix[1] = pix[2] = src[x];
+                        break;
+
+                    case 3:
+                        pix[0] = src[ x * 3 + 0 ];
+                        pix[1] = src[ x * 3 + 1 ];
+                        pix[2] = src[ x * 3 + 2 ];
+                        break;
+
+                    case 4:
+                        {
+                            unsigned a = src[ x * 4 + 3 ];
+
+                            pix[0] = ( src[ x * 4 + 0 ] * a + 127 ) / 255;
+                            pix[1] = ( src[ x * 4 + 1 ] * a + 127 ) / 255;
+                            pix[2] = ( src[ x * 4 + 2 ] * a + 127 ) / 255;
+                        }
+                        break;
+
+                    default:
+                        // depth is checked above.
+                        pix[0] = pix[1] = pix[2] = 0;
+                        break;
+                }
+
+                if ( ( (float)pix[0] / 255.f > level ) 
+                     && ( (float)pix[1] / 255.f > level ) 
+                     && ( (float)pix[2] / 255.f > level ) )
+                {
+                    pix[0] *= 3;
+                    pix[1] *= 3;
+                    pix[2] *= 3;
+                }
+
+                r[x] = pix[0];
+                g[x] = pix[1];
+                b[x] = pix[2];
+            }
+        }
+    } );
+
+    return true;
+}
+
+// Fixed point version of tiledConvolve(), writes 8 bit output directly.
+// Taps are applied with 16 bit multiply-add to 32 bit integers,
+// each output is acc / qtotal by multiply of reciprocal.
+static void tiledConvolveFixed( const FixedImage &srcf, const BokehKernel &kernel,
+                                unsigned char* outptr,
+                                unsigned tilew, unsigned tileh )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    const unsigned            srcw  = srcf.w;
+    const unsigned            srch  = srcf.h;
+    const unsigned            ntaps = kernel.taps.size();
+    const BokehKernel::Tap*   taps  = ntaps > 0 ? &kernel.taps[0] : nullptr;
+    const short*              qwgts = ntaps > 0 ? &kernel.qweights[0] : nullptr;
+    const unsigned long long  recip = kernel.qrecip;
+
+    if ( ntaps == 0 )
+        return;
+
+    perf::addTaps( (unsigned long long)ntaps * srcw * srch );
+
+    unsigned dymin = taps[0].dy;
+    unsigned dymax = taps[0].dy;
+    unsigned dxmax = 0;
+
+    for( unsigned cnt=0; cnt<ntaps; cnt++ )
+    {
+        dymin = min( dymin, taps[cnt].dy );
+        dymax = max( dymax, taps[cnt].dy );
+        dxmax = max( dxmax, taps[cnt].dx );
+    }
+
+    if ( tilew == 0 )
+        tilew = srcw;
+
+    tilew = min( max( tilew, 1u ), srcw );
+    tileh = min( max( tileh, 1u ), srch );
+
+    const unsigned tilesx = ( srcw + tilew - 1 ) / tilew;
+    const unsigned tilesy = ( srch + tileh - 1 ) / tileh;
+    const unsigned halow  = tilew + dxmax;
+    const unsigned haloh  = tileh + dymax - dymin;
+
+    // halo, tile and row pointers of taps per worker.
+    const unsigned                          nworkers = pool::threads();
+    ScratchBuffer<unsigned short>           halos( (size_t)halow * haloh * nworkers );
+    ScratchBuffer<unsigned>                 tiles( (size_t)tilew * tileh * nworkers );
+    ScratchBuffer<const unsigned short*>    rowss( (size_t)ntaps * nworkers );
+
+    if ( ( halos.data == nullptr ) || ( tiles.data == nullptr ) 
+         || ( rowss.data == nullptr ) )
+        return;
+
+    pool::parallelFor( tilesx * tilesy, (double)ntaps * tilew * tileh * 3,
+                       [&]( unsigned t0, unsigned t1, unsigned worker )
+    {
+        unsigned short*        halo = halos.data + (size_t)halow * haloh * worker;
+        unsigned*              tile = tiles.data + (size_t)tilew * tileh * worker;
+        const unsigned short** rows = rowss.data + (size_t)ntaps * worker;
+
+        for( unsigned tcnt=t0; tcnt<t1; tcnt++ )
+        {
+            unsigned tx = ( tcnt % tilesx ) * tilew;
+            unsigned ty = ( tcnt / tilesx ) * tileh;
+            unsigned tw = min( tilew, srcw - tx );
+            unsigned th = min( tileh, srch - ty );
+            unsigned hw = tw + dxmax;
+            unsigned hh = th + dymax - dymin;
+            unsigned hx = ( tx + srcw - dxmax ) % srcw;
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                for( unsigned hy=0; hy<hh; hy++ )
+                {
+                    const unsigned short* src = srcf.row( c, ( ty + dymin + hy ) % srch );
+                    unsigned short*       dst = &halo[ (size_t)hy * hw ];
+                    unsigned              x0  = hx;
+                    unsigned              n   = hw;
+
+                    while( n > 0 )
+                    {
+                        unsigned run = min( n, srcw - x0 );
+
+                        memcpy( dst, &src[x0], run * sizeof(unsigned short) );
+
+                        dst += run;
+                        n   -= run;
+                        x0   = 0;
+                    }
+                }
+
+                fill( tile, tile + (size_t)tw * th, 0u );
+
+                for( unsigned y=0; y<th; y++ )
+                {
+                    for( unsigned cnt=0; cnt<ntaps; cnt++ )
+                    {
+                        rows[cnt] = &halo[ (size_t)( y + taps[cnt].dy - dymin ) * hw
+                                           + dxmax - taps[cnt].dx ];
+                    }
+
+                    simd::maddTaps16( &tile[ (size_t)y * tw ], rows, qwgts, 
+                                      ntaps, tw );
+                }
+
+                for( unsigned y=0; y<th; y++ )
+                {
+                    const unsigned* src = &tile[ (size_t)y * tw ];
+                    unsigned char*  dst = &outptr[ ( (size_t)( ty + y ) * srcw + tx ) * 3 + c ];
+
+                    for( unsigned x=0; x<tw; x++ )
+                    {
+                        unsigned long long v = ( src[x] * recip ) >> 40;
+
+                        dst[ x * 3 ] = (unsigned char)min( v, 255ull );
+                    }
+                }
+            }
+        }
+    } );
+}
+
+// Span convolution is worth when it has less work than taps,
+// each span costs two prefix reads per pixel.
+static bool useSpans( const BokehKernel &kernel )
+{
+    return ( kernel.flat == true ) 
+           && ( kernel.spans.size() * 2 < kernel.taps.size() );
+}
+
+// Flat masks : sum of a span is difference of row prefix sums,
+// so each output pixel costs two reads per span, regardless of width.
+// Prefix rows are extended by bkw to left for wrap-around, and kept in
+// ring of bkh rows per thread, as consecutive output rows reuse them.
+static void spanConvolve( const PlanarImage &srcf, const BokehKernel &kernel,
+                          PlanarImage &outf )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    const unsigned  srcw   = srcf.w;
+    const unsigned  srch   = srcf.h;
+    const unsigned  bkw    = kernel.w;
+    const unsigned  bkh    = kernel.h;
+    const unsigned  pw     = srcw + bkw + 1;
+    const unsigned  nspans = kernel.spans.size();
+    const float     wgt    = kernel.flatweight;
+
+    // a span costs two prefix reads, counted as two taps.
+    perf::addTaps( (unsigned long long)nspans * 2 * srcw * srch );
+
+    // contiguous rows per band, to slide prefix ring.
+    // each band primes its own ring, so one band per worker.
+    const unsigned nbands = min( srch, pool::threads() );
+
+    // double, as differences of long sums in float lose precision.
+    // ring keeps bkh rows of 3 planes, one per band.
+    const size_t          ringsz = (size_t)bkh * 3 * pw;
+    ScratchBuffer<double> rings( ringsz * nbands );
+
+    if ( rings.data == nullptr )
+        return;
+
+    pool::parallelFor( nbands, (double)nspans * 2 * srcw * srch * 3 / nbands,
+                       [&]( unsigned b0, unsigned b1, unsigned )
+    {
+        for( unsigned band=b0; band<b1; band++ )
+        {
+            unsigned y0 = (unsigned)( (unsigned long long)srch * band / nbands );
+            unsigned y1 = (unsigned)( (unsigned long long)srch * ( band + 1 ) / nbands );
+
+            double*  ring  = rings.data + ringsz * band;
+            unsigned knext = y0 + 1;
+
+            for( unsigned y=y0; y<y1; y++ )
+            {
+                // rows needed are ( y + dy ) for dy in [1,bkh].
+                for( ; knext<=y+bkh; knext++ )
+                {
+                    for( unsigned c=0; c<3; c++ )
+                    {
+                        const float* src = srcf.row( c, knext % srch );
+                        double*      pfx = &ring[ ( (size_t)( knext % bkh ) * 3 + c ) * pw ];
+
+                        pfx[0] = 0.0;
+
+                        for( unsigned j=0; j<bkw; j++ )
+                        {
+                            pfx[ j + 1 ] = pfx[j] + src[ srcw - bkw + j ];
+                        }
+
+                        for( unsigned j=bkw; j+1<pw; j++ )
+                        {
+                            pfx[ j + 1 ] = pfx[j] + src[ j - bkw ];
+                        }
+                    }
+                }
+
+                for( unsigned c=0; c<3; c++ )
+                {
+                    float* dst = outf.row( c, y );
+
+                    for( unsigned cnt=0; cnt<nspans; cnt++ )
+                    {
+                        const BokehKernel::Span &span = kernel.spans[cnt];
+                        const double* pfx = &ring[ ( (size_t)( ( y + span.dy ) % bkh ) * 3 + c ) * pw ];
+
+                        // sum of src[ x - x1 + 1 .. x - x0 ]
+                        const double* phi = &pfx[ bkw + 1 - span.x0 ];
+                        const double* plo = &pfx[ bkw + 1 - span.x1 ];
+
+                        for( unsigned x=0; x<srcw; x++ )
+                        {
+                            dst[x] += wgt * (float)( phi[x] - plo[x] );
+                        }
+                    }
+                }
+            }
+        }
+    } );
+}
+
+// One-sided Jacobi SVD of m x n row major matrix, m >= n preferred.
+// a becomes U * S by columns, v becomes n x n row major V.
+static void jacobiSVD( vector<double> &a, unsigned m, unsigned n,
+                       vector<double> &v )
+{
+    const double eps  = 1e-10;
+    double       tiny = 0.0;
+
+    // columns cancelled out by rotation never become exact zero,
+    // those are ignored under this to avoid underflow.
+    for( unsigned cnt=0; cnt<m*n; cnt++ )
+    {
+        tiny += a[cnt] * a[cnt];
+    }
+
+    tiny *= 1e-24;
+
+    v.assign( n * n, 0.0 );
+
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        v[ cnt * n + cnt ] = 1.0;
+    }
+
+    for( unsigned sweep=0; sweep<60; sweep++ )
+    {
+        double offmax = 0.0;
+
+        for( unsigned p=0; p+1<n; p++ )
+        {
+            for( unsigned q=p+1; q<n; q++ )
+            {
+                double alpha = 0.0;
+                double beta  = 0.0;
+                double gamma = 0.0;
+
+                for( unsigned i=0; i<m; i++ )
+                {
+                    double ap = a[ i * n + p ];
+                    double aq = a[ i * n + q ];
+                    alpha += ap * ap;
+                    beta  += aq * aq;
+                    gamma += ap * aq;
+                }
+
+                if ( ( alpha <= tiny ) || ( beta <= tiny ) )
+                    continue;
+
+                double offd = fabs( gamma ) / ( sqrt( alpha ) * sqrt( beta ) );
+
+                if ( offd <= eps )
+                    continue;
+
+                offmax = max( offmax, offd );
+
+                double zeta = ( beta - alpha ) / ( 2.0 * gamma );
+                double t    = ( zeta >= 0.0 ? 1.0 : -1.0 ) 
+                              / ( fabs( zeta ) + sqrt( 1.0 + zeta * zeta ) );
+                double c    = 1.0 / sqrt( 1.0 + t * t );
+                double s    = c * t;
+
+                for( unsigned i=0; i<m; i++ )
+                {
+                    double ap = a[ i * n + p ];
+                    double aq = a[ i * n + q ];
+                    a[ i * n + p ] = c * ap - s * aq;
+                    a[ i * n + q ] = s * ap + c * aq;
+                }
+
+                for( unsigned i=0; i<n; i++ )
+                {
+                    double vp = v[ i * n + p ];
+                    double vq = v[ i * n + q ];
+                    v[ i * n + p ] = c * vp - s * vq;
+                    v[ i * n + q ] = s * vp + c * vq;
+                }
+            }
+        }
+
+        if ( offmax <= eps )
+            break;
+    }
+}
+
+// Mask approximated as sum of rank-1 kernels :
+//   mask( mx, my ) ~= sum( cols[r][my] * rows[r][mx] ), r < rank
+// Weights are normalized by total, like outf /= total.
+struct SeparableKernel
+{
+    unsigned        bkw;
+    unsigned        bkh;
+    unsigned        rank;
+    float           error;  /// relative Frobenius error of approximation.
+    vector<float>   rows;   /// rank x bkw, horizontal kernels.
+    vector<float>   cols;   /// rank x bkh, vertical kernels.
+};
+
+static bool decomposeMask( const PlanarImage &maskf, float errbudget,
+                           SeparableKernel &sk )
+{
+    perf::Timer timer( perf::KERNEL );
+
+    unsigned bkw = maskf.w;
+    unsigned bkh = maskf.h;
+    float    total = 0;
+
+    for( unsigned my=0; my<bkh; my++ )
+    {
+        for( unsigned mx=0; mx<bkw; mx++ )
+        {
+            total += maskWeight( maskf, mx, my );
+        }
+    }
+
+    if ( total <= 0.f )
+        return false;
+
+    // Jacobi costs n^2 x m per sweep, so let n be the shorter side.
+    bool     trans = bkw > bkh;
+    unsigned m     = trans ? bkw : bkh;
+    unsigned n     = trans ? bkh : bkw;
+
+    vector<double> a( m * n );
+    vector<double> v;
+
+    for( unsigned my=0; my<bkh; my++ )
+    {
+        for( unsigned mx=0; mx<bkw; mx++ )
+        {
+            float wgt = maskWeight( maskf, mx, my );
+
+            if ( trans == true )
+            {
+                a[ mx * n + my ] = wgt / total;
+            }
+            else
+            {
+                a[ my * n + mx ] = wgt / total;
+            }
+        }
+    }
+
+    jacobiSVD( a, m, n, v );
+
+    vector<double>   sv( n, 0.0 );
+    vector<unsigned> order( n );
+    double           energy = 0.0;
+
+    for( unsigned j=0; j<n; j++ )
+    {
+        for( unsigned i=0; i<m; i++ )
+        {
+            sv[j] += a[ i * n + j ] * a[ i * n + j ];
+        }
+
+        energy  += sv[j];
+        order[j] = j;
+    }
+
+    if ( energy <= 0.0 )
+        return false;
+
+    sort( order.begin(), order.end(), 
+          [&sv]( unsigned l, unsigned r ) { return sv[l] > sv[r]; } );
+
+    // smallest rank keeps residual energy within budget.
+    double   kept = 0.0;
+    unsigned rank = 0;
+
+    while( rank < n )
+    {
+        kept += sv[ order[rank] ];
+        rank++;
+
+        if ( sqrt( max( 0.0, energy - kept ) / energy ) <= errbudget )
+            break;
+    }
+
+    sk.bkw   = bkw;
+    sk.bkh   = bkh;
+    sk.rank  = rank;
+    sk.error = (float)sqrt( max( 0.0, energy - kept ) / energy );
+    sk.rows.assign( rank * bkw, 0.f );
+    sk.cols.assign( rank * bkh, 0.f );
+
+    // U * S column goes to longer side, V column to shorter side.
+    for( unsigned r=0; r<rank; r++ )
+    {
+        unsigned j = order[r];
+
+        for( unsigned i=0; i<m; i++ )
+        {
+            if ( trans == true )
+                sk.rows[ r * bkw + i ] = (float)a[ i * n + j ];
+            else
+                sk.cols[ r * bkh + i ] = (float)a[ i * n + j ];
+        }
+
+        for( unsigned i=0; i<n; i++ )
+        {
+            if ( trans == true )
+                sk.cols[ r * bkh + i ] = (float)v[ i * n + j ];
+            else
+                sk.rows[ r * bkw + i ] = (float)v[ i * n + j ];
+        }
+    }
+
+    return true;
+}
+
+// dst[i] = sum( kern[j] * src[ ( i - j - off ) % n ] ), wrapped around.
+static void convolveRow( const float* src, float* dst, unsigned n,
+                         const float* kern, unsigned klen, unsigned off )
+{
+    for( unsigned i=0; i<n; i++ )
+    {
+        dst[i] = 0.f;
+    }
+
+    for( unsigned j=0; j<klen; j++ )
+    {
+        const float wgt = kern[j];
+
+        if ( wgt == 0.f )
+            continue;
+
+        unsigned d = ( j + off ) % n;
+
+        simd::axpy( dst, &src[ n - d ], wgt, d );
+        simd::axpy( dst + d, src, wgt, n - d );
+    }
+}
+
+// Transposes by 32x32 blocks, so both of read and write stays in cache.
+// dst must be sized src.h x src.w.
+static void transposeImage( const PlanarImage &src, PlanarImage &dst )
+{
+    const unsigned blk = 32;
+
+    pool::parallelFor( ( src.h + blk - 1 ) / blk, (double)blk * src.w * 3, 
+                       [&]( unsigned b0, unsigned b1, unsigned )
+    {
+        for( unsigned by=b0*blk; by<min( src.h, b1*blk ); by+=blk )
+        {
+            unsigned ey = min( src.h, by + blk );
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                for( unsigned bx=0; bx<src.w; bx+=blk )
+                {
+                    unsigned ex = min( src.w, bx + blk );
+
+                    for( unsigned y=by; y<ey; y++ )
+                    {
+                        const float* srow = src.row( c, y );
+
+                        for( unsigned x=bx; x<ex; x++ )
+                        {
+                            dst.row( c, x )[y] = srow[x];
+                        }
+                    }
+                }
+            }
+        }
+    } );
+}
+
+// Engine of compiled kernel : spans for flat masks, or tiled gather.
+static void convolveKernel( const PlanarImage &srcf, const BokehKernel &kernel,
+                            PlanarImage &outf )
+{
+    if ( useSpans( kernel ) == true )
+    {
+        spanConvolve( srcf, kernel, outf );
+    }
+    else
+    if ( tile_w > 0 )
+    {
+        tiledConvolve( srcf, kernel, outf, tile_w, tile_h );
+    }
+    else
+    {
+        gatherConvolve( srcf, kernel, outf );
+    }
+}
+
+// Engine selected by BokehEngine.
+static void convolveEngine( const PlanarImage &srcf, const BokehKernel &kernel,
+                            unsigned engine, PlanarImage &outf )
+{
+    switch( engine )
+    {
+        case BOKEH_ENGINE_TILED:
+            tiledConvolve( srcf, kernel, outf, tile_w > 0 ? tile_w : 256, tile_h );
+            break;
+
+        case BOKEH_ENGINE_GATHER:
+            gatherConvolve( srcf, kernel, outf );
+            break;
+
+        default:
+            convolveKernel( srcf, kernel, outf );
+            break;
+    }
+}
+
+static inline const unsigned char* rasterRow( const BokehRaster &r, unsigned y )
+{
+    return (const unsigned char*)r.pixels + (ptrdiff_t)y * r.rowstride;
+}
+
+static inline unsigned char* rasterRow( BokehRaster &r, unsigned y )
+{
+    return (unsigned char*)r.pixels + (ptrdiff_t)y * r.rowstride;
+}
+
+static inline float readRasterSample( const unsigned char* p, unsigned format )
+{
+    switch( format )
+    {
+        case BOKEH_RASTER_U16BE:
+            return (float)( ( p[0] << 8 ) | p[1] );
+
+        case BOKEH_RASTER_F32LE:
+        case BOKEH_RASTER_F32BE:
+            {
+                unsigned char b[4] = { p[0], p[1], p[2], p[3] };
+                float         f;
+
+                if ( format == BOKEH_RASTER_F32BE )
+                {
+                    std::swap( b[0], b[3] );
+                    std::swap( b[1], b[2] );
+                }
+
+                memcpy( &f, b, 4 );
+                return f;
+            }
+
+        default:
+            return (float)p[0];
+    }
+}
+
+static inline void writeRasterSample( unsigned char* p, unsigned format, float v )
+{
+    switch( format )
+    {
+        case BOKEH_RASTER_U16BE:
+            {
+                unsigned u = max( 0.f, min( 1.f, v ) ) * 65535.f;
+
+                p[0] = u >> 8;
+                p[1] = u & 0xFF;
+            }
+            break;
+
+        case BOKEH_RASTER_F32LE:
+        case BOKEH_RASTER_F32BE:
+            memcpy( p, &v, 4 );
+
+            if ( format == BOKEH_RASTER_F32BE )
+            {
+                std::swap( p[0], p[3] );
+                std::swap( p[1], p[2] );
+            }
+            break;
+
+        default:
+            p[0] = max( 0.f, min( 1.f, v ) ) * 255.f;
+            break;
+    }
+}
+
+static unsigned rasterSampleSize( unsigned format )
+{
+    switch( format )
+    {
+        case BOKEH_RASTER_U8:       return 1;
+        case BOKEH_RASTER_U16BE:    return 2;
+        case BOKEH_RASTER_F32LE:
+        case BOKEH_RASTER_F32BE:    return 4;
+    }
+
+    return 0;
+}
+
+// Raster to planar by rows, as same as loadPlanarFromMemory().
+// 8 bit of full range goes to vector unpacking straight from raster.
+static PlanarImage loadPlanarFromRaster( const BokehRaster &r )
+{
+    perf::Timer timer( perf::UNPACK );
+
+    const unsigned ssz = rasterSampleSize( r.format );
+
+    if ( ( r.pixels == NULL ) || ( r.w == 0 ) || ( r.h == 0 ) || ( ssz == 0 )
+         || ( ( r.d != 1 ) && ( r.d != 3 ) && ( r.d != 4 ) ) || ( r.range <= 0.f ) )
+        return PlanarImage();
+
+    PlanarImage img( r.w, r.h );
+
+    if ( img.empty() == true )
+        return img;
+
+    const bool  direct = ( r.format == BOKEH_RASTER_U8 ) && ( r.range == 255.f );
+    const float inv    = 1.f / r.range;
+    const HighlightSetting light = highlights();
+
+    pool::parallelFor( r.h, r.w * 4, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for ( unsigned y=y0; y<y1; y++ ) 
+        {
+            const unsigned char* src = rasterRow( r, y );
+            float* pr = img.row( 0, y );
+            float* pg = img.row( 1, y );
+            float* pb = img.row( 2, y );
+
+            if ( direct == true )
+            {
+                simd::unpackRGB( src, r.d, pr, pg, pb, r.w, 
+                                 light.level, light.boost );
+                continue;
+            }
+
+            for( unsigned x=0; x<r.w; x++ )
+            {
+                const unsigned char* p = src + (size_t)x * r.d * ssz;
+                float pix[3];
+
+                for( unsigned c=0; c<3; c++ )
+                {
+                    pix[c] = readRasterSample( p + ( r.d >= 3 ? c : 0 ) * ssz, 
+                                               r.format ) * inv;
+                }
+
+                if ( r.d == 4 )
+                {
+                    float af = readRasterSample( p + 3 * ssz, r.format ) * inv;
+
+                    pix[0] *= af;
+                    pix[1] *= af;
+                    pix[2] *= af;
+                }
+
+                if ( ( pix[0] > light.level ) && ( pix[1] > light.level ) 
+                     && ( pix[2] > light.level ) )
+                {
+                    pix[0] *= light.boost;
+                    pix[1] *= light.boost;
+                    pix[2] *= light.boost;
+                }
+
+                pr[x] = pix[0];
+                pg[x] = pix[1];
+                pb[x] = pix[2];
+            }
+        }
+    } );
+
+    return img;
+}
+
+// Float rasters keep values as is, integers are clamped.
+static bool savePlanarToRaster( const PlanarImage &img, BokehRaster &r )
+{
+    perf::Timer timer( perf::PACK );
+
+    const unsigned ssz = rasterSampleSize( r.format );
+
+    if ( ( r.pixels == NULL ) || ( r.w != img.w ) || ( r.h != img.h ) 
+         || ( r.d != 3 ) || ( ssz == 0 ) )
+        return false;
+
+    pool::parallelFor( img.h, img.w * 4, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            unsigned char* dst = rasterRow( r, y );
+
+            if ( r.format == BOKEH_RASTER_U8 )
+            {
+                simd::packRGB( img.row( 0, y ), img.row( 1, y ), img.row( 2, y ),
+                               dst, img.w );
+                continue;
+            }
+
+            for( unsigned x=0; x<img.w; x++ )
+            {
+                for( unsigned c=0; c<3; c++ )
+                {
+                    writeRasterSample( dst + ( (size_t)x * 3 + c ) * ssz, r.format,
+                                       img.row( c, y )[x] );
+                }
+            }
+        }
+    } );
+
+    return true;
+}
+
+const char* GetBokehSIMD()
+{
+    return simd::levelName( simd::level() );
+}
+
+unsigned GetBokehThreads()
+{
+    return pool::threads();
+}
+
+void SetBokehThreads( unsigned n )
+{
+    pool::setThreads( n );
+}
+
+void SetBokehPinning( bool pin )
+{
+    pool::setPinning( pin );
+}
+
+void GetBokehMemoryStats( BokehMemoryStats &stats )
+{
+    arena::Stats st = arena::current().stats();
+
+    stats.requests    = st.requests;
+    stats.allocs      = st.allocs;
+    stats.reuses      = st.reuses;
+    stats.peakbytes   = st.peak;
+    stats.cachedbytes = st.cached;
+    stats.hugebytes   = st.huge;
+}
+
+void ResetBokehMemoryStats()
+{
+    arena::current().resetStats();
+}
+
+void GetBokehStats( BokehStats &stats )
+{
+    perf::Stats st = perf::current().stats();
+
+    for( unsigned cnt=0; cnt<BOKEH_STAGE_MAX; cnt++ )
+    {
+        const perf::StageStats &ss  = st.stages[cnt];
+        BokehStageStats        &dst = stats.stages[cnt];
+
+        dst.calls        = ss.calls;
+        dst.ns           = ss.ns;
+        dst.bytes        = ss.bytes;
+        dst.taps         = ss.taps;
+        dst.threads      = ss.threads;
+        dst.cycles       = ss.counters[ perf::CYCLES ];
+        dst.instructions = ss.counters[ perf::INSTRUCTIONS ];
+        dst.llcmisses    = ss.counters[ perf::LLC_MISSES ];
+    }
+
+    stats.bytes    = st.bytes;
+    stats.counters = perf::counters();
+}
+
+void ResetBokehStats()
+{
+    perf::current().reset();
+}
+
+const char* GetBokehStageName( unsigned stage )
+{
+    return perf::stageName( (perf::Stage)stage );
+}
+
+bool SetBokehCounters( bool enable )
+{
+    return perf::setCounters( enable );
+}
+
+void SetBokehHugePages( bool enable )
+{
+    arena::current().setHugePages( enable );
+}
+
+void TrimBokehMemory()
+{
+    arena::current().trim();
+}
+
+float GetBokehIntensity()
+{
+    return highlight_default.level;
+}
+
+void SetBokehIntensity( float level )
+{
+    highlight_default.level = level;
+}
+
+// Shift of source by a tap of legacy engines, weighted by mask pixel.
+// Same as weight * circshift( src, sx, sy ).
+struct ShiftTap
+{
+    Image::RGBf weight;
+    unsigned    sx;
+    unsigned    sy;
+};
+
+// Legacy engines sum shifted sources to outf.
+// Each output row is summed by one worker, over taps in order of mask,
+// so result is same to bits for any count of threads.
+static void accumulateShifts( const Image &srcf, const vector<ShiftTap> &taps,
+                              Image &outf )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    const unsigned w = srcf.w;
+    const unsigned h = srcf.h;
+
+    perf::addTaps( (unsigned long long)taps.size() * w * h );
+
+    pool::parallelFor( h, (double)taps.size() * w * 3, 
+                       [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            Image::RGBf* dst = &outf( 0, y );
+
+            for( size_t cnt=0; cnt<taps.size(); cnt++ )
+            {
+                const Image::RGBf  wgt = taps[cnt].weight;
+                const unsigned     sx  = taps[cnt].sx % w;
+                const unsigned     sy  = ( y + h - taps[cnt].sy % h ) % h;
+                const Image::RGBf* src = &srcf( 0, sy );
+
+                // dst[x] gets src[ x - sx ], wrapped part first.
+                for( unsigned x=0; x<sx; x++ )
+                {
+                    const Image::RGBf &pix = src[ x + w - sx ];
+
+                    dst[x].r += wgt.r * pix.r;
+                    dst[x].g += wgt.g * pix.g;
+                    dst[x].b += wgt.b * pix.b;
+                }
+
+                for( unsigned x=sx; x<w; x++ )
+                {
+                    const Image::RGBf &pix = src[ x - sx ];
+
+                    dst[x].r += wgt.r * pix.r;
+                    dst[x].g += wgt.g * pix.g;
+                    dst[x].b += wgt.b * pix.b;
+                }
+            }
+        }
+    } );
+}
+
+bool ProcessBokeh( const unsigned char* srcptr, 
+                   unsigned srcw, unsigned srch, unsigned srcd,
+                   const unsigned char* bokeh,  
+                   unsigned char* &outptr )
+{
+    Image srcf  = loadFromMemory( srcptr, srcw, srch, srcd );   
+    Image maskf = loadFromMemory( bokeh, srcw, srch, 1 );
+    Image outf( srcw, srch );
+
+    float total = 0;
+    Image::RGBf kBlack = Image::RGBf(0);
+   
+    vector<ShiftTap> taps;
+
+    {
+        perf::Timer timer( perf::KERNEL );
+
+        for ( unsigned y=0; y<srch; y++ ) 
+        {
+            for ( unsigned x=0; x<srcw; x++ ) 
+            {
+                if ( maskf(x, y) != kBlack ) 
+                {
+                    ShiftTap tap = { maskf(x, y), x, y };
+
+                    taps.push_back( tap );
+                    total += maskf(x, y);
+                }
+            }
+        }
+    }
+
+    accumulateShifts( srcf, taps, outf );
+
+    // divided and packed in one pass.
+    return saveToMemory( outf / total, outptr );
+}
+
+static BokehContext* createContext( const BokehConfig &config, 
+                                    const unsigned char* bokeh,  
+                                    unsigned bkw, unsigned bkh,
+                                    arena::Arena* mem );
+
+bool ProcessFastBokeh( const unsigned char* srcptr, 
+                       unsigned srcw, unsigned srch, unsigned srcd,
+                       const unsigned char* bokeh,  
+                       unsigned bkw, unsigned bkh,
+                       unsigned char* &outptr )
+{
+    // check mask size.
+    if ( ( srcw < bkw ) || ( srch < bkh ) ) 
+        return false;
+
+    BokehConfig config;
+    InitBokehConfig( config );
+
+    config.anchorx = 0;
+    config.anchory = bkh;
+
+    // buffers go to arena of caller, recycled between calls.
+    BokehContext* ctx = createContext( config, bokeh, bkw, bkh, &arena::current() );
+
+    if ( ctx == NULL )
+        return false;
+
+    outptr = new unsigned char[ (size_t)srcw * srch * 3 ];
+
+    bool retb = ProcessBokehContext( ctx, srcptr, srcw, srch, srcd, 0,
+                                     outptr, 0, 3 );
+
+    DiscardBokehContext( ctx );
+
+    if ( retb == false )
+    {
+        delete[] outptr;
+        outptr = NULL;
+    }
+
+    return retb;
+}
+
+bool ProcessGatherBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const unsigned char* bokeh,  
+                         unsigned bkw, unsigned bkh,
+                         unsigned char* &outptr )
+{
+    BokehKernel* kernel = CompileBokehKernel( bokeh, bkw, bkh );
+
+    if ( kernel == nullptr )
+        return false;
+
+    bool retb = ProcessKernelBokeh( srcptr, srcw, srch, srcd, kernel, outptr );
+
+    DiscardBokehKernel( kernel );
+
+    return retb;
+}
+
+BokehKernel* CompileBokehKernel( const unsigned char* bokeh,  
+                                 unsigned bkw, unsigned bkh )
+{
+    PlanarImage maskf = loadPlanarFromMemory( bokeh, bkw, bkh, 1 );
+
+    if ( maskf.empty() == true )
+        return nullptr;
+
+    BokehKernel* kernel = new BokehKernel;
+
+    if ( compileKernel( maskf, *kernel ) == false )
+    {
+        delete kernel;
+        return nullptr;
+    }
+
+    return kernel;
+}
+
+void DiscardBokehKernel( BokehKernel* &kernel )
+{
+    if ( kernel != nullptr )
+    {
+        delete kernel;
+        kernel = nullptr;
+    }
+}
+
+unsigned BokehKernelTaps( const BokehKernel* kernel )
+{
+    if ( kernel == nullptr )
+        return 0;
+
+    return kernel->taps.size();
+}
+
+bool ProcessKernelBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const BokehKernel* kernel,
+                         unsigned char* &outptr )
+{
+    if ( kernel == nullptr )
+        return false;
+
+    // check mask size.
+    if ( ( srcw < kernel->w ) || ( srch < kernel->h ) ) 
+        return false;
+
+    PlanarImage srcf = loadPlanarFromMemory( srcptr, srcw, srch, srcd );   
+
+    if ( srcf.empty() == true )
+        return false;
+
+    PlanarImage outf( srcw, srch );
+
+    if ( outf.empty() == true )
+        return false;
+
+    convolveKernel( srcf, *kernel, outf );
+
+    return savePlanarToMemory( outf, outptr );
+}
+
+bool ProcessFixedBokeh( const unsigned char* srcptr, 
+                        unsigned srcw, unsigned srch, unsigned srcd,
+                        const BokehKernel* kernel,
+                        unsigned char* &outptr )
+{
+    if ( ( kernel == nullptr ) || ( kernel->qtotal == 0 ) )
+        return false;
+
+    // check mask size.
+    if ( ( srcw < kernel->w ) || ( srch < kernel->h ) ) 
+        return false;
+
+    FixedImage srcf( srcw, srch );
+
+    if ( loadFixedFromMemory( srcptr, srcw, srch, srcd, srcf ) == false )
+        return false;
+
+    outptr = new unsigned char[ (size_t)srcw * srch * 3 ];
+
+    if ( outptr == NULL )
+        return false;
+
+    tiledConvolveFixed( srcf, *kernel, outptr, tile_w, tile_h );
+
+    return true;
+}
+
+bool ProcessStreamBokeh( unsigned srcw, unsigned srch, unsigned srcd,
+                         BokehRowReader reader, void* rdparam,
+                         const BokehKernel* kernel,
+                         BokehRowWriter writer, void* wrparam,
+                         unsigned band )
+{
+    if ( ( reader == nullptr ) || ( writer == nullptr ) || ( kernel == nullptr ) )
+        return false;
+
+    if ( ( srcw < kernel->w ) || ( srch < kernel->h ) || ( srcd == 0 ) ) 
+        return false;
+
+    const unsigned          ntaps = kernel->taps.size();
+    const BokehKernel::Tap* taps  = &kernel->taps[0];
+    // taps are sorted by dy.
+    const unsigned          dymin = taps[0].dy;
+    const unsigned          dymax = taps[ ntaps - 1 ].dy;
+
+    band = min( max( band, 1u ), srch );
+
+    // Output rows of a band read source rows [ y0 + dymin, y1 + dymax ),
+    // kept in ring. Last rows wrap around to first dymax rows of source,
+    // so these are kept from start.
+    const unsigned ringh = band + dymax - dymin;
+    PlanarImage    ring( srcw, ringh );
+    PlanarImage    top( srcw, dymax );
+    PlanarImage    outf( srcw, band );
+    // source rows of a band, at most first band with its lower rows.
+    const size_t          rawbytes = (size_t)srcw * srcd;
+    vector<unsigned char> rawrows( rawbytes * ( band + dymax ) );
+    vector<unsigned char> outrows( (size_t)srcw * band * 3 );
+
+    if ( ( ring.empty() == true ) || ( top.empty() == true ) 
+         || ( outf.empty() == true ) )
+        return false;
+
+    const HighlightSetting light = highlights();
+    unsigned loaded = 0;
+
+    for( unsigned y0=0; y0<srch; y0+=band )
+    {
+        const unsigned y1   = min( y0 + band, srch );
+        const unsigned need = min( y1 - 1 + dymax + 1, srch );
+
+        const unsigned first = loaded;
+
+        // rows of band are read before unpacked, so reader is not timed.
+        for( ; loaded<need; loaded++ )
+        {
+            if ( reader( loaded, &rawrows[ rawbytes * ( loaded - first ) ], rdparam ) == false )
+                return false;
+        }
+
+        if ( first < loaded )
+        {
+            perf::Timer timer( perf::UNPACK );
+
+            for( unsigned y=first; y<loaded; y++ )
+            {
+                unsigned slot = y % ringh;
+
+                simd::unpackRGB( &rawrows[ rawbytes * ( y - first ) ], srcd,
+                                 ring.row( 0, slot ), ring.row( 1, slot ), 
+                                 ring.row( 2, slot ), srcw, 
+                                 light.level, light.boost );
+
+                if ( y < dymax )
+                {
+                    for( unsigned c=0; c<3; c++ )
+                    {
+                        memcpy( top.row( c, y ), ring.row( c, slot ),
+                                srcw * sizeof(float) );
+                    }
+                }
+            }
+        }
+
+        {
+            // output rows are packed in same loop.
+            perf::Timer timer( perf::CONVOLVE );
+
+            perf::addTaps( (unsigned long long)ntaps * srcw * ( y1 - y0 ) );
+
+            outf.clear();
+
+            pool::parallelFor( y1 - y0, (double)ntaps * srcw * 3,
+                               [&]( unsigned r0, unsigned r1, unsigned )
+            {
+                for( unsigned y=y0+r0; y<y0+r1; y++ )
+                {
+                    for( unsigned c=0; c<3; c++ )
+                    {
+                        float* dst = outf.row( c, y - y0 );
+
+                        for( unsigned cnt=0; cnt<ntaps; cnt++ )
+                        {
+                            const unsigned mx  = taps[cnt].dx;
+                            const float    wgt = taps[cnt].weight;
+                            const unsigned sy  = y + taps[cnt].dy;
+                            const float*   src = sy < srch ? ring.row( c, sy % ringh )
+                                                           : top.row( c, sy - srch );
+
+                            // wrapped part of row, then straight part.
+                            simd::axpy( dst, &src[ srcw - mx ], wgt, mx );
+                            simd::axpy( dst + mx, src, wgt, srcw - mx );
+                        }
+                    }
+
+                    simd::packRGB( outf.row( 0, y - y0 ), outf.row( 1, y - y0 ), 
+                                   outf.row( 2, y - y0 ),
+                                   &outrows[ (size_t)( y - y0 ) * srcw * 3 ], srcw );
+                }
+            } );
+        }
+
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            if ( writer( y, &outrows[ (size_t)( y - y0 ) * srcw * 3 ], wrparam ) == false )
+                return false;
+        }
+    }
+
+    return true;
+}
+
+BokehKernel* CompileRasterKernel( const BokehRaster &mask )
+{
+    PlanarImage maskf = loadPlanarFromRaster( mask );
+
+    if ( maskf.empty() == true )
+        return nullptr;
+
+    BokehKernel* kernel = new BokehKernel;
+
+    if ( compileKernel( maskf, *kernel ) == false )
+    {
+        delete kernel;
+        return nullptr;
+    }
+
+    return kernel;
+}
+
+bool ProcessRasterBokeh( const BokehRaster &src, const BokehKernel* kernel,
+                         BokehRaster &dst )
+{
+    if ( kernel == nullptr )
+        return false;
+
+    if ( ( src.w < kernel->w ) || ( src.h < kernel->h ) 
+         || ( dst.w != src.w ) || ( dst.h != src.h ) ) 
+        return false;
+
+    PlanarImage srcf = loadPlanarFromRaster( src );
+
+    if ( srcf.empty() == true )
+        return false;
+
+    PlanarImage outf( src.w, src.h );
+
+    if ( outf.empty() == true )
+        return false;
+
+    convolveKernel( srcf, *kernel, outf );
+
+    return savePlanarToRaster( outf, dst );
+}
+
+void SetBokehTileSize( unsigned tilew, unsigned tileh )
+{
+    tile_w = tilew;
+    tile_h = max( tileh, 1u );
+}
+
+void GetBokehTileSize( unsigned &tilew, unsigned &tileh )
+{
+    tilew = tile_w;
+    tileh = tile_h;
+}
+
+bool AutotuneBokehTiles( const BokehKernel* kernel,
+                         unsigned &tilew, unsigned &tileh )
+{
+    if ( ( kernel == nullptr ) || ( kernel->taps.size() == 0 ) )
+        return false;
+
+    // results cached by mask size, for this process.
+    static map< pair<unsigned,unsigned>, pair<unsigned,unsigned> > cache;
+    static mutex cachemtx;
+
+    {
+        lock_guard<mutex> lock( cachemtx );
+
+        pair<unsigned,unsigned> key( kernel->w, kernel->h );
+
+        if ( cache.find( key ) == cache.end() )
+        {
+            // synthetic frame, large enough to have many tiles per thread.
+            const unsigned tw[] = { 64, 128, 256, 512, 0 };
+            const unsigned th[] = { 8, 16, 32, 64 };
+            unsigned       fw   = max( 768u, kernel->w * 4 );
+            unsigned       fh   = max( 256u, kernel->h * 4 );
+            PlanarImage    srcf( fw, fh );
+            PlanarImage    outf( fw, fh );
+            double         best = -1.0;
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                for( unsigned y=0; y<fh; y++ )
+                {
+                    for( unsigned x=0; x<fw; x++ )
+                    {
+                        srcf.row( c, y )[x] = (float)( ( x * 7 + y * 13 + c ) % 256 ) / 255.f;
+                    }
+                }
+            }
+
+            pair<unsigned,unsigned> found( 0, 1 );
+
+            for( unsigned cx=0; cx<sizeof(tw)/sizeof(unsigned); cx++ )
+            {
+                for( unsigned cy=0; cy<sizeof(th)/sizeof(unsigned); cy++ )
+                {
+                    // whole rows have no tile height.
+                    if ( ( tw[cx] == 0 ) && ( cy > 0 ) )
+                        continue;
+
+                    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+
+                    if ( tw[cx] > 0 )
+                    {
+                        tiledConvolve( srcf, *kernel, outf, tw[cx], th[cy] );
+                    }
+                    else
+                    {
+                        outf.clear();
+                        gatherConvolve( srcf, *kernel, outf );
+                    }
+
+                    double elapsed = chrono::duration<double>( chrono::steady_clock::now() - t0 ).count();
+
+                    if ( ( best < 0.0 ) || ( elapsed < best ) )
+                    {
+                        best  = elapsed;
+                        found = make_pair( tw[cx], tw[cx] > 0 ? th[cy] : 1u );
+                    }
+                }
+            }
+
+            cache[ key ] = found;
+        }
+
+        tilew = cache[ key ].first;
+        tileh = cache[ key ].second;
+    }
+
+    SetBokehTileSize( tilew, tileh );
+
+    return true;
+}
+
+bool ProcessFFTBokeh( const unsigned char* srcptr, 
+                      unsigned srcw, unsigned srch, unsigned srcd,
+                      const unsigned char* bokeh,  
+                      unsigned bkw, unsigned bkh,
+                      unsigned char* &outptr )
+{
+    // check mask size.
+    if ( ( srcw < bkw ) || ( srch < bkh ) ) 
+        return false;
+
+    PlanarImage srcf  = loadPlanarFromMemory( srcptr, srcw, srch, srcd );   
+    PlanarImage maskf = loadPlanarFromMemory( bokeh, bkw, bkh, 1 );
+
+    if ( ( srcf.empty() == true ) || ( maskf.empty() == true ) )
+        return false;
+
+    BokehKernel bk;
+
+    if ( compileKernel( maskf, bk ) == false )
+        return false;
+
+    PlanarImage outf( srcw, srch );
+
+    if ( outf.empty() == true )
+        return false;
+
+    {
+        // no taps, transforms cost the same for any mask.
+        perf::Timer timer( perf::CONVOLVE );
+
+        // circshift() wraps around, so all shifts and sums are exactly a
+        // circular convolution of source with a srcw x srch kernel plane,
+        // having each tap at ( dx, -dy ) :
+        //   out = IFFT( FFT( src ) * FFT( kernel ) )
+        // Kernel is normalized already, so no division after.
+        fft::RealPlan2D plan( srcw, srch );
+
+        unsigned          planesz = srcw * srch;
+        vector<float>     kernel( planesz, 0.f );
+        vector<fft::cpx>  kspec( plan.spectrumSize() );
+        vector<fft::cpx>  sspec( plan.spectrumSize() );
+
+        for( size_t cnt=0; cnt<bk.taps.size(); cnt++ )
+        {
+            const BokehKernel::Tap &tap = bk.taps[cnt];
+            unsigned                ky  = ( srch - tap.dy ) % srch;
+
+            kernel[ ky * srcw + tap.dx ] = tap.weight;
+        }
+
+        plan.forward( &kernel[0], srcw, &kspec[0] );
+
+        unsigned specsz = plan.spectrumSize();
+
+        // each of RGB channel transformed once.
+        for( unsigned ch=0; ch<3; ch++ )
+        {
+            plan.forward( srcf.planes[ch], srcf.stride, &sspec[0] );
+
+            pool::parallelFor( specsz, 6, [&]( unsigned i0, unsigned i1, unsigned )
+            {
+                for( unsigned cnt=i0; cnt<i1; cnt++ )
+                {
+                    sspec[cnt] *= kspec[cnt];
+                }
+            } );
+
+            plan.inverse( &sspec[0], outf.planes[ch], outf.stride );
+        }
+    }
+
+    return savePlanarToMemory( outf, outptr );
+}
+
+unsigned AnalyseBokehMask( const unsigned char* bokeh, 
+                           unsigned bkw, unsigned bkh,
+                           float errbudget )
+{
+    PlanarImage     maskf = loadPlanarFromMemory( bokeh, bkw, bkh, 1 );
+    SeparableKernel sk;
+
+    if ( maskf.empty() == true )
+        return 0;
+
+    if ( decomposeMask( maskf, errbudget, sk ) == false )
+        return 0;
+
+    return sk.rank;
+}
+
+bool ProcessSeparableBokeh( const unsigned char* srcptr, 
+                            unsigned srcw, unsigned srch, unsigned srcd,
+                            const unsigned char* bokeh,  
+                            unsigned bkw, unsigned bkh,
+                            unsigned char* &outptr,
+                            float errbudget )
+{
+    // check mask size.
+    if ( ( srcw < bkw ) || ( srch < bkh ) ) 
+        return false;
+
+    PlanarImage srcf  = loadPlanarFromMemory( srcptr, srcw, srch, srcd );   
+    PlanarImage maskf = loadPlanarFromMemory( bokeh, bkw, bkh, 1 );
+
+    if ( ( srcf.empty() == true ) || ( maskf.empty() == true ) )
+        return false;
+
+    SeparableKernel sk;
+
+    if ( decomposeMask( maskf, errbudget, sk ) == false )
+        return false;
+
+    PlanarImage outf( srch, srcw );   /// transposed, until end.
+    PlanarImage hpass( srcw, srch );
+    PlanarImage hpassT( srch, srcw );
+
+    if ( ( outf.empty() == true ) || ( hpass.empty() == true ) 
+         || ( hpassT.empty() == true ) )
+        return false;
+
+    {
+        // rank x ( bkw + bkh ) taps per pixel.
+        perf::Timer timer( perf::CONVOLVE );
+
+        perf::addTaps( (unsigned long long)sk.rank * ( bkw + bkh ) * srcw * srch );
+
+        // line buffer per worker for vertical pass.
+        vector< vector<float> > lines( pool::threads() );
+
+        for( unsigned r=0; r<sk.rank; r++ )
+        {
+            const float* rowk = &sk.rows[ r * bkw ];
+            const float* colk = &sk.cols[ r * bkh ];
+
+            // horizontal : tap mx shifts by mx.
+            pool::parallelFor( srch, (double)bkw * srcw * 3,
+                               [&]( unsigned y0, unsigned y1, unsigned )
+            {
+                for( unsigned y=y0; y<y1; y++ )
+                {
+                    for( unsigned c=0; c<3; c++ )
+                    {
+                        convolveRow( srcf.row( c, y ), hpass.row( c, y ),
+                                     srcw, rowk, bkw, 0 );
+                    }
+                }
+            } );
+
+            transposeImage( hpass, hpassT );
+
+            // vertical, as rows of transposed : tap my shifts by srch - bkh + my.
+            pool::parallelFor( srcw, (double)bkh * srch * 3,
+                               [&]( unsigned x0, unsigned x1, unsigned worker )
+            {
+                vector<float> &line = lines[ worker ];
+
+                line.resize( srch );
+
+                for( unsigned x=x0; x<x1; x++ )
+                {
+                    for( unsigned c=0; c<3; c++ )
+                    {
+                        float* dst = outf.row( c, x );
+
+                        convolveRow( hpassT.row( c, x ), &line[0],
+                                     srch, colk, bkh, srch - bkh );
+
+                        for( unsigned y=0; y<srch; y++ )
+                        {
+                            dst[y] += line[y];
+                        }
+                    }
+                }
+            } );
+        }
+
+        transposeImage( outf, hpass );
+    }
+
+    return savePlanarToMemory( hpass, outptr );
+}
+
+// Scale of pyramid mode : power of 2, while smaller side of reduced
+// mask keeps lowside ( quality 0 ) to highside ( quality near 1 ) pixels.
+static unsigned pyramidScale( unsigned bkw, unsigned bkh, float quality,
+                              unsigned lowside = 8, unsigned highside = 64 )
+{
+    if ( quality >= 1.f )
+        return 1;
+
+    unsigned minside = lowside 
+                       + (unsigned)( max( quality, 0.f ) * ( highside - lowside ) );
+    unsigned side    = min( bkw, bkh );
+    unsigned scale   = 1;
+
+    while( side / ( scale * 2 ) >= minside )
+    {
+        scale *= 2;
+    }
+
+    return scale;
+}
+
+// Reduces by f x f blocks, average of pixels in image or sum for masks.
+// padtop rows of zero are inserted to top, as mask height must be
+// multiple of f to keep vertical offset of taps.
+static PlanarImage downsamplePlanar( const PlanarImage &src, unsigned f,
+                                     unsigned padtop, bool average )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    const unsigned dw = ( src.w + f - 1 ) / f;
+    const unsigned dh = ( src.h + padtop + f - 1 ) / f;
+
+    PlanarImage dst( dw, dh );
+
+    if ( dst.empty() == true )
+        return dst;
+
+    pool::parallelFor( dh, (double)f * f * dw * 3,
+                       [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            // source rows of block, padding rows skipped.
+            unsigned sy0 = max( y * f, padtop ) - padtop;
+            unsigned sy1 = min( ( y + 1 ) * f, src.h + padtop ) - padtop;
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                float* drow = dst.row( c, y );
+
+                for( unsigned sy=sy0; sy<sy1; sy++ )
+                {
+                    const float* srow = src.row( c, sy );
+
+                    for( unsigned x=0; x<dw; x++ )
+                    {
+                        unsigned sx1 = min( ( x + 1 ) * f, src.w );
+
+                        for( unsigned sx=x*f; sx<sx1; sx++ )
+                        {
+                            drow[x] += srow[sx];
+                        }
+                    }
+                }
+
+                if ( ( average == true ) && ( sy1 > sy0 ) )
+                {
+                    for( unsigned x=0; x<dw; x++ )
+                    {
+                        unsigned cols = min( ( x + 1 ) * f, src.w ) - x * f;
+
+                        drow[x] /= (float)( cols * ( sy1 - sy0 ) );
+                    }
+                }
+            }
+        }
+    } );
+
+    return dst;
+}
+
+// Bilinear, wrapping around as convolution does.
+// Pixel x of reduced image is center of block, x * f + ( f - 1 ) / 2.
+static void upsamplePlanar( const PlanarImage &src, unsigned f, PlanarImage &dst )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    vector<unsigned> x0( dst.w );
+    vector<unsigned> x1( dst.w );
+    vector<float>    tx( dst.w );
+
+    for( unsigned x=0; x<dst.w; x++ )
+    {
+        float    u = ( x + 0.5f ) / f - 0.5f + src.w;
+        unsigned i = (unsigned)u;
+
+        tx[x] = u - i;
+        x0[x] = i % src.w;
+        x1[x] = ( i + 1 ) % src.w;
+    }
+
+    pool::parallelFor( dst.h, (double)dst.w * 3 * 4,
+                       [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            float    v  = ( y + 0.5f ) / f - 0.5f + src.h;
+            unsigned j  = (unsigned)v;
+            float    ty = v - j;
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                const float* r0   = src.row( c, j % src.h );
+                const float* r1   = src.row( c, ( j + 1 ) % src.h );
+                float*       drow = dst.row( c, y );
+
+                for( unsigned x=0; x<dst.w; x++ )
+                {
+                    float a = r0[ x0[x] ] + ( r0[ x1[x] ] - r0[ x0[x] ] ) * tx[x];
+                    float b = r1[ x0[x] ] + ( r1[ x1[x] ] - r1[ x0[x] ] ) * tx[x];
+
+                    drow[x] = a + ( b - a ) * ty;
+                }
+            }
+        }
+    } );
+}
+
+// Boosted highlight pixel, convolved at full resolution.
+struct Highlight
+{
+    unsigned x;
+    float    r;
+    float    g;
+    float    b;
+};
+
+// Adds sparse highlights convolved by kernel : each output row gathers
+// highlights of source rows its taps read, in order of taps.
+static void highlightPass( const vector< vector<Highlight> > &rows, 
+                           const BokehKernel &kernel, PlanarImage &outf )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    const unsigned w = outf.w;
+    const unsigned h = outf.h;
+    const vector<BokehKernel::Tap> &taps = kernel.taps;
+
+    // taps are sorted by dy, so groups of same source row.
+    vector<size_t> groups;
+
+    for( size_t cnt=0; cnt<taps.size(); cnt++ )
+    {
+        if ( ( cnt == 0 ) || ( taps[cnt].dy != taps[cnt-1].dy ) )
+        {
+            groups.push_back( cnt );
+        }
+    }
+
+    groups.push_back( taps.size() );
+
+    size_t count = 0;
+
+    for( unsigned y=0; y<h; y++ )
+    {
+        count += rows[y].size();
+    }
+
+    if ( count == 0 )
+        return;
+
+    pool::parallelFor( h, (double)count * taps.size() * 3 / h,
+                       [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            float* dr = outf.row( 0, y );
+            float* dg = outf.row( 1, y );
+            float* db = outf.row( 2, y );
+
+            for( size_t grp=0; grp+1<groups.size(); grp++ )
+            {
+                const vector<Highlight> &hls = rows[ ( y + taps[ groups[grp] ].dy ) % h ];
+
+                for( size_t cnt=groups[grp]; cnt<groups[grp+1]; cnt++ )
+                {
+                    const float wgt = taps[cnt].weight;
+
+                    for( size_t hl=0; hl<hls.size(); hl++ )
+                    {
+                        unsigned x = hls[hl].x + taps[cnt].dx;
+
+                        if ( x >= w )
+                            x -= w;
+
+                        dr[x] += wgt * hls[hl].r;
+                        dg[x] += wgt * hls[hl].g;
+                        db[x] += wgt * hls[hl].b;
+                    }
+                }
+            }
+        }
+    } );
+}
+
+// Picks boosted pixels ( all channels over 1 ) for highlight pass,
+// brightest ones in budget of work, and takes them out of reduced source.
+static void selectHighlights( const PlanarImage &srcf, const BokehKernel &kernel,
+                              unsigned f, float quality, PlanarImage &smallsrc,
+                              vector< vector<Highlight> > &rows )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    struct Candidate
+    {
+        float    lum;
+        unsigned x;
+        unsigned y;
+    };
+
+    vector<Candidate> cands;
+
+    for( unsigned y=0; y<srcf.h; y++ )
+    {
+        const float* r = srcf.row( 0, y );
+        const float* g = srcf.row( 1, y );
+        const float* b = srcf.row( 2, y );
+
+        for( unsigned x=0; x<srcf.w; x++ )
+        {
+            if ( ( r[x] > 1.f ) && ( g[x] > 1.f ) && ( b[x] > 1.f ) )
+            {
+                Candidate cand = { r[x] + g[x] + b[x], x, y };
+
+                cands.push_back( cand );
+            }
+        }
+    }
+
+    // work of highlights up to ( 1 + 4 x quality ) times of reduced pass.
+    double budget = (double)srcf.w * srcf.h / ( (double)f * f ) 
+                    * ( (double)kernel.taps.size() / ( (double)f * f ) )
+                    * ( 1.0 + 4.0 * quality );
+    size_t maxcount = (size_t)( budget / max( (size_t)1, kernel.taps.size() ) );
+
+    if ( cands.size() > maxcount )
+    {
+        partial_sort( cands.begin(), cands.begin() + maxcount, cands.end(),
+                      []( const Candidate &l, const Candidate &r )
+                      { 
+                          if ( l.lum != r.lum )
+                              return l.lum > r.lum;
+
+                          return ( l.y < r.y ) || ( ( l.y == r.y ) && ( l.x < r.x ) );
+                      } );
+        cands.resize( maxcount );
+    }
+
+    rows.assign( srcf.h, vector<Highlight>() );
+
+    for( size_t cnt=0; cnt<cands.size(); cnt++ )
+    {
+        unsigned x = cands[cnt].x;
+        unsigned y = cands[cnt].y;
+        Highlight hl = { x, srcf.row( 0, y )[x], srcf.row( 1, y )[x], 
+                            srcf.row( 2, y )[x] };
+
+        rows[y].push_back( hl );
+
+        // average of block loses this pixel.
+        unsigned bx    = x / f;
+        unsigned by    = y / f;
+        unsigned cols  = min( ( bx + 1 ) * f, srcf.w ) - bx * f;
+        unsigned lines = min( ( by + 1 ) * f, srcf.h ) - by * f;
+        float    inv   = 1.f / (float)( cols * lines );
+
+        smallsrc.row( 0, by )[bx] -= hl.r * inv;
+        smallsrc.row( 1, by )[bx] -= hl.g * inv;
+        smallsrc.row( 2, by )[bx] -= hl.b * inv;
+    }
+
+    // kept in order of x for each row.
+    for( unsigned y=0; y<srcf.h; y++ )
+    {
+        sort( rows[y].begin(), rows[y].end(),
+              []( const Highlight &l, const Highlight &r ) { return l.x < r.x; } );
+    }
+}
+
+unsigned PyramidBokehScale( unsigned bkw, unsigned bkh, float quality )
+{
+    return pyramidScale( bkw, bkh, quality );
+}
+
+bool ProcessPyramidBokeh( const unsigned char* srcptr, 
+                          unsigned srcw, unsigned srch, unsigned srcd,
+                          const unsigned char* bokeh,  
+                          unsigned bkw, unsigned bkh,
+                          unsigned char* &outptr,
+                          float quality )
+{
+    // check mask size.
+    if ( ( srcw < bkw ) || ( srch < bkh ) ) 
+        return false;
+
+    PlanarImage srcf  = loadPlanarFromMemory( srcptr, srcw, srch, srcd );   
+    PlanarImage maskf = loadPlanarFromMemory( bokeh, bkw, bkh, 1 );
+    PlanarImage outf( srcw, srch );
+
+    if ( ( srcf.empty() == true ) || ( maskf.empty() == true ) 
+         || ( outf.empty() == true ) )
+        return false;
+
+    BokehKernel kernel;
+
+    if ( compileKernel( maskf, kernel ) == false )
+        return false;
+
+    const unsigned f = pyramidScale( bkw, bkh, quality );
+
+    if ( f == 1 )
+    {
+        convolveKernel( srcf, kernel, outf );
+
+        return savePlanarToMemory( outf, outptr );
+    }
+
+    const unsigned padtop    = ( bkh + f - 1 ) / f * f - bkh;
+    PlanarImage    smallsrc  = downsamplePlanar( srcf, f, 0, true );
+    PlanarImage    smallmask = downsamplePlanar( maskf, f, padtop, false );
+    BokehKernel    smallk;
+
+    if ( ( smallsrc.empty() == true ) || ( smallmask.empty() == true ) )
+        return false;
+
+    if ( compileKernel( smallmask, smallk ) == false )
+        return false;
+
+    vector< vector<Highlight> > hlrows;
+
+    selectHighlights( srcf, kernel, f, quality, smallsrc, hlrows );
+
+    PlanarImage smallout( smallsrc.w, smallsrc.h );
+
+    if ( smallout.empty() == true )
+        return false;
+
+    convolveKernel( smallsrc, smallk, smallout );
+    upsamplePlanar( smallout, f, outf );
+    highlightPass( hlrows, kernel, outf );
+
+    return savePlanarToMemory( outf, outptr );
+}
+
+// Run of taps of same weight in a mask row, splatted as one.
+struct SplatRun
+{
+    unsigned dx;
+    unsigned len;
+    unsigned dy;
+    float    weight;
+};
+
+// Takes boosted pixels out of source : highlight keeps what boost added,
+// and source keeps pixel as before boost.
+static size_t extractHighlights( PlanarImage &srcf, 
+                                 vector< vector<Highlight> > &rows )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    rows.assign( srcf.h, vector<Highlight>() );
+
+    const HighlightSetting light = highlights();
+    const float keep = ( light.boost - 1.f ) / light.boost;
+
+    pool::parallelFor( srcf.h, srcf.w * 3, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            float* r = srcf.row( 0, y );
+            float* g = srcf.row( 1, y );
+            float* b = srcf.row( 2, y );
+
+            for( unsigned x=0; x<srcf.w; x++ )
+            {
+                if ( ( r[x] > 1.f ) && ( g[x] > 1.f ) && ( b[x] > 1.f ) )
+                {
+                    Highlight hl = { x, r[x] * keep, g[x] * keep, b[x] * keep };
+
+                    rows[y].push_back( hl );
+
+                    r[x] -= hl.r;
+                    g[x] -= hl.g;
+                    b[x] -= hl.b;
+                }
+            }
+        }
+    } );
+
+    size_t count = 0;
+
+    for( unsigned y=0; y<srcf.h; y++ )
+    {
+        count += rows[y].size();
+    }
+
+    return count;
+}
+
+// Adds highlights splatted by shape of kernel. Each task owns a band of
+// output rows, and splats every highlight reaching it, so no atomics.
+// Long runs of flat masks are added as differences of row, summed up
+// once for band, unless highlights are too few to pay for whole frame.
+// Values of highlights may be negative, to take pixels out.
+static void scatterHighlights( const vector< vector<Highlight> > &rows,
+                               const BokehKernel &kernel, PlanarImage &outf )
+{
+    perf::Timer timer( perf::CONVOLVE );
+
+    const unsigned w = outf.w;
+    const unsigned h = outf.h;
+
+    vector<SplatRun> runs;
+
+    if ( kernel.flat == true )
+    {
+        for( size_t cnt=0; cnt<kernel.spans.size(); cnt++ )
+        {
+            const BokehKernel::Span &span = kernel.spans[cnt];
+            SplatRun run = { span.x0, span.x1 - span.x0, span.dy, kernel.flatweight };
+
+            runs.push_back( run );
+        }
+    }
+    else
+    {
+        for( size_t cnt=0; cnt<kernel.taps.size(); cnt++ )
+        {
+            const BokehKernel::Tap &tap = kernel.taps[cnt];
+            SplatRun run = { tap.dx, 1, tap.dy, tap.weight };
+
+            runs.push_back( run );
+        }
+    }
+
+    if ( runs.size() == 0 )
+        return;
+
+    // runs are sorted by dy, first run of each dy from dymin.
+    const unsigned dymin  = runs.front().dy;
+    const unsigned dymax  = runs.back().dy;
+    vector<size_t> groups( dymax - dymin + 2, runs.size() );
+
+    for( size_t cnt=runs.size(); cnt>0; cnt-- )
+    {
+        groups[ runs[cnt-1].dy - dymin ] = cnt - 1;
+    }
+
+    for( size_t cnt=groups.size()-1; cnt>0; cnt-- )
+    {
+        groups[cnt-1] = min( groups[cnt-1], groups[cnt] );
+    }
+
+    size_t count = 0;
+    bool   diffs = false;
+
+    for( unsigned y=0; y<h; y++ )
+    {
+        count += rows[y].size();
+    }
+
+    for( size_t cnt=0; cnt<runs.size(); cnt++ )
+    {
+        diffs |= ( runs[cnt].len > 4 );
+    }
+
+    if ( count == 0 )
+        return;
+
+    if ( (double)count * kernel.taps.size() < (double)w * h )
+    {
+        diffs = false;
+    }
+
+    PlanarImage diff;
+
+    if ( diffs == true )
+    {
+        PlanarImage tmp( w, h );
+
+        if ( tmp.empty() == true )
+            return;
+
+        diff.swap( tmp );
+    }
+
+    pool::parallelFor( h, (double)count * runs.size() * 3 / h + w * 3,
+                       [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        // source row su - dy reaches output row, for su unwrapped.
+        for( unsigned su=y0+dymin; su<y1+dymax; su++ )
+        {
+            const vector<Highlight> &hls = rows[ su % h ];
+
+            if ( hls.size() == 0 )
+                continue;
+
+            unsigned dlo = max( dymin, su + 1 > y1 ? su + 1 - y1 : 0 );
+            unsigned dhi = min( dymax, su - y0 );
+
+            for( unsigned dy=dlo; dy<=dhi; dy++ )
+            {
+                const unsigned y  = su - dy;
+                float*         dr = outf.row( 0, y );
+                float*         dg = outf.row( 1, y );
+                float*         db = outf.row( 2, y );
+
+                for( size_t cnt=groups[dy-dymin]; cnt<groups[dy-dymin+1]; cnt++ )
+                {
+                    const SplatRun &run = runs[cnt];
+
+                    if ( ( diffs == true ) && ( run.len > 4 ) )
+                    {
+                        float* fr = diff.row( 0, y );
+                        float* fg = diff.row( 1, y );
+                        float* fb = diff.row( 2, y );
+
+                        for( size_t hl=0; hl<hls.size(); hl++ )
+                        {
+                            const float vr = run.weight * hls[hl].r;
+                            const float vg = run.weight * hls[hl].g;
+                            const float vb = run.weight * hls[hl].b;
+
+                            unsigned x0 = hls[hl].x + run.dx;
+                            unsigned x1 = x0 + run.len;
+
+                            if ( x0 >= w )
+                            {
+                                x0 -= w;
+                                x1 -= w;
+                            }
+
+                            fr[x0] += vr; fg[x0] += vg; fb[x0] += vb;
+
+                            // wraps around to start of row.
+                            if ( x1 > w )
+                            {
+                                x1 -= w;
+
+                                fr[0] += vr; fg[0] += vg; fb[0] += vb;
+                            }
+
+                            if ( x1 < w )
+                            {
+                                fr[x1] -= vr; fg[x1] -= vg; fb[x1] -= vb;
+                            }
+                        }
+                    }
+                    else
+                    {
+                        for( size_t hl=0; hl<hls.size(); hl++ )
+                        {
+                            unsigned x = hls[hl].x + run.dx;
+
+                            for( unsigned cx=0; cx<run.len; cx++, x++ )
+                            {
+                                if ( x >= w )
+                                    x -= w;
+
+                                dr[x] += run.weight * hls[hl].r;
+                                dg[x] += run.weight * hls[hl].g;
+                                db[x] += run.weight * hls[hl].b;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        if ( diffs == false )
+            return;
+
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            for( unsigned c=0; c<3; c++ )
+            {
+                const float* fr  = diff.row( c, y );
+                float*       dr  = outf.row( c, y );
+                float        sum = 0.f;
+
+                for( unsigned x=0; x<w; x++ )
+                {
+                    sum   += fr[x];
+                    dr[x] += sum;
+                }
+            }
+        }
+    } );
+}
+
+unsigned HybridBokehScale( unsigned bkw, unsigned bkh, float quality )
+{
+    return pyramidScale( bkw, bkh, quality, 4, 32 );
+}
+
+bool ProcessHybridBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const unsigned char* bokeh,  
+                         unsigned bkw, unsigned bkh,
+                         unsigned char* &outptr,
+                         float quality )
+{
+    // check mask size.
+    if ( ( srcw < bkw ) || ( srch < bkh ) ) 
+        return false;
+
+    PlanarImage srcf  = loadPlanarFromMemory( srcptr, srcw, srch, srcd );   
+    PlanarImage maskf = loadPlanarFromMemory( bokeh, bkw, bkh, 1 );
+    PlanarImage outf( srcw, srch );
+
+    if ( ( srcf.empty() == true ) || ( maskf.empty() == true ) 
+         || ( outf.empty() == true ) )
+        return false;
+
+    BokehKernel kernel;
+
+    if ( compileKernel( maskf, kernel ) == false )
+        return false;
+
+    vector< vector<Highlight> > hlrows;
+
+    extractHighlights( srcf, hlrows );
+
+    // remainder has no highlights, so smooth enough to reduce
+    // further than pyramid mode.
+    const unsigned f = HybridBokehScale( bkw, bkh, quality );
+
+    if ( f == 1 )
+    {
+        convolveKernel( srcf, kernel, outf );
+    }
+    else
+    {
+        const unsigned padtop    = ( bkh + f - 1 ) / f * f - bkh;
+        PlanarImage    smallsrc  = downsamplePlanar( srcf, f, 0, true );
+        PlanarImage    smallmask = downsamplePlanar( maskf, f, padtop, false );
+        BokehKernel    smallk;
+
+        if ( ( smallsrc.empty() == true ) || ( smallmask.empty() == true ) )
+            return false;
+
+        if ( compileKernel( smallmask, smallk ) == false )
+            return false;
+
+        PlanarImage smallout( smallsrc.w, smallsrc.h );
+
+        if ( smallout.empty() == true )
+            return false;
+
+        convolveKernel( smallsrc, smallk, smallout );
+        upsamplePlanar( smallout, f, outf );
+    }
+
+    scatterHighlights( hlrows, kernel, outf );
+
+    return savePlanarToMemory( outf, outptr );
+}
+
+// Coarsest reduction of preview, mask of 4 pixels.
+static unsigned previewScale( unsigned bkw, unsigned bkh )
+{
+    return pyramidScale( bkw, bkh, 0.f, 4, 4 );
+}
+
+unsigned PreviewBokehPasses( unsigned bkw, unsigned bkh )
+{
+    unsigned passes = 1;
+
+    for( unsigned f=previewScale( bkw, bkh ); f>1; f/=2 )
+    {
+        passes++;
+    }
+
+    return passes;
+}
+
+bool ProcessPreviewBokeh( const unsigned char* srcptr, 
+                          unsigned srcw, unsigned srch, unsigned srcd,
+                          const unsigned char* bokeh,  
+                          unsigned bkw, unsigned bkh,
+                          unsigned pass, unsigned char* outptr,
+                          BokehCancelCheck cancel, void* param )
+{
+    // check mask size.
+    if ( ( srcw < bkw ) || ( srch < bkh ) || ( outptr == nullptr ) ) 
+        return false;
+
+    const unsigned passes = PreviewBokehPasses( bkw, bkh );
+    const unsigned f      = pass + 1 < passes ? previewScale( bkw, bkh ) >> pass : 1;
+
+    PlanarImage srcf  = loadPlanarFromMemory( srcptr, srcw, srch, srcd );   
+    PlanarImage maskf = loadPlanarFromMemory( bokeh, bkw, bkh, 1 );
+
+    if ( ( srcf.empty() == true ) || ( maskf.empty() == true ) )
+        return false;
+
+    // last pass by row bands of source, with rows of mask height below 
+    // each band, so convolution of a band does not wrap vertically.
+    if ( f == 1 )
+    {
+        BokehKernel kernel;
+
+        if ( compileKernel( maskf, kernel ) == false )
+            return false;
+
+        const unsigned dymax = kernel.taps.back().dy;
+        const unsigned bandh = min( srch, max( 64u, dymax * 4 ) );
+        PlanarImage    band( srcw, bandh + dymax );
+        PlanarImage    bandout( srcw, bandh + dymax );
+
+        if ( ( band.empty() == true ) || ( bandout.empty() == true ) )
+            return false;
+
+        for( unsigned y0=0; y0<srch; y0+=bandh )
+        {
+            if ( ( cancel != nullptr ) && ( cancel( param ) == true ) )
+                return false;
+
+            for( unsigned y=0; y<band.h; y++ )
+            {
+                for( unsigned c=0; c<3; c++ )
+                {
+                    memcpy( band.row( c, y ), srcf.row( c, ( y0 + y ) % srch ),
+                            srcw * sizeof(float) );
+                }
+            }
+
+            bandout.clear();
+            convolveKernel( band, kernel, bandout );
+
+            const unsigned rows = min( bandh, srch - y0 );
+
+            perf::Timer timer( perf::PACK );
+
+            pool::parallelFor( rows, srcw * 3, [&]( unsigned r0, unsigned r1, unsigned )
+            {
+                for( unsigned y=r0; y<r1; y++ )
+                {
+                    simd::packRGB( bandout.row( 0, y ), bandout.row( 1, y ), 
+                                   bandout.row( 2, y ),
+                                   &outptr[ (size_t)( y0 + y ) * srcw * 3 ], srcw );
+                }
+            } );
+        }
+
+        return true;
+    }
+
+    const unsigned padtop    = ( bkh + f - 1 ) / f * f - bkh;
+    PlanarImage    smallsrc  = downsamplePlanar( srcf, f, 0, true );
+    PlanarImage    smallmask = downsamplePlanar( maskf, f, padtop, false );
+    PlanarImage    smallout( smallsrc.w, smallsrc.h );
+    BokehKernel    smallk;
+
+    if ( ( smallsrc.empty() == true ) || ( smallmask.empty() == true )
+         || ( smallout.empty() == true ) )
+        return false;
+
+    if ( compileKernel( smallmask, smallk ) == false )
+        return false;
+
+    if ( ( cancel != nullptr ) && ( cancel( param ) == true ) )
+        return false;
+
+    convolveKernel( smallsrc, smallk, smallout );
+
+    if ( ( cancel != nullptr ) && ( cancel( param ) == true ) )
+        return false;
+
+    // full size planes reused from source.
+    upsamplePlanar( smallout, f, srcf );
+    packPlanar( srcf, outptr );
+
+    return true;
+}
+
+// Source coordinate of v in [0,n) by border, -1 for constant color.
+static inline int borderCoord( int v, int n, unsigned border )
+{
+    if ( ( v >= 0 ) && ( v < n ) )
+        return v;
+
+    switch( border )
+    {
+        case BOKEH_BORDER_CLAMP:
+            return v < 0 ? 0 : n - 1;
+
+        case BOKEH_BORDER_MIRROR:
+            {
+                if ( n == 1 )
+                    return 0;
+
+                // reflected without edge repeated, period of 2 ( n - 1 ).
+                int period = 2 * ( n - 1 );
+
+                v = ( v % period + period ) % period;
+
+                return v < n ? v : period - v;
+            }
+
+        case BOKEH_BORDER_CONSTANT:
+            return -1;
+
+        default:
+            return ( v % n + n ) % n;
+    }
+}
+
+// Source of output rectangle of rw x rh with halo of kernel, in size of
+// ( rw + kernel w - 1 ) x ( rh + kernel h ) from source ( ox, oy ).
+// Pixels out of frame of w x h are given by border, or color.
+// fetch( sy, sx, n, r, g, b ) fills n pixels of source row sy from sx.
+template <class F>
+static PlanarImage regionSource( unsigned w, unsigned h, const BokehKernel &kernel,
+                                 int ox, int oy, unsigned rw, unsigned rh,
+                                 unsigned border, const float* color, F fetch )
+{
+    perf::Timer timer( perf::UNPACK );
+
+    PlanarImage sub( rw + kernel.w - 1, rh + kernel.h );
+
+    if ( sub.empty() == true )
+        return sub;
+
+    // columns in frame are fetched at once.
+    const int in0 = min( max( -ox, 0 ), (int)sub.w );
+    const int in1 = max( min( (int)w - ox, (int)sub.w ), in0 );
+
+    pool::parallelFor( sub.h, sub.w * 4, [&]( unsigned r0, unsigned r1, unsigned )
+    {
+        for( unsigned y=r0; y<r1; y++ )
+        {
+            float*    r  = sub.row( 0, y );
+            float*    g  = sub.row( 1, y );
+            float*    b  = sub.row( 2, y );
+            const int sy = borderCoord( oy + (int)y, h, border );
+
+            if ( sy < 0 )
+            {
+                fill( r, r + sub.w, color[0] );
+                fill( g, g + sub.w, color[1] );
+                fill( b, b + sub.w, color[2] );
+                continue;
+            }
+
+            if ( in1 > in0 )
+            {
+                fetch( sy, ox + in0, in1 - in0, r + in0, g + in0, b + in0 );
+            }
+
+            for( int x=0; x<(int)sub.w; x++ )
+            {
+                if ( ( x == in0 ) && ( in1 > in0 ) )
+                {
+                    x = in1 - 1;
+                    continue;
+                }
+
+                const int sx = borderCoord( ox + x, w, border );
+
+                if ( sx < 0 )
+                {
+                    r[x] = color[0];
+                    g[x] = color[1];
+                    b[x] = color[2];
+                }
+                else
+                {
+                    fetch( sy, sx, 1, r + x, g + x, b + x );
+                }
+            }
+        }
+    } );
+
+    return sub;
+}
+
+// Convolves source of regionSource(), output rectangle is at
+// ( kernel w - 1, 0 ) of out, where no tap wraps around.
+static bool convolveRegion( const PlanarImage &sub, const BokehKernel &kernel,
+                            PlanarImage &out, unsigned engine = BOKEH_ENGINE_AUTO )
+{
+    if ( sub.empty() == true )
+        return false;
+
+    PlanarImage tmp( sub.w, sub.h );
+
+    if ( tmp.empty() == true )
+        return false;
+
+    convolveEngine( sub, kernel, engine, tmp );
+    out.swap( tmp );
+
+    return true;
+}
+
+bool ProcessRegionBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const BokehKernel* kernel,
+                         unsigned rx, unsigned ry, unsigned rw, unsigned rh,
+                         unsigned char* &outptr )
+{
+    if ( ( srcptr == nullptr ) || ( kernel == nullptr ) || ( srcd == 0 ) )
+        return false;
+
+    if ( ( srcw < kernel->w ) || ( srch < kernel->h ) 
+         || ( rw == 0 ) || ( rh == 0 ) 
+         || ( rx + rw > srcw ) || ( ry + rh > srch ) ) 
+        return false;
+
+    const HighlightSetting light = highlights();
+
+    PlanarImage sub = regionSource( srcw, srch, *kernel, 
+                                    (int)rx - (int)( kernel->w - 1 ), ry, rw, rh,
+                                    BOKEH_BORDER_WRAP, nullptr,
+                                    [&]( unsigned sy, unsigned sx, unsigned n,
+                                         float* r, float* g, float* b )
+    {
+        simd::unpackRGB( &srcptr[ ( (size_t)sy * srcw + sx ) * srcd ], srcd,
+                         r, g, b, n, light.level, light.boost );
+    } );
+
+    PlanarImage out;
+
+    if ( convolveRegion( sub, *kernel, out ) == false )
+        return false;
+
+    outptr = new unsigned char[ (size_t)rw * rh * 3 ];
+
+    if ( outptr == NULL )
+        return false;
+
+    perf::Timer timer( perf::PACK );
+
+    pool::parallelFor( rh, rw * 3, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            simd::packRGB( out.row( 0, y ) + kernel->w - 1, 
+                           out.row( 1, y ) + kernel->w - 1,
+                           out.row( 2, y ) + kernel->w - 1,
+                           &outptr[ (size_t)y * rw * 3 ], rw );
+        }
+    } );
+
+    return true;
+}
+
+bool ProcessBorderBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const BokehKernel* kernel, unsigned border,
+                         unsigned char* &outptr,
+                         int anchorx, int anchory, unsigned color )
+{
+    if ( ( srcptr == nullptr ) || ( kernel == nullptr ) || ( srcd == 0 ) )
+        return false;
+
+    if ( ( srcw < kernel->w ) || ( srch < kernel->h ) )
+        return false;
+
+    if ( anchorx < 0 )
+        anchorx = kernel->w / 2;
+
+    if ( anchory < 0 )
+        anchory = kernel->h / 2;
+
+    // color is boosted as pixels of source.
+    const unsigned char rgb[3] = { (unsigned char)( color >> 16 ),
+                                   (unsigned char)( color >> 8 ),
+                                   (unsigned char)color };
+    float colorf[3] = { 0.f };
+    const HighlightSetting light = highlights();
+
+    simd::unpackRGB( rgb, 3, &colorf[0], &colorf[1], &colorf[2], 1, 
+                     light.level, light.boost );
+
+    // output ( x, y ) reads source ( x - mx + anchorx, y - my + anchory ),
+    // as mask is placed on pixel by anchor.
+    PlanarImage sub = regionSource( srcw, srch, *kernel, 
+                                    anchorx - (int)( kernel->w - 1 ),
+                                    anchory - (int)kernel->h,
+                                    srcw, srch, border, colorf,
+                                    [&]( unsigned sy, unsigned sx, unsigned n,
+                                         float* r, float* g, float* b )
+    {
+        simd::unpackRGB( &srcptr[ ( (size_t)sy * srcw + sx ) * srcd ], srcd,
+                         r, g, b, n, light.level, light.boost );
+    } );
+
+    PlanarImage out;
+
+    if ( convolveRegion( sub, *kernel, out ) == false )
+        return false;
+
+    outptr = new unsigned char[ (size_t)srcw * srch * 3 ];
+
+    if ( outptr == NULL )
+        return false;
+
+    perf::Timer timer( perf::PACK );
+
+    pool::parallelFor( srch, srcw * 3, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            simd::packRGB( out.row( 0, y ) + kernel->w - 1, 
+                           out.row( 1, y ) + kernel->w - 1,
+                           out.row( 2, y ) + kernel->w - 1,
+                           &outptr[ (size_t)y * srcw * 3 ], srcw );
+        }
+    } );
+
+    return true;
+}
+
+// Frame kept between edits : source before and after boost, and output
+// of whole frame once rendered.
+class BokehCache
+{
+    public:
+        BokehCache() : w(0), h(0), level(0), boost(1), rendered(false) 
+        {
+        }
+
+    public:
+        unsigned    w;
+        unsigned    h;
+        PlanarImage linear;
+        PlanarImage boosted;
+        PlanarImage outf;
+        BokehKernel kernel;
+        float       level;      /// intensity of boosted.
+        float       boost;
+        bool        rendered;
+};
+
+// Source of rectangle from bytes to linear, and boosted by level.
+static void loadCacheSource( BokehCache &cache, const unsigned char* srcptr, 
+                             unsigned srcd, unsigned rx, unsigned ry, 
+                             unsigned rw, unsigned rh )
+{
+    perf::Timer timer( perf::UNPACK );
+
+    pool::parallelFor( rh, rw * 4, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=ry+y0; y<ry+y1; y++ )
+        {
+            // boost 1 keeps source linear.
+            simd::unpackRGB( &srcptr[ ( (size_t)y * cache.w + rx ) * srcd ], srcd,
+                             cache.linear.row( 0, y ) + rx, 
+                             cache.linear.row( 1, y ) + rx,
+                             cache.linear.row( 2, y ) + rx, rw, 
+                             cache.level, 1.f );
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                memcpy( cache.boosted.row( c, y ) + rx, cache.linear.row( c, y ) + rx,
+                        rw * sizeof(float) );
+            }
+
+            float* r = cache.boosted.row( 0, y );
+            float* g = cache.boosted.row( 1, y );
+            float* b = cache.boosted.row( 2, y );
+
+            for( unsigned x=rx; x<rx+rw; x++ )
+            {
+                if ( ( r[x] > cache.level ) && ( g[x] > cache.level ) 
+                     && ( b[x] > cache.level ) )
+                {
+                    r[x] *= cache.boost;
+                    g[x] *= cache.boost;
+                    b[x] *= cache.boost;
+                }
+            }
+        }
+    } );
+}
+
+// Re-renders output rectangle of cache, wrapping around frame.
+static bool renderCacheRegion( BokehCache &cache, unsigned x0, unsigned y0,
+                               unsigned rw, unsigned rh )
+{
+    const PlanarImage &src = cache.boosted;
+
+    PlanarImage sub = regionSource( cache.w, cache.h, cache.kernel, 
+                                    (int)x0 - (int)( cache.kernel.w - 1 ), y0, rw, rh,
+                                    BOKEH_BORDER_WRAP, nullptr,
+                                    [&]( unsigned sy, unsigned sx, unsigned n,
+                                         float* r, float* g, float* b )
+    {
+        memcpy( r, src.row( 0, sy ) + sx, n * sizeof(float) );
+        memcpy( g, src.row( 1, sy ) + sx, n * sizeof(float) );
+        memcpy( b, src.row( 2, sy ) + sx, n * sizeof(float) );
+    } );
+
+    PlanarImage out;
+
+    if ( convolveRegion( sub, cache.kernel, out ) == false )
+        return false;
+
+    pool::parallelFor( rh, rw * 3, [&]( unsigned r0, unsigned r1, unsigned )
+    {
+        for( unsigned y=r0; y<r1; y++ )
+        {
+            for( unsigned c=0; c<3; c++ )
+            {
+                const float* srow = out.row( c, y ) + cache.kernel.w - 1;
+                float*       drow = cache.outf.row( c, ( y0 + y ) % cache.h );
+                unsigned     x    = x0;
+
+                for( unsigned cnt=0; cnt<rw; cnt++, x++ )
+                {
+                    if ( x >= cache.w )
+                        x -= cache.w;
+
+                    drow[x] = srow[cnt];
+                }
+            }
+        }
+    } );
+
+    return true;
+}
+
+BokehCache* CreateBokehCache( const unsigned char* srcptr, 
+                              unsigned srcw, unsigned srch, unsigned srcd,
+                              const BokehKernel* kernel )
+{
+    if ( ( srcptr == nullptr ) || ( kernel == nullptr ) || ( srcd == 0 ) )
+        return NULL;
+
+    if ( ( srcw < kernel->w ) || ( srch < kernel->h ) )
+        return NULL;
+
+    BokehCache* cache = new BokehCache;
+
+    cache->w      = srcw;
+    cache->h      = srch;
+    cache->kernel = *kernel;
+    cache->level  = highlights().level;
+    cache->boost  = highlights().boost;
+
+    PlanarImage linear( srcw, srch );
+    PlanarImage boosted( srcw, srch );
+    PlanarImage outf( srcw, srch );
+
+    if ( ( linear.empty() == true ) || ( boosted.empty() == true ) 
+         || ( outf.empty() == true ) )
+    {
+        delete cache;
+        return NULL;
+    }
+
+    cache->linear.swap( linear );
+    cache->boosted.swap( boosted );
+    cache->outf.swap( outf );
+
+    loadCacheSource( *cache, srcptr, srcd, 0, 0, srcw, srch );
+
+    return cache;
+}
+
+void DiscardBokehCache( BokehCache* &cache )
+{
+    if ( cache != NULL )
+    {
+        delete cache;
+        cache = NULL;
+    }
+}
+
+bool SetBokehCacheIntensity( BokehCache* cache, float level )
+{
+    if ( cache == NULL )
+        return false;
+
+    const float lo = min( level, cache->level );
+    const float hi = max( level, cache->level );
+
+    // pixels of smallest channel in ( lo, hi ] flip, by boost - 1 times of linear.
+    const float sign = ( level < cache->level ? 1.f : -1.f ) * ( cache->boost - 1.f );
+    vector< vector<Highlight> > rows( cache->h );
+
+    pool::parallelFor( cache->h, cache->w * 3, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            const float* r  = cache->linear.row( 0, y );
+            const float* g  = cache->linear.row( 1, y );
+            const float* b  = cache->linear.row( 2, y );
+            float*       br = cache->boosted.row( 0, y );
+            float*       bg = cache->boosted.row( 1, y );
+            float*       bb = cache->boosted.row( 2, y );
+
+            for( unsigned x=0; x<cache->w; x++ )
+            {
+                float minc = min( r[x], min( g[x], b[x] ) );
+
+                if ( ( minc > lo ) && ( minc <= hi ) )
+                {
+                    Highlight hl = { x, r[x] * sign, g[x] * sign, b[x] * sign };
+
+                    rows[y].push_back( hl );
+
+                    br[x] += hl.r;
+                    bg[x] += hl.g;
+                    bb[x] += hl.b;
+                }
+            }
+        }
+    } );
+
+    cache->level = level;
+
+    if ( cache->rendered == true )
+    {
+        scatterHighlights( rows, cache->kernel, cache->outf );
+    }
+
+    return true;
+}
+
+bool UpdateBokehCache( BokehCache* cache, const unsigned char* srcptr, unsigned srcd,
+                       unsigned rx, unsigned ry, unsigned rw, unsigned rh )
+{
+    if ( ( cache == NULL ) || ( srcptr == nullptr ) || ( srcd == 0 ) )
+        return false;
+
+    if ( ( rw == 0 ) || ( rh == 0 ) 
+         || ( rx + rw > cache->w ) || ( ry + rh > cache->h ) )
+        return false;
+
+    loadCacheSource( *cache, srcptr, srcd, rx, ry, rw, rh );
+
+    if ( cache->rendered == false )
+        return true;
+
+    // output x reads source x - dx, and y reads y + dy,
+    // so changed source reaches right and above by mask size.
+    const BokehKernel &k = cache->kernel;
+    const unsigned dymin = k.taps.front().dy;
+    const unsigned dymax = k.taps.back().dy;
+    const unsigned ow    = min( rw + k.w - 1, cache->w );
+    const unsigned oh    = min( rh + dymax - dymin, cache->h );
+    const unsigned oy    = ( ry + cache->h - dymax % cache->h ) % cache->h;
+
+    return renderCacheRegion( *cache, rx, oy, ow, oh );
+}
+
+bool RenderBokehCache( BokehCache* cache, 
+                       unsigned rx, unsigned ry, unsigned rw, unsigned rh,
+                       unsigned char* &outptr )
+{
+    if ( cache == NULL )
+        return false;
+
+    if ( ( rw == 0 ) || ( rh == 0 ) 
+         || ( rx + rw > cache->w ) || ( ry + rh > cache->h ) )
+        return false;
+
+    if ( cache->rendered == false )
+    {
+        convolveKernel( cache->boosted, cache->kernel, cache->outf );
+        cache->rendered = true;
+    }
+
+    outptr = new unsigned char[ (size_t)rw * rh * 3 ];
+
+    if ( outptr == NULL )
+        return false;
+
+    perf::Timer timer( perf::PACK );
+
+    pool::parallelFor( rh, rw * 3, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            simd::packRGB( cache->outf.row( 0, ry + y ) + rx, 
+                           cache->outf.row( 1, ry + y ) + rx,
+                           cache->outf.row( 2, ry + y ) + rx,
+                           &outptr[ (size_t)y * rw * 3 ], rw );
+        }
+    } );
+
+    return true;
+}
+
+// Configuration, compiled mask, arena of buffers and stats, so frames
+// of a context touch no other state than pool of threads.
+class BokehContext
+{
+    public:
+        BokehContext() : mem( &own ), sink( &ownsink ), bkw(0), bkh(0)
+        {
+        }
+
+    public:
+        arena::Arena            own;
+        arena::Arena*           mem;    /// own, or caller's for wrappers.
+        perf::Sink              ownsink;
+        perf::Sink*             sink;   /// same as mem.
+        BokehConfig             config;
+        HighlightSetting        light;
+        vector<unsigned char>   mask;   /// kept to compile again.
+        unsigned                bkw;
+        unsigned                bkh;
+        BokehKernel             kernel;
+};
+
+// Mask is boosted by highlights as sources, so compiled by context's.
+static bool compileContext( BokehContext &ctx )
+{
+    HighlightScope hscope( ctx.light );
+    arena::Scope   ascope( *ctx.mem );
+    perf::Scope    pscope( *ctx.sink );
+
+    PlanarImage maskf = loadPlanarFromMemory( &ctx.mask[0], ctx.bkw, ctx.bkh, 1 );
+
+    if ( maskf.empty() == true )
+        return false;
+
+    BokehKernel kernel;
+
+    if ( compileKernel( maskf, kernel ) == false )
+        return false;
+
+    ctx.kernel = kernel;
+
+    return true;
+}
+
+static BokehContext* createContext( const BokehConfig &config, 
+                                    const unsigned char* bokeh,  
+                                    unsigned bkw, unsigned bkh,
+                                    arena::Arena* mem )
+{
+    if ( ( bokeh == nullptr ) || ( bkw == 0 ) || ( bkh == 0 ) )
+        return NULL;
+
+    BokehContext* ctx = new BokehContext;
+
+    if ( mem != nullptr )
+    {
+        ctx->mem  = mem;
+        ctx->sink = &perf::current();
+    }
+
+    ctx->config      = config;
+    ctx->light.level = config.intensity;
+    ctx->light.boost = config.boost;
+    ctx->bkw         = bkw;
+    ctx->bkh         = bkh;
+    ctx->mask.assign( bokeh, bokeh + (size_t)bkw * bkh );
+
+    if ( compileContext( *ctx ) == false )
+    {
+        delete ctx;
+        return NULL;
+    }
+
+    return ctx;
+}
+
+// Float planes clamped to pixels of 3 or 4 channels, alpha is opaque.
+static void packPixels( const float* r, const float* g, const float* b,
+                        unsigned char* dst, unsigned d, unsigned n )
+{
+    if ( d == 3 )
+    {
+        simd::packRGB( r, g, b, dst, n );
+        return;
+    }
+
+    for( unsigned x=0; x<n; x++ )
+    {
+        dst[ x * 4 + 0 ] = max( 0.f, min( 1.f, r[x] ) ) * 255.f;
+        dst[ x * 4 + 1 ] = max( 0.f, min( 1.f, g[x] ) ) * 255.f;
+        dst[ x * 4 + 2 ] = max( 0.f, min( 1.f, b[x] ) ) * 255.f;
+        dst[ x * 4 + 3 ] = 255;
+    }
+}
+
+void InitBokehConfig( BokehConfig &config )
+{
+    config.intensity = highlight_default.level;
+    config.boost     = highlight_default.boost;
+    config.threads   = 0;
+    config.engine    = BOKEH_ENGINE_AUTO;
+    config.border    = BOKEH_BORDER_WRAP;
+    config.anchorx   = -1;
+    config.anchory   = -1;
+    config.color     = 0;
+}
+
+BokehContext* CreateBokehContext( const BokehConfig &config,
+                                  const unsigned char* bokeh,  
+                                  unsigned bkw, unsigned bkh )
+{
+    return createContext( config, bokeh, bkw, bkh, nullptr );
+}
+
+void DiscardBokehContext( BokehContext* &ctx )
+{
+    if ( ctx != NULL )
+    {
+        delete ctx;
+        ctx = NULL;
+    }
+}
+
+void GetBokehContextConfig( const BokehContext* ctx, BokehConfig &config )
+{
+    if ( ctx != NULL )
+    {
+        config = ctx->config;
+    }
+}
+
+bool SetBokehContextConfig( BokehContext* ctx, const BokehConfig &config )
+{
+    if ( ctx == NULL )
+        return false;
+
+    bool recompile = ( config.intensity != ctx->light.level ) 
+                     || ( config.boost != ctx->light.boost );
+
+    ctx->config      = config;
+    ctx->light.level = config.intensity;
+    ctx->light.boost = config.boost;
+
+    if ( recompile == true )
+        return compileContext( *ctx );
+
+    return true;
+}
+
+bool SetBokehContextMask( BokehContext* ctx, const unsigned char* bokeh,  
+                          unsigned bkw, unsigned bkh )
+{
+    if ( ( ctx == NULL ) || ( bokeh == nullptr ) || ( bkw == 0 ) || ( bkh == 0 ) )
+        return false;
+
+    ctx->bkw = bkw;
+    ctx->bkh = bkh;
+    ctx->mask.assign( bokeh, bokeh + (size_t)bkw * bkh );
+
+    return compileContext( *ctx );
+}
+
+bool ProcessBokehContext( BokehContext* ctx, 
+                          const unsigned char* srcptr, 
+                          unsigned srcw, unsigned srch, unsigned srcd,
+                          size_t srcstride,
+                          unsigned char* dstptr, size_t dststride, unsigned dstd )
+{
+    if ( ( ctx == NULL ) || ( srcptr == nullptr ) || ( dstptr == nullptr ) )
+        return false;
+
+    if ( ( ( srcd != 1 ) && ( srcd != 3 ) && ( srcd != 4 ) ) 
+         || ( ( dstd != 3 ) && ( dstd != 4 ) ) )
+        return false;
+
+    const BokehKernel &kernel = ctx->kernel;
+    const BokehConfig &config = ctx->config;
+
+    if ( ( srcw < kernel.w ) || ( srch < kernel.h ) ) 
+        return false;
+
+    if ( srcstride == 0 )
+        srcstride = (size_t)srcw * srcd;
+
+    if ( dststride == 0 )
+        dststride = (size_t)srcw * dstd;
+
+    if ( ( srcstride < (size_t)srcw * srcd ) || ( dststride < (size_t)srcw * dstd ) )
+        return false;
+
+    HighlightScope hscope( ctx->light );
+    arena::Scope   ascope( *ctx->mem );
+    perf::Scope    pscope( *ctx->sink );
+    pool::Limit    limit( config.threads );
+
+    const HighlightSetting light = ctx->light;
+    const int anchorx = config.anchorx < 0 ? kernel.w / 2 : config.anchorx;
+    const int anchory = config.anchory < 0 ? kernel.h / 2 : config.anchory;
+
+    // output ( x, y ) is at ( ox + x, ( oy + y ) % h ) of out,
+    // where rows of wrapped frame wrap around width too.
+    PlanarImage out;
+    unsigned    ox = 0;
+    unsigned    oy = 0;
+
+    if ( config.border == BOKEH_BORDER_WRAP )
+    {
+        // no halo, anchor just shifts output over frame.
+        PlanarImage srcf( srcw, srch );
+        PlanarImage outf( srcw, srch );
+
+        if ( ( srcf.empty() == true ) || ( outf.empty() == true ) )
+            return false;
+
+        {
+            perf::Timer timer( perf::UNPACK );
+
+            pool::parallelFor( srch, srcw * 4, [&]( unsigned y0, unsigned y1, unsigned )
+            {
+                for( unsigned y=y0; y<y1; y++ )
+                {
+                    simd::unpackRGB( &srcptr[ (size_t)y * srcstride ], srcd,
+                                     srcf.row( 0, y ), srcf.row( 1, y ), srcf.row( 2, y ),
+                                     srcw, light.level, light.boost );
+                }
+            } );
+        }
+
+        convolveEngine( srcf, kernel, config.engine, outf );
+        out.swap( outf );
+
+        ox = (unsigned)anchorx % srcw;
+        oy = (unsigned)( ( anchory - (int)kernel.h ) % (int)srch + (int)srch ) % srch;
+    }
+    else
+    {
+        const unsigned char rgb[3] = { (unsigned char)( config.color >> 16 ),
+                                       (unsigned char)( config.color >> 8 ),
+                                       (unsigned char)config.color };
+        float colorf[3] = { 0.f };
+
+        simd::unpackRGB( rgb, 3, &colorf[0], &colorf[1], &colorf[2], 1, 
+                         light.level, light.boost );
+
+        PlanarImage sub = regionSource( srcw, srch, kernel, 
+                                        anchorx - (int)( kernel.w - 1 ),
+                                        anchory - (int)kernel.h,
+                                        srcw, srch, config.border, colorf,
+                                        [&]( unsigned sy, unsigned sx, unsigned n,
+                                             float* r, float* g, float* b )
+        {
+            simd::unpackRGB( &srcptr[ (size_t)sy * srcstride + (size_t)sx * srcd ], 
+                             srcd, r, g, b, n, light.level, light.boost );
+        } );
+
+        if ( convolveRegion( sub, kernel, out, config.engine ) == false )
+            return false;
+
+        ox = kernel.w - 1;
+    }
+
+    {
+        perf::Timer timer( perf::PACK );
+
+        pool::parallelFor( srch, srcw * 3, [&]( unsigned y0, unsigned y1, unsigned )
+        {
+            for( unsigned y=y0; y<y1; y++ )
+            {
+                unsigned       sy   = ( oy + y ) % out.h;
+                unsigned char* dst  = &dstptr[ (size_t)y * dststride ];
+                unsigned       run  = min( srcw, out.w - ox );
+
+                packPixels( out.row( 0, sy ) + ox, out.row( 1, sy ) + ox, 
+                            out.row( 2, sy ) + ox, dst, dstd, run );
+
+                if ( run < srcw )
+                {
+                    packPixels( out.row( 0, sy ), out.row( 1, sy ), out.row( 2, sy ),
+                                dst + (size_t)run * dstd, dstd, srcw - run );
+                }
+            }
+        } );
+    }
+
+    return true;
+}
+
+void GetBokehContextMemoryStats( BokehContext* ctx, BokehMemoryStats &stats )
+{
+    if ( ctx != NULL )
+    {
+        arena::Scope scope( *ctx->mem );
+
+        GetBokehMemoryStats( stats );
+    }
+}
+
+void GetBokehContextStats( BokehContext* ctx, BokehStats &stats )
+{
+    if ( ctx != NULL )
+    {
+        perf::Scope scope( *ctx->sink );
+
+        GetBokehStats( stats );
+    }
+}
+
+void ResetBokehContextStats( BokehContext* ctx )
+{
+    if ( ctx != NULL )
+    {
+        ctx->sink->reset();
+    }
+}
+
+double BokehPSNR( const unsigned char* ref, const unsigned char* img,
+                  unsigned w, unsigned h, unsigned d )
+{
+    if ( ( ref == NULL ) || ( img == NULL ) )
+        return 0.0;
+
+    size_t count = (size_t)w * h * d;
+    double sum   = 0.0;
+
+    for( size_t cnt=0; cnt<count; cnt++ )
+    {
+        double diff = (double)ref[cnt] - (double)img[cnt];
+
+        sum += diff * diff;
+    }
+
+    if ( sum == 0.0 )
+        return 99.0;
+
+    return 10.0 * log10( 255.0 * 255.0 * count / sum );
+}
+
+// Aperture of a depth layer : mask reduced to kw x kh by area average.
+// Flat masks are kept flat by threshold of half, for span convolution.
+static PlanarImage scaleMask( const PlanarImage &maskf, unsigned kw, unsigned kh,
+                              bool flat )
+{
+    perf::Timer timer( perf::KERNEL );
+
+    PlanarImage dst( kw, kh );
+
+    if ( dst.empty() == true )
+        return dst;
+
+    for( unsigned y=0; y<kh; y++ )
+    {
+        unsigned sy0 = (unsigned)( (unsigned long long)y * maskf.h / kh );
+        unsigned sy1 = max( sy0 + 1, 
+                            (unsigned)( (unsigned long long)( y + 1 ) * maskf.h / kh ) );
+
+        for( unsigned x=0; x<kw; x++ )
+        {
+            unsigned sx0 = (unsigned)( (unsigned long long)x * maskf.w / kw );
+            unsigned sx1 = max( sx0 + 1, 
+                                (unsigned)( (unsigned long long)( x + 1 ) * maskf.w / kw ) );
+            float    sum = 0.f;
+
+            for( unsigned sy=sy0; sy<sy1; sy++ )
+            {
+                for( unsigned sx=sx0; sx<sx1; sx++ )
+                {
+                    sum += maskWeight( maskf, sx, sy );
+                }
+            }
+
+            sum /= (float)( ( sy1 - sy0 ) * ( sx1 - sx0 ) );
+
+            if ( flat == true )
+            {
+                sum = sum >= 0.5f ? 1.f : 0.f;
+            }
+
+            dst.row( 0, y )[x] = sum;
+            dst.row( 1, y )[x] = sum;
+            dst.row( 2, y )[x] = sum;
+        }
+    }
+
+    return dst;
+}
+
+// Front to back compositing of depth layers, per pixel.
+// Color is premultiplied by coverage, divided by coverage at end.
+class DepthComposite
+{
+    public:
+        DepthComposite( unsigned w, unsigned h )
+         : color( w, h ), cover( (size_t)w * h, 0.f )
+        {
+        }
+
+    public:
+        // layer of sharp pixels in region, color and coverage as is.
+        void addSharp( const PlanarImage &srcf, const vector<float> &alpha,
+                       unsigned rx, unsigned ry, unsigned rw, unsigned rh )
+        {
+            pool::parallelFor( rh, rw * 4, [&]( unsigned y0, unsigned y1, unsigned )
+            {
+                for( unsigned y=ry+y0; y<ry+y1; y++ )
+                {
+                    const float* a   = &alpha[ (size_t)y * color.w + rx ];
+                    float*       acc = &cover[ (size_t)y * color.w + rx ];
+
+                    for( unsigned c=0; c<3; c++ )
+                    {
+                        const float* src = srcf.row( c, y ) + rx;
+                        float*       dst = color.row( c, y ) + rx;
+
+                        for( unsigned x=0; x<rw; x++ )
+                        {
+                            dst[x] += ( 1.f - acc[x] ) * a[x] * src[x];
+                        }
+                    }
+
+                    for( unsigned x=0; x<rw; x++ )
+                    {
+                        acc[x] += ( 1.f - acc[x] ) * a[x];
+                    }
+                }
+            } );
+        }
+
+        // layer convolved in region, placed at ( rx, ry ) of image.
+        // ( x, y ) of region is read at ( ( x + ox ) % w, ( y + oy ) % h )
+        // of convolved images, to center aperture.
+        void addBlurred( const PlanarImage &layerc, const PlanarImage &layera,
+                         unsigned rx, unsigned ry, unsigned rw, unsigned rh,
+                         unsigned ox, unsigned oy )
+        {
+            pool::parallelFor( rh, rw * 4, [&]( unsigned y0, unsigned y1, unsigned )
+            {
+                for( unsigned y=y0; y<y1; y++ )
+                {
+                    unsigned     ly  = ( y + oy ) % layerc.h;
+                    const float* la  = layera.row( 0, ly );
+                    float*       acc = &cover[ (size_t)( ry + y ) * color.w + rx ];
+
+                    for( unsigned c=0; c<3; c++ )
+                    {
+                        const float* lc  = layerc.row( c, ly );
+                        float*       dst = color.row( c, ry + y ) + rx;
+
+                        for( unsigned x=0; x<rw; x++ )
+                        {
+                            dst[x] += ( 1.f - acc[x] ) * lc[ ( x + ox ) % layerc.w ];
+                        }
+                    }
+
+                    for( unsigned x=0; x<rw; x++ )
+                    {
+                        float a = min( la[ ( x + ox ) % layerc.w ], 1.f );
+
+                        acc[x] += ( 1.f - acc[x] ) * a;
+                    }
+                }
+            } );
+        }
+
+        // uncovered borders are normalized by coverage.
+        bool save( unsigned char* &outptr )
+        {
+            pool::parallelFor( color.h, color.w * 3,
+                               [&]( unsigned y0, unsigned y1, unsigned )
+            {
+                for( unsigned y=y0; y<y1; y++ )
+                {
+                    const float* acc = &cover[ (size_t)y * color.w ];
+
+                    for( unsigned c=0; c<3; c++ )
+                    {
+                        float* dst = color.row( c, y );
+
+                        for( unsigned x=0; x<color.w; x++ )
+                        {
+                            dst[x] = acc[x] > 0.f ? dst[x] / acc[x] : 0.f;
+                        }
+                    }
+                }
+            } );
+
+            return savePlanarToMemory( color, outptr );
+        }
+
+        bool empty() const { return color.empty(); }
+
+    private:
+        PlanarImage   color;
+        vector<float> cover;
+};
+
+bool ProcessDepthBokeh( const unsigned char* srcptr, 
+                        unsigned srcw, unsigned srch, unsigned srcd,
+                        const void* depthptr, unsigned depthbits,
+                        const unsigned char* bokeh,  
+                        unsigned bkw, unsigned bkh,
+                        float focus,
+                        unsigned char* &outptr,
+                        float cocscale, unsigned layers )
+{
+    if ( ( depthptr == NULL ) || ( ( depthbits != 8 ) && ( depthbits != 16 ) ) 
+         || ( layers < 2 ) )
+        return false;
+
+    if ( ( srcptr == NULL ) || ( srcd == 0 ) )
+        return false;
+
+    // sharp layer is linear source, blurred layers are boosted for highlights.
+    PlanarImage    linear( srcw, srch );
+    PlanarImage    srcf( srcw, srch );
+    PlanarImage    maskf = loadPlanarFromMemory( bokeh, bkw, bkh, 1 );
+    DepthComposite comp( srcw, srch );
+    BokehKernel    full;
+
+    if ( ( linear.empty() == true ) || ( srcf.empty() == true ) 
+         || ( maskf.empty() == true ) || ( comp.empty() == true ) )
+        return false;
+
+    {
+        perf::Timer timer( perf::UNPACK );
+
+        const HighlightSetting light = highlights();
+
+        pool::parallelFor( srch, srcw * 8, [&]( unsigned y0, unsigned y1, unsigned )
+        {
+            for( unsigned y=y0; y<y1; y++ )
+            {
+                const unsigned char* row = &srcptr[ (size_t)y * srcw * srcd ];
+
+                // boost 1 keeps source linear.
+                simd::unpackRGB( row, srcd, 
+                                 linear.row( 0, y ), linear.row( 1, y ), 
+                                 linear.row( 2, y ), srcw, light.level, 1.f );
+                simd::unpackRGB( row, srcd, 
+                                 srcf.row( 0, y ), srcf.row( 1, y ), 
+                                 srcf.row( 2, y ), srcw, light.level, light.boost );
+            }
+        } );
+    }
+
+    if ( compileKernel( maskf, full ) == false )
+        return false;
+
+    // signed circle of confusion by mask size, negative is front of focus.
+    const size_t  count = (size_t)srcw * srch;
+    vector<float> coc( count );
+
+    pool::parallelFor( srch, srcw, [&]( unsigned y0, unsigned y1, unsigned )
+    {
+        for( size_t cnt=(size_t)y0*srcw; cnt<(size_t)y1*srcw; cnt++ )
+        {
+            float z = depthbits == 8 
+                      ? ( (const unsigned char*)depthptr )[cnt] / 255.f
+                      : ( (const unsigned short*)depthptr )[cnt] / 65535.f;
+
+            coc[cnt] = min( max( ( z - focus ) * cocscale, -1.f ), 1.f );
+        }
+    } );
+
+    // Layer k of a side has coc k / ( layers - 1 ), a pixel is shared by
+    // two layers around its coc linearly. Order of front to back is
+    // front side from largest coc, sharp layer, then back side.
+    // Lower layer and weight of upper one are found once per pixel,
+    // with bounding boxes of orders reduced from boxes of workers.
+    const unsigned   orders   = layers * 2 - 1;
+    const unsigned   nworkers = pool::threads();
+    vector<unsigned> lower( count );
+    vector<float>    upper( count );
+    vector<unsigned> boxes( (size_t)nworkers * orders * 4 );
+    vector<float>    alpha( count );
+
+    for( size_t cnt=0; cnt<boxes.size(); cnt+=4 )
+    {
+        boxes[cnt + 0] = srcw;
+        boxes[cnt + 1] = srch;
+        boxes[cnt + 2] = 0;
+        boxes[cnt + 3] = 0;
+    }
+
+    pool::parallelFor( srch, srcw * 4, [&]( unsigned y0, unsigned y1, unsigned wk )
+    {
+        unsigned* wbox = &boxes[ (size_t)wk * orders * 4 ];
+
+        for( unsigned y=y0; y<y1; y++ )
+        {
+            for( unsigned x=0; x<srcw; x++ )
+            {
+                size_t   pos = (size_t)y * srcw + x;
+                float    a   = fabs( coc[pos] ) * ( layers - 1 );
+                unsigned k0  = min( (unsigned)a, layers - 1 );
+                float    t   = a - k0;
+
+                lower[pos] = k0;
+                upper[pos] = t;
+
+                // orders of k0 and k0 + 1, of side of pixel.
+                for( unsigned k=k0; k<=min( k0 + 1, layers - 1 ); k++ )
+                {
+                    if ( ( k == k0 ? 1.f - t : t ) <= 0.f )
+                        continue;
+
+                    unsigned  order = coc[pos] < 0.f ? layers - 1 - k : layers - 1 + k;
+                    unsigned* box   = &wbox[ order * 4 ];
+
+                    box[0] = min( box[0], x );
+                    box[1] = min( box[1], y );
+                    box[2] = max( box[2], x + 1 );
+                    box[3] = max( box[3], y + 1 );
+                }
+            }
+        }
+    } );
+
+    for( int order=-(int)( layers - 1 ); order<(int)layers; order++ )
+    {
+        const unsigned k    = (unsigned)abs( order );
+        const float    side = order < 0 ? -1.f : 1.f;
+
+        unsigned bx0 = srcw;
+        unsigned by0 = srch;
+        unsigned bx1 = 0;
+        unsigned by1 = 0;
+
+        for( unsigned wk=0; wk<nworkers; wk++ )
+        {
+            const unsigned* box = &boxes[ ( (size_t)wk * orders + order + layers - 1 ) * 4 ];
+
+            bx0 = min( bx0, box[0] );
+            by0 = min( by0, box[1] );
+            bx1 = max( bx1, box[2] );
+            by1 = max( by1, box[3] );
+        }
+
+        // nothing in this layer.
+        if ( bx1 == 0 )
+            continue;
+
+        // weights of this layer, in its bounding box only.
+        pool::parallelFor( by1 - by0, ( bx1 - bx0 ) * 2,
+                           [&]( unsigned y0, unsigned y1, unsigned )
+        {
+            for( unsigned y=by0+y0; y<by0+y1; y++ )
+            {
+                for( unsigned x=bx0; x<bx1; x++ )
+                {
+                    size_t pos = (size_t)y * srcw + x;
+                    float  wgt = 0.f;
+
+                    if ( ( k == 0 ) || ( coc[pos] * side > 0.f ) )
+                    {
+                        if ( lower[pos] == k )
+                            wgt = 1.f - upper[pos];
+                        else
+                        if ( lower[pos] + 1 == k )
+                            wgt = upper[pos];
+                    }
+
+                    alpha[pos] = wgt;
+                }
+            }
+        } );
+
+        float    cf = (float)k / ( layers - 1 );
+        unsigned kw = max( 1u, (unsigned)( bkw * cf + 0.5f ) );
+        unsigned kh = max( 1u, (unsigned)( bkh * cf + 0.5f ) );
+
+        BokehKernel kernel;
+        PlanarImage scaled;
+
+        if ( ( kw > 1 ) || ( kh > 1 ) )
+        {
+            scaled = scaleMask( maskf, kw, kh, full.flat );
+        }
+
+        if ( ( scaled.empty() == true ) || ( compileKernel( scaled, kernel ) == false ) )
+        {
+            comp.addSharp( linear, alpha, bx0, by0, bx1 - bx0, by1 - by0 );
+            continue;
+        }
+
+        // only bounding box of layer, with zero margins of aperture
+        // size around, so wrap around of convolution reads zeros.
+        const unsigned lw = bx1 - bx0 + kw * 2;
+        const unsigned lh = by1 - by0 + kh * 2;
+        PlanarImage    layerc( lw, lh );
+        PlanarImage    layera( lw, lh );
+        PlanarImage    outc( lw, lh );
+        PlanarImage    outa( lw, lh );
+
+        if ( ( layerc.empty() == true ) || ( layera.empty() == true )
+             || ( outc.empty() == true ) || ( outa.empty() == true ) )
+            return false;
+
+        for( unsigned y=by0; y<by1; y++ )
+        {
+            const float* a = &alpha[ (size_t)y * srcw ];
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                const float* src = srcf.row( c, y );
+                float*       dst = layerc.row( c, y - by0 + kh ) + kw;
+
+                for( unsigned x=bx0; x<bx1; x++ )
+                {
+                    dst[ x - bx0 ] = src[x] * a[x];
+                }
+            }
+
+            memcpy( layera.row( 0, y - by0 + kh ) + kw, &a[bx0], 
+                    ( bx1 - bx0 ) * sizeof(float) );
+        }
+
+        convolveKernel( layerc, kernel, outc );
+        convolveKernel( layera, kernel, outa );
+
+        // blur spreads kw / 2 and kh / 2 around, in image.
+        unsigned rx0 = bx0 > kw / 2 ? bx0 - kw / 2 : 0;
+        unsigned ry0 = by0 > kh / 2 ? by0 - kh / 2 : 0;
+        unsigned rx1 = min( srcw, bx1 + kw / 2 + 1 );
+        unsigned ry1 = min( srch, by1 + kh / 2 + 1 );
+
+        // engine output ( x, y ) has tap ( mx, my ) from
+        // ( x - mx, y + kh - my ), centered one is at 
+        // ( x + kw / 2, y + kh / 2 - kh ) of it.
+        comp.addBlurred( outc, outa, rx0, ry0, rx1 - rx0, ry1 - ry0,
+                         rx0 - bx0 + kw + kw / 2, 
+                         ry0 - by0 + kh + kh / 2 + lh - kh );
+    }
+
+    return comp.save( outptr );
+}
@@ -1,15 +1,398 @@
 #ifndef __LIBBOKEH_H__
+#define __LIBBOKEH_H__
+
+#include <cstddef>
+
+/// Bokeh mask compiled to list of non-zero taps.
+class BokehKernel;
+
+/// Name of vector instruction set selected at runtime :
+/// "scalar", "sse2", "avx2" or "avx512".
+/// Environment variable BOKEH_SIMD limits it, as same names.
+const char* GetBokehSIMD();
+
+/// Count of threads of processing, including caller.
+/// Environment variable BOKEH_THREADS sets it at start up, 
+/// and BOKEH_PIN=1 pins each thread to a core.
+unsigned GetBokehThreads();
+/// 0 for all of hardware threads.
+void SetBokehThreads( unsigned n );
+void SetBokehPinning( bool pin );
+
+/// Image buffers are recycled by size, between calls and frames.
+/// Counts since start or last ResetBokehMemoryStats().
+struct BokehMemoryStats
+{
+    unsigned long long  requests;   /// buffers requested.
+    unsigned long long  allocs;     /// buffers allocated from system.
+    unsigned long long  reuses;     /// buffers recycled.
+    unsigned long long  peakbytes;  /// max bytes of buffers in use.
+    unsigned long long  cachedbytes;/// bytes kept for recycling.
+    unsigned long long  hugebytes;  /// bytes backed by huge pages.
+};
+
+void GetBokehMemoryStats( BokehMemoryStats &stats );
+void ResetBokehMemoryStats();
+/// Backs buffers over 2 MB by transparent huge pages, Linux only.
+/// Environment variable BOKEH_HUGEPAGES=1 enables it at start up.
+void SetBokehHugePages( bool enable );
+/// Frees buffers kept for recycling.
+void TrimBokehMemory();
+
+/// Stages of processing in BokehStats.
+enum BokehStage
+{
+    BOKEH_STAGE_UNPACK = 0,     /// source bytes to floats, with highlights.
+    BOKEH_STAGE_KERNEL,         /// mask compiled and normalized.
+    BOKEH_STAGE_CONVOLVE,       /// loops of taps, FFT and resampling.
+    BOKEH_STAGE_PACK,           /// floats quantized to bytes.
+    BOKEH_STAGE_MAX
+};
+
+struct BokehStageStats
+{
+    unsigned long long  calls;
+    unsigned long long  ns;         /// by monotonic clock.
+    unsigned long long  bytes;      /// allocated from system.
+    unsigned long long  taps;       /// taps x pixels, a span counts 2.
+    unsigned            threads;    /// max threads of a loop.
+    /// hardware counters of all threads, 0 when not enabled.
+    unsigned long long  cycles;
+    unsigned long long  instructions;
+    unsigned long long  llcmisses;  /// last level cache misses.
+};
+
+/// Time and work of processing by stages, since start or last
+/// ResetBokehStats(). Fixed point and stream engines pack bytes in
+/// convolution loops, so these are counted as BOKEH_STAGE_CONVOLVE.
+struct BokehStats
+{
+    BokehStageStats     stages[ BOKEH_STAGE_MAX ];
+    unsigned long long  bytes;      /// allocated from system, any stage.
+    bool                counters;   /// hardware counters enabled.
+};
+
+void GetBokehStats( BokehStats &stats );
+void ResetBokehStats();
+/// "unpack", "kernel", "convolve" or "pack".
+const char* GetBokehStageName( unsigned stage );
+/// Counts cycles, instructions and LLC misses by perf_event_open()
+/// of Linux, false when not supported or permitted.
+/// Environment variable BOKEH_PERF=1 enables them at start up.
+bool SetBokehCounters( bool enable );
+
+/// Pixels of all channels over intensity ( 0 to 1, default 0.9 ) 
+/// are boosted by 3 as highlights. Not thread safe to processing,
+/// BokehContext keeps its own.
+float GetBokehIntensity();
+void SetBokehIntensity( float level );
 
 bool ProcessBokeh( const unsigned char* srcptr, 
                    unsigned srcw, unsigned srch, unsigned srcd,
                    const unsigned char* bokeh,  
 				   unsigned char* &outptr );
 
+/// Mask of bkw x bkh, as BokehContext of defaults and anchor ( 0, bkh ).
 bool ProcessFastBokeh( const unsigned char* srcptr, 
                        unsigned srcw, unsigned srch, unsigned srcd,
                        const unsigned char* bokeh,  
                        unsigned bkw, unsigned bkh,
 				       unsigned char* &outptr );
 
+/// Same result as ProcessFastBokeh(), gathering each output pixel 
+/// directly from source without temporary shifted images.
+bool ProcessGatherBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const unsigned char* bokeh,  
+                         unsigned bkw, unsigned bkh,
+                         unsigned char* &outptr );
+/// Compiles mask once, to be used for many frames.
+/// Returns NULL when mask has no non-zero pixel.
+BokehKernel* CompileBokehKernel( const unsigned char* bokeh,  
+                                 unsigned bkw, unsigned bkh );
+void DiscardBokehKernel( BokehKernel* &kernel );
+/// Count of non-zero taps.
+unsigned BokehKernelTaps( const BokehKernel* kernel );
+
+/// Same as ProcessGatherBokeh() with compiled mask,
+/// costs only for non-zero taps.
+/// Flat weighted masks ( disc, polygon ) are done by spans of row
+/// prefix sums, costs O( bkh ) per pixel regardless of mask width.
+bool ProcessKernelBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const BokehKernel* kernel,
+                         unsigned char* &outptr );
+
+/// Fixed point version of ProcessKernelBokeh() : 16 bit samples,
+/// integer weights of sum about 2^22 and 32 bit accumulators.
+/// Highlights boosted by 3 are kept as 16 bit samples up to 765.
+/// Rounding of weights bounds difference to float engines as
+///   1 + 765 x ( count of taps ) / ( sum of integer weights ) levels,
+/// where the sum is 2^22 unless a tap holds over 1/128 of mask weight,
+/// plus 0.5 level for 4 channel input. In practice it is 1 level.
+bool ProcessFixedBokeh( const unsigned char* srcptr, 
+                        unsigned srcw, unsigned srch, unsigned srcd,
+                        const BokehKernel* kernel,
+                        unsigned char* &outptr );
+
+/// Row callbacks of ProcessStreamBokeh(), called in order of y.
+/// Reader fills srcw x srcd bytes of source row y,
+/// writer receives srcw x 3 bytes of output row y.
+/// Returning false stops processing.
+typedef bool (*BokehRowReader)( unsigned y, unsigned char* row, void* param );
+typedef bool (*BokehRowWriter)( unsigned y, const unsigned char* row, void* param );
+
+/// Same result as ProcessKernelBokeh() without whole images in memory :
+/// source rows are read incrementally, and output rows are written by
+/// bands as soon as their source rows are read.
+/// Memory is O( srcw x ( band + mask height ) ) regardless of srch.
+/// First rows of mask height are kept for wrap-around of last rows.
+bool ProcessStreamBokeh( unsigned srcw, unsigned srch, unsigned srcd,
+                         BokehRowReader reader, void* rdparam,
+                         const BokehKernel* kernel,
+                         BokehRowWriter writer, void* wrparam,
+                         unsigned band = 32 );
+
+/// Sample formats of BokehRaster.
+enum BokehRasterFormat
+{
+    BOKEH_RASTER_U8 = 0,
+    BOKEH_RASTER_U16BE,     /// as 16 bit PPM and PGM.
+    BOKEH_RASTER_F32LE,     /// as PFM of negative scale.
+    BOKEH_RASTER_F32BE
+};
+
+/// Pixels in caller's memory, as mapped PPM, PGM or PFM files.
+/// Rows start at pixels and go by rowstride bytes, negative for
+/// bottom-up rasters like PFM. Samples are read as value / range.
+struct BokehRaster
+{
+    void*       pixels;
+    unsigned    w;
+    unsigned    h;
+    unsigned    d;          /// 1, 3 or 4 channels.
+    unsigned    format;     /// BokehRasterFormat.
+    long        rowstride;
+    float       range;      /// max value of integer formats, 1 for float.
+};
+
+/// Compiles mask of any raster format, channels are averaged.
+BokehKernel* CompileRasterKernel( const BokehRaster &mask );
+/// Same as ProcessKernelBokeh() reading source raster directly,
+/// and writing into caller's dst of same size in 3 channels.
+/// Integer dst is clamped, float dst keeps boosted highlights over 1.
+bool ProcessRasterBokeh( const BokehRaster &src, const BokehKernel* kernel,
+                         BokehRaster &dst );
+
+/// Output tile size for ProcessKernelBokeh(), each tile gathers
+/// source with halo of kernel size in cache. 0 width for whole rows.
+void SetBokehTileSize( unsigned tilew, unsigned tileh );
+void GetBokehTileSize( unsigned &tilew, unsigned &tileh );
+/// Measures tile sizes with kernel on this CPU, and sets fastest one.
+/// Result is cached by mask size, so it costs once per process.
+bool AutotuneBokehTiles( const BokehKernel* kernel,
+                         unsigned &tilew, unsigned &tileh );
+
+/// Same result as ProcessFastBokeh() by FFT circular convolution,
+/// costs O( W.H.log(W.H) ) regardless of mask size.
+/// Float FFT rounding keeps difference to direct engines within
+/// 1e-4 of full scale, so 8 bit output differs at most 1 level.
+bool ProcessFFTBokeh( const unsigned char* srcptr, 
+                      unsigned srcw, unsigned srch, unsigned srcd,
+                      const unsigned char* bokeh,  
+                      unsigned bkw, unsigned bkh,
+                      unsigned char* &outptr );
+/// Returns rank of separable approximation for mask in errbudget,
+/// as relative Frobenius error ( 0 means failed ).
+/// ProcessSeparableBokeh() costs rank x ( bkw + bkh ) per pixel,
+/// so it is worth to use when it is smaller than count of mask taps.
+unsigned AnalyseBokehMask( const unsigned char* bokeh, 
+                           unsigned bkw, unsigned bkh,
+                           float errbudget = 0.01f );
+
+/// Approximated ProcessFastBokeh() by SVD of mask, 
+/// with rank-1 horizontal and vertical passes.
+bool ProcessSeparableBokeh( const unsigned char* srcptr, 
+                            unsigned srcw, unsigned srch, unsigned srcd,
+                            const unsigned char* bokeh,  
+                            unsigned bkw, unsigned bkh,
+                            unsigned char* &outptr,
+                            float errbudget = 0.01f );
+
+/// Reduction of pyramid mode for mask and quality : power of 2,
+/// while smaller side of reduced mask keeps 8 to 64 pixels 
+/// for quality 0 to 1. Quality 1 is 1, not reduced.
+unsigned PyramidBokehScale( unsigned bkw, unsigned bkh, float quality = 0.5f );
+
+/// Approximated ProcessFastBokeh() for large masks.
+/// Source and mask are reduced by PyramidBokehScale(), convolved,
+/// and enlarged again. Brightest highlights are convolved at full
+/// resolution and added, in budget of ( 1 + 4 x quality ) times of
+/// reduced convolution. Each 2x reduction costs 1/16.
+bool ProcessPyramidBokeh( const unsigned char* srcptr, 
+                          unsigned srcw, unsigned srch, unsigned srcd,
+                          const unsigned char* bokeh,  
+                          unsigned bkw, unsigned bkh,
+                          unsigned char* &outptr,
+                          float quality = 0.5f );
+
+/// Reduction of rest of source in ProcessHybridBokeh(), as 
+/// PyramidBokehScale() but reduced mask keeps 4 to 32 pixels.
+unsigned HybridBokehScale( unsigned bkw, unsigned bkh, float quality = 0.5f );
+
+/// Approximated ProcessFastBokeh() for night shots of few highlights.
+/// Boosted highlights are listed and splatted by mask shape at full
+/// resolution, and rest of source is convolved at HybridBokehScale().
+/// Cost of highlights grows by their count, and by mask height only
+/// for flat masks. Quality 1 is same as ProcessFastBokeh().
+bool ProcessHybridBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const unsigned char* bokeh,  
+                         unsigned bkw, unsigned bkh,
+                         unsigned char* &outptr,
+                         float quality = 0.5f );
+
+/// Checks cancellation between steps of processing, true to stop.
+typedef bool (*BokehCancelCheck)( void* param );
+
+/// Count of passes of ProcessPreviewBokeh(), coarse to full.
+unsigned PreviewBokehPasses( unsigned bkw, unsigned bkh );
+
+/// A pass of progressive preview, written to outptr of caller 
+/// as srcw x srch x 3 bytes. First pass reduces mask to 4 pixels,
+/// each next pass halves reduction, and last one is same as 
+/// ProcessKernelBokeh() by row bands. Returns false when cancelled,
+/// then outptr may be written partially.
+bool ProcessPreviewBokeh( const unsigned char* srcptr, 
+                          unsigned srcw, unsigned srch, unsigned srcd,
+                          const unsigned char* bokeh,  
+                          unsigned bkw, unsigned bkh,
+                          unsigned pass, unsigned char* outptr,
+                          BokehCancelCheck cancel = NULL, void* param = NULL );
+
+/// Output rectangle of ProcessKernelBokeh() only, as rw x rh x 3 bytes.
+/// Reads source rectangle and halo of mask size, left and below.
+bool ProcessRegionBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const BokehKernel* kernel,
+                         unsigned rx, unsigned ry, unsigned rw, unsigned rh,
+                         unsigned char* &outptr );
+
+/// Pixels out of source for ProcessBorderBokeh().
+enum BokehBorder
+{
+    BOKEH_BORDER_WRAP = 0,  /// other side, as other engines.
+    BOKEH_BORDER_CLAMP,     /// nearest edge pixel.
+    BOKEH_BORDER_MIRROR,    /// reflected without edge, as dcb|abcd|cba.
+    BOKEH_BORDER_CONSTANT   /// color.
+};
+
+/// Output of source size, no expanding and cropping needed.
+/// Mask is placed on each pixel by anchor in mask, -1 for center,
+/// and wrap mode of anchor ( 0, bkh ) is same as ProcessKernelBokeh().
+/// Color of constant border is 0xRRGGBB, boosted as source.
+bool ProcessBorderBokeh( const unsigned char* srcptr, 
+                         unsigned srcw, unsigned srch, unsigned srcd,
+                         const BokehKernel* kernel, unsigned border,
+                         unsigned char* &outptr,
+                         int anchorx = -1, int anchory = -1, 
+                         unsigned color = 0 );
+
+/// Render cache of a frame, for retouching : keeps source in floats,
+/// compiled mask, and output of whole frame after first render.
+/// Edits re-render by what they change, not by frame size.
+class BokehCache;
+
+/// Keeps copy of kernel, and intensity of now. NULL on failure.
+BokehCache* CreateBokehCache( const unsigned char* srcptr, 
+                              unsigned srcw, unsigned srch, unsigned srcd,
+                              const BokehKernel* kernel );
+void DiscardBokehCache( BokehCache* &cache );
+/// Changes intensity of cache only, patching output by pixels 
+/// which become highlights or not.
+bool SetBokehCacheIntensity( BokehCache* cache, float level );
+/// Source rectangle changed, read again from srcptr of whole frame, 
+/// and output re-rendered where it reaches.
+bool UpdateBokehCache( BokehCache* cache, const unsigned char* srcptr, unsigned srcd,
+                       unsigned rx, unsigned ry, unsigned rw, unsigned rh );
+/// Output rectangle of cache as rw x rh x 3 bytes, 
+/// whole frame rendered at first call.
+bool RenderBokehCache( BokehCache* cache, 
+                       unsigned rx, unsigned ry, unsigned rw, unsigned rh,
+                       unsigned char* &outptr );
+
+/// Depth of field by depth map of same size as source,
+/// 8 or 16 ( native endian ) bit samples, larger is farther.
+/// Circle of confusion is | depth - focus | x cocscale of mask size,
+/// in depth of [0,1], limited to mask size. It is binned to layers
+/// of each side of focus, each layer convolved by mask scaled to its
+/// size in bounding box of its pixels only, and composited front to
+/// back by coverage. Source is not wrapped around, no expansion needed.
+bool ProcessDepthBokeh( const unsigned char* srcptr, 
+                        unsigned srcw, unsigned srch, unsigned srcd,
+                        const void* depthptr, unsigned depthbits,
+                        const unsigned char* bokeh,  
+                        unsigned bkw, unsigned bkh,
+                        float focus,
+                        unsigned char* &outptr,
+                        float cocscale = 4.f, unsigned layers = 6 );
+
+/// Engines of BokehContext.
+enum BokehEngine
+{
+    BOKEH_ENGINE_AUTO = 0,  /// as ProcessKernelBokeh(), spans or tiles.
+    BOKEH_ENGINE_TILED,     /// tiles of SetBokehTileSize(), any mask.
+    BOKEH_ENGINE_GATHER     /// whole rows, for small masks.
+};
+
+/// Settings of BokehContext, InitBokehConfig() gives defaults.
+struct BokehConfig
+{
+    float       intensity;  /// highlight level, of SetBokehIntensity().
+    float       boost;      /// multiplier of highlights, 3.
+    unsigned    threads;    /// limit of threads, 0 for all.
+    unsigned    engine;     /// BokehEngine, auto.
+    unsigned    border;     /// BokehBorder, wrap.
+    int         anchorx;    /// as ProcessBorderBokeh(), -1 for center.
+    int         anchory;
+    unsigned    color;      /// 0xRRGGBB of constant border.
+};
+
+void InitBokehConfig( BokehConfig &config );
+
+/// Processing state for frames of a stream : configuration, compiled
+/// mask, and own recycling of buffers, so frames of same size allocate 
+/// nothing after first one. Contexts are independent of each other and
+/// of process settings, each may run in its own thread at same time.
+/// A context must not be used by two threads at once.
+class BokehContext;
+
+/// Mask is compiled by intensity and boost of config. NULL on failure.
+BokehContext* CreateBokehContext( const BokehConfig &config,
+                                  const unsigned char* bokeh,  
+                                  unsigned bkw, unsigned bkh );
+void DiscardBokehContext( BokehContext* &ctx );
+void GetBokehContextConfig( const BokehContext* ctx, BokehConfig &config );
+/// Mask is compiled again when intensity or boost changed.
+bool SetBokehContextConfig( BokehContext* ctx, const BokehConfig &config );
+bool SetBokehContextMask( BokehContext* ctx, const unsigned char* bokeh,  
+                          unsigned bkw, unsigned bkh );
+/// Processes a frame into dstptr of caller, in size of source.
+/// Rows go by stride bytes, 0 for packed rows. Output has 3 channels,
+/// or 4 with opaque alpha.
+bool ProcessBokehContext( BokehContext* ctx, 
+                          const unsigned char* srcptr, 
+                          unsigned srcw, unsigned srch, unsigned srcd,
+                          size_t srcstride,
+                          unsigned char* dstptr, size_t dststride, unsigned dstd );
+/// Memory stats of buffers of context.
+void GetBokehContextMemoryStats( BokehContext* ctx, BokehMemoryStats &stats );
+/// Stats of frames of context.
+void GetBokehContextStats( BokehContext* ctx, BokehStats &stats );
+void ResetBokehContextStats( BokehContext* ctx );
+
+/// PSNR in dB of 8 bit image to reference, 99 for same images.
+double BokehPSNR( const unsigned char* ref, const unsigned char* img,
+                  unsigned w, unsigned h, unsigned d = 3 );
 
 #endif /// of __LIBBOKEH_H__
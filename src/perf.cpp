@@ -0,0 +1,345 @@
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+#if defined(__linux__)
+    #include <unistd.h>
+    #include <sys/syscall.h>
+    #include <linux/perf_event.h>
+#endif /// of __linux__
+
+#include "perf.h"
+
+#ifndef nullptr
+    #define nullptr     NULL
+#endif
+
+using namespace std;
+
+namespace
+{
+    const char* stage_names[] = { "unpack", "kernel", "convolve", "pack" };
+    const char* counter_names[] = { "cycles", "instructions", "llc_misses" };
+
+    atomic<bool> counters_on( false );
+
+    // counters of a thread, opened at first use and closed at exit.
+    class ThreadCounters
+    {
+        public:
+            ThreadCounters() : opened( false )
+            {
+                for( unsigned cnt=0; cnt<perf::COUNTER_MAX; cnt++ )
+                {
+                    fds[cnt] = -1;
+                }
+            }
+
+            ~ThreadCounters()
+            {
+#if defined(__linux__)
+                for( unsigned cnt=0; cnt<perf::COUNTER_MAX; cnt++ )
+                {
+                    if ( fds[cnt] >= 0 )
+                        close( fds[cnt] );
+                }
+#endif /// of __linux__
+            }
+
+        public:
+            // false when cycles can not be counted.
+            bool open()
+            {
+                if ( opened == true )
+                    return fds[ perf::CYCLES ] >= 0;
+
+                opened = true;
+
+#if defined(__linux__)
+                const unsigned long long configs[] =
+                {
+                    PERF_COUNT_HW_CPU_CYCLES,
+                    PERF_COUNT_HW_INSTRUCTIONS,
+                    PERF_COUNT_HW_CACHE_MISSES  /// last level cache.
+                };
+
+                for( unsigned cnt=0; cnt<perf::COUNTER_MAX; cnt++ )
+                {
+                    perf_event_attr attr;
+                    memset( &attr, 0, sizeof( attr ) );
+
+                    attr.type           = PERF_TYPE_HARDWARE;
+                    attr.size           = sizeof( attr );
+                    attr.config         = configs[cnt];
+                    attr.exclude_kernel = 1;
+                    attr.exclude_hv     = 1;
+
+                    // this thread on any cpu.
+                    fds[cnt] = (int)syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+                }
+#endif /// of __linux__
+
+                return fds[ perf::CYCLES ] >= 0;
+            }
+
+            // counters not supported stay 0.
+            void read( unsigned long long* values )
+            {
+                for( unsigned cnt=0; cnt<perf::COUNTER_MAX; cnt++ )
+                {
+                    values[cnt] = 0;
+
+#if defined(__linux__)
+                    if ( fds[cnt] >= 0 )
+                    {
+                        if ( ::read( fds[cnt], &values[cnt], sizeof( values[cnt] ) )
+                             != sizeof( values[cnt] ) )
+                        {
+                            values[cnt] = 0;
+                        }
+                    }
+#endif /// of __linux__
+                }
+            }
+
+        private:
+            bool    opened;
+            int     fds[ perf::COUNTER_MAX ];
+    };
+
+    thread_local ThreadCounters tls_counters;
+    thread_local perf::Sink*    tls_sink  = nullptr;
+    thread_local perf::Timer*   tls_timer = nullptr;
+    // counters of worker at enter(), one loop at a time.
+    thread_local unsigned long long tls_begin[ perf::COUNTER_MAX ];
+
+    class __PERF
+    {
+        public:
+            __PERF()
+            {
+                const char* env = getenv( "BOKEH_PERF" );
+
+                if ( ( env != nullptr ) && ( atoi( env ) > 0 ) )
+                {
+                    perf::setCounters( true );
+                }
+            }
+
+        public:
+            perf::Sink  procsink;
+    };
+
+    __PERF perfs;
+}
+
+namespace perf {
+
+unsigned long long now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+const char* stageName( Stage s )
+{
+    if ( s < STAGE_MAX )
+        return stage_names[s];
+
+    return "unknown";
+}
+
+const char* counterName( Counter c )
+{
+    if ( c < COUNTER_MAX )
+        return counter_names[c];
+
+    return "unknown";
+}
+
+bool setCounters( bool enable )
+{
+    if ( ( enable == true ) && ( tls_counters.open() == false ) )
+    {
+        enable = false;
+    }
+
+    counters_on = enable;
+
+    return enable;
+}
+
+bool counters()
+{
+    return counters_on;
+}
+
+Sink::Sink()
+{
+    memset( &st, 0, sizeof( Stats ) );
+}
+
+void Sink::add( Stage s, const StageStats &ss )
+{
+    lock_guard<mutex> lock( mtx );
+
+    StageStats &dst = st.stages[s];
+
+    dst.calls  += ss.calls;
+    dst.ns     += ss.ns;
+    dst.bytes  += ss.bytes;
+    dst.taps   += ss.taps;
+    dst.threads = max( dst.threads, ss.threads );
+
+    for( unsigned cnt=0; cnt<COUNTER_MAX; cnt++ )
+    {
+        dst.counters[cnt] += ss.counters[cnt];
+    }
+}
+
+void Sink::addBytes( unsigned long long n )
+{
+    lock_guard<mutex> lock( mtx );
+
+    st.bytes += n;
+}
+
+Stats Sink::stats()
+{
+    lock_guard<mutex> lock( mtx );
+
+    return st;
+}
+
+void Sink::reset()
+{
+    lock_guard<mutex> lock( mtx );
+
+    memset( &st, 0, sizeof( Stats ) );
+}
+
+Sink& global()
+{
+    return perfs.procsink;
+}
+
+Sink& current()
+{
+    if ( tls_sink != nullptr )
+        return *tls_sink;
+
+    return perfs.procsink;
+}
+
+Scope::Scope( Sink &s )
+ : prev( tls_sink )
+{
+    tls_sink = &s;
+}
+
+Scope::~Scope()
+{
+    tls_sink = prev;
+}
+
+Timer::Timer( Stage s )
+ : root( tls_timer ), stage( s ), counting( counters_on )
+{
+    if ( root != nullptr )
+        return;
+
+    root = this;
+    tls_timer = this;
+
+    memset( &st, 0, sizeof( StageStats ) );
+    st.calls   = 1;
+    st.threads = 1;
+
+    for( unsigned cnt=0; cnt<COUNTER_MAX; cnt++ )
+    {
+        workers[cnt] = 0;
+        begin[cnt]   = 0;
+    }
+
+    if ( counting == true )
+    {
+        tls_counters.open();
+        tls_counters.read( begin );
+    }
+
+    st.ns = now();
+}
+
+Timer::~Timer()
+{
+    if ( root != this )
+        return;
+
+    st.ns = now() - st.ns;
+
+    if ( counting == true )
+    {
+        unsigned long long end[ COUNTER_MAX ];
+
+        tls_counters.read( end );
+
+        for( unsigned cnt=0; cnt<COUNTER_MAX; cnt++ )
+        {
+            st.counters[cnt] = end[cnt] - begin[cnt] + workers[cnt];
+        }
+    }
+
+    tls_timer = nullptr;
+
+    current().add( stage, st );
+}
+
+void Timer::loop( unsigned nworkers )
+{
+    root->st.threads = max( root->st.threads, nworkers );
+}
+
+void Timer::enter()
+{
+    if ( root->counting == true )
+    {
+        tls_counters.open();
+        tls_counters.read( tls_begin );
+    }
+}
+
+void Timer::leave()
+{
+    if ( root->counting == true )
+    {
+        unsigned long long end[ COUNTER_MAX ];
+
+        tls_counters.read( end );
+
+        for( unsigned cnt=0; cnt<COUNTER_MAX; cnt++ )
+        {
+            root->workers[cnt] += end[cnt] - tls_begin[cnt];
+        }
+    }
+}
+
+void addTaps( unsigned long long n )
+{
+    if ( tls_timer != nullptr )
+    {
+        tls_timer->st.taps += n;
+    }
+}
+
+void addBytes( unsigned long long n )
+{
+    if ( tls_timer != nullptr )
+    {
+        tls_timer->st.bytes += n;
+    }
+
+    current().addBytes( n );
+}
+
+}; /// of namespace perf
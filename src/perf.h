@@ -0,0 +1,129 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <atomic>
+#include <mutex>
+
+#include "pool.h"
+
+/// Per stage instrumentation of libbokeh.
+/// Stages are timed by monotonic clock in ns, with bytes allocated,
+/// taps evaluated and threads used, and recorded to sink of calling
+/// thread. On Linux, hardware counters ( cycles, instructions and
+/// last level cache misses ) of caller and workers of pool are added
+/// when enabled, environment variable BOKEH_PERF=1 enables them at
+/// start up.
+namespace perf {
+
+enum Stage
+{
+    UNPACK = 0,     /// bytes to float planes, with highlights.
+    KERNEL,         /// mask compiled and normalized.
+    CONVOLVE,       /// loops of taps.
+    PACK,           /// float planes quantized to bytes.
+    STAGE_MAX
+};
+
+enum Counter
+{
+    CYCLES = 0,
+    INSTRUCTIONS,
+    LLC_MISSES,
+    COUNTER_MAX
+};
+
+struct StageStats
+{
+    unsigned long long  calls;
+    unsigned long long  ns;
+    unsigned long long  bytes;      /// allocated from system in stage.
+    unsigned long long  taps;       /// taps x pixels.
+    unsigned            threads;    /// max workers of a loop.
+    unsigned long long  counters[ COUNTER_MAX ];
+};
+
+struct Stats
+{
+    StageStats          stages[ STAGE_MAX ];
+    unsigned long long  bytes;      /// allocated from system, all stages.
+};
+
+/// Monotonic clock in ns.
+unsigned long long now();
+const char* stageName( Stage s );
+const char* counterName( Counter c );
+
+/// Opens counters in calling thread to check support,
+/// false when kernel or CPU does not support or permit them.
+bool setCounters( bool enable );
+bool counters();
+
+class Sink
+{
+    public:
+        Sink();
+
+    public:
+        void  add( Stage s, const StageStats &ss );
+        void  addBytes( unsigned long long n );
+        Stats stats();
+        void  reset();
+
+    private:
+        Sink( const Sink& );
+        Sink& operator = ( const Sink& );
+
+    private:
+        std::mutex  mtx;
+        Stats       st;
+};
+
+/// Sink of process, used unless other one is current.
+Sink& global();
+/// Sink of calling thread.
+Sink& current();
+
+/// Makes a sink current for calling thread, until end of scope.
+class Scope
+{
+    public:
+        Scope( Sink &s );
+        ~Scope();
+
+    private:
+        Sink*   prev;
+};
+
+/// Times a stage of calling thread, until end of scope.
+/// Stages inside other stage are counted in outer one.
+class Timer : public pool::Probe
+{
+    public:
+        Timer( Stage s );
+        ~Timer();
+
+    public:
+        void loop( unsigned nworkers );
+        void enter();
+        void leave();
+
+    private:
+        Timer*                              root;   /// outer most.
+        Stage                               stage;
+        bool                                counting;
+        StageStats                          st;
+        unsigned long long                  begin[ COUNTER_MAX ];
+        std::atomic<unsigned long long>     workers[ COUNTER_MAX ];
+
+        friend void addTaps( unsigned long long n );
+        friend void addBytes( unsigned long long n );
+};
+
+/// Counted to stage of calling thread.
+void addTaps( unsigned long long n );
+/// Bytes from system, counted to stage and sink of calling thread.
+void addBytes( unsigned long long n );
+
+}; /// of namespace perf
+
+#endif /// of __PERF_H__
@@ -0,0 +1,399 @@
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <new>
+
+#if defined(__linux__)
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+#include "pool.h"
+
+using namespace std;
+
+namespace
+{
+    // operations of a chunk, to keep scheduling cost small.
+    const double kChunkWork = 32768.0;
+
+    // [lo,hi) packed in 64 bit, so owner and thieves update by one CAS.
+    // padded and aligned to cache line, not to be shared by workers.
+    struct alignas(64) Range
+    {
+        atomic<unsigned long long> r;
+        char                       pad[ 64 - sizeof(unsigned long long) ];
+    };
+
+    inline unsigned long long packRange( unsigned lo, unsigned hi )
+    {
+        return ( (unsigned long long)hi << 32 ) | lo;
+    }
+
+    thread_local bool     tls_inloop = false;
+    thread_local unsigned tls_limit  = 0;
+    thread_local pool::Probe* tls_probe = nullptr;
+
+    class __POOL
+    {
+        public:
+            __POOL() 
+            : count( 0 ), pin( false ), quit( false ), generation( 0 ),
+              body( nullptr ), probe( nullptr ), grain( 1 ), active( 0 ),
+              pending( 0 ), ranges( nullptr ), rangemem( nullptr )
+            {
+                const char* env = getenv( "BOKEH_THREADS" );
+
+                if ( env != nullptr )
+                {
+                    count = atoi( env );
+                }
+
+                env = getenv( "BOKEH_PIN" );
+
+                if ( ( env != nullptr ) && ( atoi( env ) > 0 ) )
+                {
+                    pin = true;
+                }
+
+                count = resolve( count );
+            }
+
+            ~__POOL()
+            {
+                stop();
+            }
+
+        public:
+            unsigned resolve( unsigned n )
+            {
+                if ( n == 0 )
+                {
+                    n = max( 1u, thread::hardware_concurrency() );
+                }
+
+                return n;
+            }
+
+            void stop()
+            {
+                {
+                    lock_guard<mutex> lock( mtx );
+                    quit = true;
+                    cvstart.notify_all();
+                }
+
+                for( size_t cnt=0; cnt<workers.size(); cnt++ )
+                {
+                    workers[cnt].join();
+                }
+
+                workers.clear();
+                quit = false;
+
+                free( rangemem );
+                rangemem = nullptr;
+                ranges   = nullptr;
+            }
+
+            // Workers are started by first parallel loop.
+            void start()
+            {
+                // new of C++11 does not keep alignment over 16 bytes.
+                rangemem = malloc( sizeof( Range ) * count + alignof( Range ) );
+                size_t addr = ( (size_t)rangemem + alignof( Range ) - 1 )
+                              & ~( alignof( Range ) - 1 );
+                ranges = (Range*)addr;
+
+                for( unsigned cnt=0; cnt<count; cnt++ )
+                {
+                    new( &ranges[cnt] ) Range;
+                    ranges[cnt].r = 0;
+                }
+
+                for( unsigned cnt=1; cnt<count; cnt++ )
+                {
+                    workers.push_back( thread( &__POOL::loop, this, cnt, generation ) );
+
+#if defined(__linux__)
+                    if ( pin == true )
+                    {
+                        cpu_set_t cpus;
+                        unsigned  ncpu = max( 1u, thread::hardware_concurrency() );
+
+                        CPU_ZERO( &cpus );
+                        CPU_SET( cnt % ncpu, &cpus );
+                        pthread_setaffinity_np( workers.back().native_handle(),
+                                                sizeof( cpu_set_t ), &cpus );
+                    }
+#endif /// of __linux__
+                }
+            }
+
+            void loop( unsigned idx, unsigned long long seen )
+            {
+                for( ;; )
+                {
+                    {
+                        unique_lock<mutex> lock( mtx );
+                        cvstart.wait( lock, [&]
+                                      { return quit || ( generation != seen ); } );
+
+                        if ( quit == true )
+                            return;
+
+                        seen = generation;
+                    }
+
+                    if ( idx < active )
+                    {
+                        if ( probe != nullptr )
+                            probe->enter();
+
+                        work( idx );
+
+                        if ( probe != nullptr )
+                            probe->leave();
+                    }
+
+                    if ( --pending == 0 )
+                    {
+                        lock_guard<mutex> lock( mtx );
+                        cvdone.notify_all();
+                    }
+                }
+            }
+
+            bool take( unsigned idx, unsigned &b, unsigned &e )
+            {
+                unsigned long long cur = ranges[idx].r.load();
+
+                for( ;; )
+                {
+                    unsigned lo = (unsigned)cur;
+                    unsigned hi = (unsigned)( cur >> 32 );
+
+                    if ( lo >= hi )
+                        return false;
+
+                    unsigned nlo = min( hi, lo + grain );
+
+                    if ( ranges[idx].r.compare_exchange_weak( cur, packRange( nlo, hi ) ) )
+                    {
+                        b = lo;
+                        e = nlo;
+                        return true;
+                    }
+                }
+            }
+
+            // Steals upper half of remaining range of another worker.
+            bool steal( unsigned idx )
+            {
+                for( unsigned cnt=1; cnt<active; cnt++ )
+                {
+                    unsigned           victim = ( idx + cnt ) % active;
+                    unsigned long long cur    = ranges[victim].r.load();
+
+                    for( ;; )
+                    {
+                        unsigned lo = (unsigned)cur;
+                        unsigned hi = (unsigned)( cur >> 32 );
+
+                        if ( lo >= hi )
+                            break;
+
+                        unsigned mid = lo + ( hi - lo ) / 2;
+
+                        if ( ranges[victim].r.compare_exchange_weak( cur, packRange( lo, mid ) ) )
+                        {
+                            ranges[idx].r = packRange( mid, hi );
+                            return true;
+                        }
+                    }
+                }
+
+                return false;
+            }
+
+            void work( unsigned idx )
+            {
+                unsigned b = 0;
+                unsigned e = 0;
+
+                tls_inloop = true;
+
+                do
+                {
+                    while( take( idx, b, e ) == true )
+                    {
+                        (*body)( b, e, idx );
+                    }
+                }
+                while( steal( idx ) == true );
+
+                tls_inloop = false;
+            }
+
+            void run( unsigned n, unsigned nworkers, unsigned chunk, 
+                      const pool::Body &fn, pool::Probe* pr )
+            {
+                if ( ( workers.size() + 1 != count ) )
+                {
+                    stop();
+                    start();
+                }
+
+                for( unsigned cnt=0; cnt<count; cnt++ )
+                {
+                    unsigned lo = (unsigned)( (unsigned long long)n * cnt / nworkers );
+                    unsigned hi = (unsigned)( (unsigned long long)n * ( cnt + 1 ) / nworkers );
+
+                    ranges[cnt].r = cnt < nworkers ? packRange( lo, hi ) : 0;
+                }
+
+                body    = &fn;
+                probe   = pr;
+                grain   = chunk;
+                active  = nworkers;
+                pending = count - 1;
+
+                {
+                    lock_guard<mutex> lock( mtx );
+                    generation++;
+                    cvstart.notify_all();
+                }
+
+                work( 0 );
+
+                unique_lock<mutex> lock( mtx );
+                cvdone.wait( lock, [&]{ return pending == 0; } );
+            }
+
+        public:
+            atomic<unsigned>    count;
+            bool                pin;
+            mutex               runmtx;     /// one loop at a time, others wait.
+
+        private:
+            bool                quit;
+            mutex               mtx;
+            condition_variable  cvstart;
+            condition_variable  cvdone;
+            unsigned long long  generation;
+            vector<thread>      workers;
+            const pool::Body*   body;
+            pool::Probe*        probe;
+            unsigned            grain;
+            unsigned            active;
+            atomic<unsigned>    pending;
+            Range*              ranges;
+            void*               rangemem;   /// ranges, before alignment.
+    };
+
+    __POOL workpool;
+}
+
+namespace pool {
+
+unsigned threads()
+{
+    unsigned n = workpool.count;
+
+    if ( ( tls_limit > 0 ) && ( tls_limit < n ) )
+        return tls_limit;
+
+    return n;
+}
+
+void setThreads( unsigned n )
+{
+    lock_guard<mutex> lock( workpool.runmtx );
+
+    workpool.count = workpool.resolve( n );
+}
+
+void setPinning( bool pin )
+{
+    lock_guard<mutex> lock( workpool.runmtx );
+
+    workpool.pin = pin;
+    // applied when workers are restarted.
+    workpool.stop();
+}
+
+bool pinning()
+{
+    return workpool.pin;
+}
+
+void parallelFor( unsigned n, double cost, const Body &body )
+{
+    if ( n == 0 )
+        return;
+
+    cost = max( cost, 1.0 );
+
+    double   work     = cost * n;
+    unsigned nworkers = (unsigned)min( (double)workpool.count.load(), 
+                                       ceil( work / ( kChunkWork * 4 ) ) );
+
+    if ( tls_limit > 0 )
+    {
+        nworkers = min( nworkers, tls_limit );
+    }
+
+    if ( ( nworkers <= 1 ) || ( tls_inloop == true ) )
+    {
+        if ( tls_probe != nullptr )
+            tls_probe->loop( 1 );
+
+        body( 0, n, 0 );
+        return;
+    }
+
+    // loops of other threads are queued, so each one gets its workers.
+    workpool.runmtx.lock();
+
+    // pool may be shrunk by setThreads() before lock.
+    nworkers = min( nworkers, min( n, workpool.count.load() ) );
+
+    if ( tls_probe != nullptr )
+        tls_probe->loop( nworkers );
+
+    // chunks of kChunkWork at least, and some per worker to balance.
+    unsigned chunk = (unsigned)ceil( kChunkWork / cost );
+    chunk = max( 1u, min( chunk, n / ( nworkers * 4 ) ) );
+
+    workpool.run( n, nworkers, chunk, body, tls_probe );
+    workpool.runmtx.unlock();
+}
+
+Limit::Limit( unsigned n )
+ : prev( tls_limit )
+{
+    tls_limit = n;
+}
+
+Limit::~Limit()
+{
+    tls_limit = prev;
+}
+
+Probe::Probe()
+ : prev( tls_probe )
+{
+    tls_probe = this;
+}
+
+Probe::~Probe()
+{
+    tls_probe = prev;
+}
+
+}; /// of namespace pool
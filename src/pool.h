@@ -0,0 +1,87 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+/// Persistent thread pool of libbokeh, independent of OpenMP.
+/// A loop is split to ranges per worker, each worker takes chunks from
+/// its own range, and idle workers steal half of remaining range of
+/// others. Caller thread works as worker 0.
+/// Environment variable BOKEH_THREADS sets count of threads,
+/// and BOKEH_PIN=1 pins workers to cores.
+namespace pool {
+
+/// body( begin, end, worker ) for items [begin,end), worker < threads().
+/// Refers callable of caller without copy, so loops allocate nothing.
+class Body
+{
+    public:
+        template <class F>
+        Body( const F &f )
+         : obj( &f ), fn( &invoke<F> ) {}
+
+        void operator () ( unsigned b, unsigned e, unsigned w ) const
+        {
+            fn( obj, b, e, w );
+        }
+
+    private:
+        template <class F>
+        static void invoke( const void* o, unsigned b, unsigned e, unsigned w )
+        {
+            (*(const F*)o)( b, e, w );
+        }
+
+    private:
+        const void* obj;
+        void        (*fn)( const void*, unsigned, unsigned, unsigned );
+};
+
+/// Count of threads including caller, as limited for calling thread.
+unsigned threads();
+/// 0 for all of hardware threads. Waits running loop to end.
+void setThreads( unsigned n );
+void setPinning( bool pin );
+bool pinning();
+
+/// Runs body over [0,n). cost is rough operations per item, to size
+/// chunks and limit workers, so small loops stay in caller thread.
+/// Nested calls run in calling thread as worker 0, and calls while
+/// pool is busy for other thread wait for it.
+void parallelFor( unsigned n, double cost, const Body &body );
+
+/// Limits workers of loops called by calling thread, until end of scope.
+/// 0 is no limit.
+class Limit
+{
+    public:
+        Limit( unsigned n );
+        ~Limit();
+
+    private:
+        unsigned    prev;
+};
+
+/// Hooks of loops called by calling thread, until end of scope.
+/// loop() is called in calling thread with count of workers of each loop,
+/// enter() and leave() in each other worker around its part of loop.
+class Probe
+{
+    public:
+        Probe();
+        virtual ~Probe();
+
+    public:
+        virtual void loop( unsigned nworkers ) = 0;
+        virtual void enter() = 0;
+        virtual void leave() = 0;
+
+    private:
+        Probe( const Probe& );
+        Probe& operator = ( const Probe& );
+
+    private:
+        Probe*  prev;
+};
+
+}; /// of namespace pool
+
+#endif /// of __POOL_H__
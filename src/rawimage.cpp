@@ -0,0 +1,285 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <climits>
+
+#if !defined(_WIN32) && !defined(WIN32)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #define RAWIMAGE_MMAP
+#endif
+
+#include "rawimage.h"
+
+namespace rawimage {
+
+static void clearMapped( Mapped &m )
+{
+    memset( &m, 0, sizeof( Mapped ) );
+    m.fd = -1;
+}
+
+// Next header token, skipping white spaces and comments.
+static bool headerToken( const char* hdr, size_t len, size_t &pos, 
+                         char* tok, size_t toksz )
+{
+    size_t tlen = 0;
+
+    while( pos < len )
+    {
+        if ( hdr[pos] == '#' )
+        {
+            while( ( pos < len ) && ( hdr[pos] != '\n' ) )
+                pos++;
+        }
+        else
+        if ( isspace( (unsigned char)hdr[pos] ) )
+        {
+            pos++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    while( ( pos < len ) && ( isspace( (unsigned char)hdr[pos] ) == 0 ) 
+           && ( tlen + 1 < toksz ) )
+    {
+        tok[ tlen++ ] = hdr[ pos++ ];
+    }
+
+    tok[tlen] = 0;
+
+    return tlen > 0;
+}
+
+// Parses header, and sets raster to pixels after it.
+static bool parseHeader( Mapped &m )
+{
+    const char* hdr = (const char*)m.base;
+    size_t      pos = 2;
+    char        tok[4][32];
+
+    if ( ( m.length < 3 ) || ( hdr[0] != 'P' ) )
+        return false;
+
+    char     magic = hdr[1];
+    unsigned d     = 0;
+
+    switch( magic )
+    {
+        case '5': d = 1; break;
+        case '6': d = 3; break;
+        case 'f': d = 1; break;
+        case 'F': d = 3; break;
+        default : return false;
+    }
+
+    for( unsigned cnt=0; cnt<3; cnt++ )
+    {
+        if ( headerToken( hdr, m.length, pos, tok[cnt], 32 ) == false )
+            return false;
+    }
+
+    // single white space before pixels.
+    pos++;
+
+    BokehRaster &r = m.raster;
+    
+    r.w = atoi( tok[0] );
+    r.h = atoi( tok[1] );
+    r.d = d;
+
+    if ( ( r.w == 0 ) || ( r.h == 0 ) )
+        return false;
+
+    size_t ssz = 1;
+
+    if ( ( magic == 'f' ) || ( magic == 'F' ) )
+    {
+        // negative scale is little endian, rows are bottom to top.
+        float scale = atof( tok[2] );
+
+        r.format = scale < 0.f ? BOKEH_RASTER_F32LE : BOKEH_RASTER_F32BE;
+        r.range  = 1.f;
+        ssz      = 4;
+    }
+    else
+    {
+        unsigned maxval = atoi( tok[2] );
+
+        if ( ( maxval == 0 ) || ( maxval > 65535 ) )
+            return false;
+
+        r.format = maxval < 256 ? BOKEH_RASTER_U8 : BOKEH_RASTER_U16BE;
+        r.range  = (float)maxval;
+        ssz      = maxval < 256 ? 1 : 2;
+    }
+
+    // sizes of crafted header must not wrap around to pass the check.
+    if ( ( pos > m.length ) || ( r.w > (size_t)LONG_MAX / ( d * ssz ) ) )
+        return false;
+
+    size_t rowbytes = (size_t)r.w * d * ssz;
+
+    if ( r.h > ( m.length - pos ) / rowbytes )
+        return false;
+
+    if ( ssz == 4 )
+    {
+        r.pixels    = (unsigned char*)m.base + pos + rowbytes * ( r.h - 1 );
+        r.rowstride = -(long)rowbytes;
+    }
+    else
+    {
+        r.pixels    = (unsigned char*)m.base + pos;
+        r.rowstride = (long)rowbytes;
+    }
+
+    return true;
+}
+
+bool isRawFile( const char* fpath )
+{
+    FILE* fp = fopen( fpath, "rb" );
+
+    if ( fp == NULL )
+        return false;
+
+    char magic[2] = {0,};
+    bool retb     = false;
+
+    if ( fread( magic, 1, 2, fp ) == 2 )
+    {
+        retb = ( magic[0] == 'P' ) && ( strchr( "56fF", magic[1] ) != NULL );
+    }
+
+    fclose( fp );
+
+    return retb;
+}
+
+#ifdef RAWIMAGE_MMAP
+
+bool mapFile( const char* fpath, Mapped &m )
+{
+    clearMapped( m );
+
+    m.fd = open( fpath, O_RDONLY );
+
+    if ( m.fd < 0 )
+        return false;
+
+    struct stat st;
+
+    if ( ( fstat( m.fd, &st ) == 0 ) && ( st.st_size > 0 ) )
+    {
+        m.length = st.st_size;
+        m.base   = mmap( NULL, m.length, PROT_READ, MAP_SHARED, m.fd, 0 );
+
+        if ( m.base == MAP_FAILED )
+        {
+            m.base = NULL;
+        }
+        else
+        {
+            // whole pixels are read soon.
+            madvise( m.base, m.length, MADV_WILLNEED );
+
+            if ( parseHeader( m ) == true )
+                return true;
+        }
+    }
+
+    unmap( m );
+
+    return false;
+}
+
+bool createFile( const char* fpath, unsigned w, unsigned h, bool pfm, Mapped &m )
+{
+    clearMapped( m );
+
+    if ( ( w == 0 ) || ( h == 0 ) )
+        return false;
+
+    char   hdr[64];
+    int    hdrlen   = snprintf( hdr, 64, "%s\n%u %u\n%s\n", 
+                                pfm == true ? "PF" : "P6", w, h,
+                                pfm == true ? "-1.0" : "255" );
+    size_t rowbytes = (size_t)w * 3 * ( pfm == true ? 4 : 1 );
+
+    if ( ( w > (size_t)LONG_MAX / 12 ) || ( h > ( (size_t)-1 - hdrlen ) / rowbytes ) )
+        return false;
+
+    m.fd = open( fpath, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+
+    if ( m.fd < 0 )
+        return false;
+
+    m.length = hdrlen + rowbytes * h;
+
+    if ( ftruncate( m.fd, m.length ) == 0 )
+    {
+        m.base = mmap( NULL, m.length, PROT_READ | PROT_WRITE, MAP_SHARED, m.fd, 0 );
+
+        if ( m.base == MAP_FAILED )
+        {
+            m.base = NULL;
+        }
+        else
+        {
+            memcpy( m.base, hdr, hdrlen );
+
+            if ( parseHeader( m ) == true )
+                return true;
+        }
+    }
+
+    unmap( m );
+
+    return false;
+}
+
+void unmap( Mapped &m )
+{
+    if ( m.base != NULL )
+    {
+        munmap( m.base, m.length );
+    }
+
+    if ( m.fd >= 0 )
+    {
+        close( m.fd );
+    }
+
+    clearMapped( m );
+}
+
+#else
+
+// No mmap on this platform.
+bool mapFile( const char* fpath, Mapped &m )
+{
+    clearMapped( m );
+    return false;
+}
+
+bool createFile( const char* fpath, unsigned w, unsigned h, bool pfm, Mapped &m )
+{
+    clearMapped( m );
+    return false;
+}
+
+void unmap( Mapped &m )
+{
+    clearMapped( m );
+}
+
+#endif /// of RAWIMAGE_MMAP
+
+}; /// of namespace rawimage
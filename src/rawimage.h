@@ -0,0 +1,30 @@
+#ifndef __RAWIMAGE_H__
+#define __RAWIMAGE_H__
+
+#include <cstddef>
+#include "libbokeh.h"
+
+/// Binary PPM ( P6 ), PGM ( P5 ) of 8 or 16 bit, and PFM ( PF, Pf )
+/// mapped to memory, so pixels are used in place without decoding.
+namespace rawimage {
+
+struct Mapped
+{
+    void*       base;
+    size_t      length;
+    int         fd;
+    BokehRaster raster;     /// points into mapping.
+};
+
+/// Tests magic of file, P5, P6, PF or Pf.
+bool isRawFile( const char* fpath );
+/// Maps file read only.
+bool mapFile( const char* fpath, Mapped &m );
+/// Creates file of w x h RGB pixels with header, mapped writable.
+/// 8 bit PPM, or little endian PFM when pfm is true.
+bool createFile( const char* fpath, unsigned w, unsigned h, bool pfm, Mapped &m );
+void unmap( Mapped &m );
+
+}; /// of namespace rawimage
+
+#endif /// of __RAWIMAGE_H__
@@ -0,0 +1,964 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+    #define SIMD_X86
+    #include <immintrin.h>
+    #define TARGET_SSE2     __attribute__((target("sse2")))
+    #define TARGET_AVX2     __attribute__((target("avx2,fma")))
+    #define TARGET_AVX512   __attribute__((target("avx512f,avx512bw,avx2,fma")))
+#endif /// of __GNUC__ && x86
+
+#include "simd.h"
+
+using namespace std;
+
+namespace simd {
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar reference.
+
+static void axpy_scalar( float* dst, const float* src, float w, unsigned n )
+{
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        dst[cnt] += w * src[cnt];
+    }
+}
+
+static void scale_scalar( float* dst, float s, unsigned n )
+{
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        dst[cnt] *= s;
+    }
+}
+
+static void unpackRGB_scalar( const unsigned char* src, unsigned d,
+                              float* r, float* g, float* b, unsigned n,
+                              float intensity, float boost )
+{
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        float    pix[3] = {0.f};
+        unsigned pixque = cnt * d;
+
+        switch( d )
+        {
+            case 1:
+                pix[0] = (float)src[ pixque ];
+                pix[1] = pix[0];
+                pix[2] = pix[0];
+                break;
+
+            case 3:
+                pix[0] = (float)src[ pixque + 0 ];
+                pix[1] = (float)src[ pixque + 1 ];
+                pix[2] = (float)src[ pixque + 2 ];
+                break;
+
+            case 4:
+                {
+                    float af = (float)src[ pixque + 3 ] / 255.f;
+
+                    pix[0] = (float)src[ pixque + 0 ] * af;
+                    pix[1] = (float)src[ pixque + 1 ] * af;
+                    pix[2] = (float)src[ pixque + 2 ] * af;
+                }
+                break;
+        }
+
+        float fr = pix[0] / 255.f;
+        float fg = pix[1] / 255.f;
+        float fb = pix[2] / 255.f;
+
+        if ( ( fr > intensity ) && ( fg > intensity ) && ( fb > intensity ) )
+        {
+            fr *= boost;
+            fg *= boost;
+            fb *= boost;
+        }
+
+        r[cnt] = fr;
+        g[cnt] = fg;
+        b[cnt] = fb;
+    }
+}
+
+static void packRGB_scalar( const float* r, const float* g, const float* b,
+                            unsigned char* dst, unsigned n )
+{
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        dst[ cnt * 3 + 0 ] = max( 0.f, min( 1.f, r[cnt] ) ) * 255.f;
+        dst[ cnt * 3 + 1 ] = max( 0.f, min( 1.f, g[cnt] ) ) * 255.f;
+        dst[ cnt * 3 + 2 ] = max( 0.f, min( 1.f, b[cnt] ) ) * 255.f;
+    }
+}
+
+static void packBytes_scalar( const float* src, unsigned char* dst, unsigned n )
+{
+    for( unsigned cnt=0; cnt<n; cnt++ )
+    {
+        dst[cnt] = max( 0.f, min( 1.f, src[cnt] ) ) * 255.f;
+    }
+}
+
+static void maddTaps16_scalar( unsigned* acc, const unsigned short* const* src,
+                               const short* q, unsigned ntaps, unsigned n )
+{
+    for( unsigned t=0; t<ntaps; t++ )
+    {
+        const unsigned short* s = src[t];
+        const int             w = q[t];
+
+        for( unsigned cnt=0; cnt<n; cnt++ )
+        {
+            acc[cnt] += (unsigned)( w * s[cnt] );
+        }
+    }
+}
+
+#ifdef SIMD_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// Byte shuffles for 16 pixels of RGB, as 3 vectors of 16 bytes.
+// interleave  : output vector k = OR( pshufb( channel c, ilmask[c][k] ) )
+// deinterleave: channel c = OR( pshufb( input vector k, dlmask[c][k] ) )
+
+static unsigned char ilmask[3][3][16] __attribute__((aligned(16)));
+static unsigned char dlmask[3][3][16] __attribute__((aligned(16)));
+
+static void buildMasks()
+{
+    for( unsigned c=0; c<3; c++ )
+    {
+        for( unsigned k=0; k<3; k++ )
+        {
+            for( unsigned j=0; j<16; j++ )
+            {
+                unsigned p = k * 16 + j;
+                ilmask[c][k][j] = ( p % 3 == c ) ? p / 3 : 0x80;
+
+                unsigned q = j * 3 + c;
+                dlmask[c][k][j] = ( q / 16 == k ) ? q % 16 : 0x80;
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE2, no byte shuffle, so interleaving is done by scalar.
+
+TARGET_SSE2
+static void axpy_sse2( float* dst, const float* src, float w, unsigned n )
+{
+    __m128   vw  = _mm_set1_ps( w );
+    unsigned cnt = 0;
+
+    for( ; cnt+8<=n; cnt+=8 )
+    {
+        __m128 d0 = _mm_loadu_ps( dst + cnt );
+        __m128 d1 = _mm_loadu_ps( dst + cnt + 4 );
+        d0 = _mm_add_ps( d0, _mm_mul_ps( vw, _mm_loadu_ps( src + cnt ) ) );
+        d1 = _mm_add_ps( d1, _mm_mul_ps( vw, _mm_loadu_ps( src + cnt + 4 ) ) );
+        _mm_storeu_ps( dst + cnt, d0 );
+        _mm_storeu_ps( dst + cnt + 4, d1 );
+    }
+
+    axpy_scalar( dst + cnt, src + cnt, w, n - cnt );
+}
+
+TARGET_SSE2
+static void scale_sse2( float* dst, float s, unsigned n )
+{
+    __m128   vs  = _mm_set1_ps( s );
+    unsigned cnt = 0;
+
+    for( ; cnt+4<=n; cnt+=4 )
+    {
+        _mm_storeu_ps( dst + cnt, _mm_mul_ps( vs, _mm_loadu_ps( dst + cnt ) ) );
+    }
+
+    scale_scalar( dst + cnt, s, n - cnt );
+}
+
+// 16 floats clamped to 16 bytes.
+TARGET_SSE2
+static inline __m128i quantize16_sse2( const float* src )
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one  = _mm_set1_ps( 1.f );
+    const __m128 k255 = _mm_set1_ps( 255.f );
+    __m128i      iv[4];
+
+    for( unsigned cnt=0; cnt<4; cnt++ )
+    {
+        __m128 v = _mm_loadu_ps( src + cnt * 4 );
+        v = _mm_mul_ps( _mm_max_ps( zero, _mm_min_ps( one, v ) ), k255 );
+        iv[cnt] = _mm_cvttps_epi32( v );
+    }
+
+    return _mm_packus_epi16( _mm_packs_epi32( iv[0], iv[1] ),
+                             _mm_packs_epi32( iv[2], iv[3] ) );
+}
+
+// 16 bytes to 16 floats scaled by 1/255.
+TARGET_SSE2
+static inline void expand16_sse2( __m128i v, __m128 f[4] )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128  inv  = _mm_set1_ps( 1.f / 255.f );
+    __m128i       lo   = _mm_unpacklo_epi8( v, zero );
+    __m128i       hi   = _mm_unpackhi_epi8( v, zero );
+
+    f[0] = _mm_mul_ps( _mm_cvtepi32_ps( _mm_unpacklo_epi16( lo, zero ) ), inv );
+    f[1] = _mm_mul_ps( _mm_cvtepi32_ps( _mm_unpackhi_epi16( lo, zero ) ), inv );
+    f[2] = _mm_mul_ps( _mm_cvtepi32_ps( _mm_unpacklo_epi16( hi, zero ) ), inv );
+    f[3] = _mm_mul_ps( _mm_cvtepi32_ps( _mm_unpackhi_epi16( hi, zero ) ), inv );
+}
+
+TARGET_SSE2
+static void unpackRGB_sse2( const unsigned char* src, unsigned d,
+                            float* r, float* g, float* b, unsigned n,
+                            float intensity, float boost )
+{
+    if ( ( d != 1 ) && ( d != 3 ) )
+    {
+        unpackRGB_scalar( src, d, r, g, b, n, intensity, boost );
+        return;
+    }
+
+    const __m128 vt  = _mm_set1_ps( intensity );
+    const __m128 one = _mm_set1_ps( 1.f );
+    const __m128 vb  = _mm_set1_ps( boost );
+    unsigned     cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        unsigned char ch[3][16] __attribute__((aligned(16)));
+        __m128        f[3][4];
+
+        if ( d == 3 )
+        {
+            const unsigned char* s = src + cnt * 3;
+
+            for( unsigned x=0; x<16; x++ )
+            {
+                ch[0][x] = s[ x * 3 + 0 ];
+                ch[1][x] = s[ x * 3 + 1 ];
+                ch[2][x] = s[ x * 3 + 2 ];
+            }
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                expand16_sse2( _mm_load_si128( (const __m128i*)ch[c] ), f[c] );
+            }
+        }
+        else
+        {
+            expand16_sse2( _mm_loadu_si128( (const __m128i*)( src + cnt ) ), f[0] );
+
+            for( unsigned q=0; q<4; q++ )
+            {
+                f[1][q] = f[0][q];
+                f[2][q] = f[0][q];
+            }
+        }
+
+        for( unsigned q=0; q<4; q++ )
+        {
+            __m128 m  = _mm_and_ps( _mm_and_ps( _mm_cmpgt_ps( f[0][q], vt ),
+                                                _mm_cmpgt_ps( f[1][q], vt ) ),
+                                    _mm_cmpgt_ps( f[2][q], vt ) );
+            __m128 fm = _mm_or_ps( _mm_and_ps( m, vb ), _mm_andnot_ps( m, one ) );
+
+            _mm_storeu_ps( r + cnt + q * 4, _mm_mul_ps( f[0][q], fm ) );
+            _mm_storeu_ps( g + cnt + q * 4, _mm_mul_ps( f[1][q], fm ) );
+            _mm_storeu_ps( b + cnt + q * 4, _mm_mul_ps( f[2][q], fm ) );
+        }
+    }
+
+    unpackRGB_scalar( src + cnt * d, d, r + cnt, g + cnt, b + cnt, n - cnt,
+                      intensity, boost );
+}
+
+TARGET_SSE2
+static void packRGB_sse2( const float* r, const float* g, const float* b,
+                          unsigned char* dst, unsigned n )
+{
+    unsigned cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        unsigned char ch[3][16] __attribute__((aligned(16)));
+
+        _mm_store_si128( (__m128i*)ch[0], quantize16_sse2( r + cnt ) );
+        _mm_store_si128( (__m128i*)ch[1], quantize16_sse2( g + cnt ) );
+        _mm_store_si128( (__m128i*)ch[2], quantize16_sse2( b + cnt ) );
+
+        unsigned char* d = dst + cnt * 3;
+
+        for( unsigned x=0; x<16; x++ )
+        {
+            d[ x * 3 + 0 ] = ch[0][x];
+            d[ x * 3 + 1 ] = ch[1][x];
+            d[ x * 3 + 2 ] = ch[2][x];
+        }
+    }
+
+    packRGB_scalar( r + cnt, g + cnt, b + cnt, dst + cnt * 3, n - cnt );
+}
+
+TARGET_SSE2
+static void packBytes_sse2( const float* src, unsigned char* dst, unsigned n )
+{
+    unsigned cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        _mm_storeu_si128( (__m128i*)( dst + cnt ), quantize16_sse2( src + cnt ) );
+    }
+
+    packBytes_scalar( src + cnt, dst + cnt, n - cnt );
+}
+
+// Weights of taps t and t + 1 as one 32 bit, for pmaddwd.
+static inline int pairWeight( const short* q, unsigned t, unsigned ntaps )
+{
+    unsigned q1 = t + 1 < ntaps ? (unsigned short)q[ t + 1 ] : 0;
+
+    return (int)( (unsigned short)q[t] | ( q1 << 16 ) );
+}
+
+// Taps by pairs : samples interleaved as 16 bit pairs, then pmaddwd 
+// sums q0 * s0 + q1 * s1 into 32 bit. Accumulators stay in registers
+// for all taps of a block, odd last tap is paired with zero weight.
+TARGET_SSE2
+static void maddTaps16_sse2( unsigned* acc, const unsigned short* const* src,
+                             const short* q, unsigned ntaps, unsigned n )
+{
+    unsigned cnt = 0;
+
+    for( ; cnt+8<=n; cnt+=8 )
+    {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+
+        for( unsigned t=0; t<ntaps; t+=2 )
+        {
+            const unsigned short* s1 = src[ min( t + 1, ntaps - 1 ) ];
+            __m128i vq = _mm_set1_epi32( pairWeight( q, t, ntaps ) );
+            __m128i a  = _mm_loadu_si128( (const __m128i*)( src[t] + cnt ) );
+            __m128i b  = _mm_loadu_si128( (const __m128i*)( s1 + cnt ) );
+
+            lo = _mm_add_epi32( lo, _mm_madd_epi16( _mm_unpacklo_epi16( a, b ), vq ) );
+            hi = _mm_add_epi32( hi, _mm_madd_epi16( _mm_unpackhi_epi16( a, b ), vq ) );
+        }
+
+        __m128i* d = (__m128i*)( acc + cnt );
+
+        _mm_storeu_si128( d, _mm_add_epi32( _mm_loadu_si128( d ), lo ) );
+        _mm_storeu_si128( d + 1, _mm_add_epi32( _mm_loadu_si128( d + 1 ), hi ) );
+    }
+
+    if ( cnt < n )
+    {
+        for( unsigned t=0; t<ntaps; t++ )
+        {
+            for( unsigned x=cnt; x<n; x++ )
+            {
+                acc[x] += (unsigned)( q[t] * src[t][x] );
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2
+
+TARGET_AVX2
+static void axpy_avx2( float* dst, const float* src, float w, unsigned n )
+{
+    __m256   vw  = _mm256_set1_ps( w );
+    unsigned cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        __m256 d0 = _mm256_loadu_ps( dst + cnt );
+        __m256 d1 = _mm256_loadu_ps( dst + cnt + 8 );
+        d0 = _mm256_fmadd_ps( vw, _mm256_loadu_ps( src + cnt ), d0 );
+        d1 = _mm256_fmadd_ps( vw, _mm256_loadu_ps( src + cnt + 8 ), d1 );
+        _mm256_storeu_ps( dst + cnt, d0 );
+        _mm256_storeu_ps( dst + cnt + 8, d1 );
+    }
+
+    for( ; cnt+8<=n; cnt+=8 )
+    {
+        __m256 d0 = _mm256_loadu_ps( dst + cnt );
+        d0 = _mm256_fmadd_ps( vw, _mm256_loadu_ps( src + cnt ), d0 );
+        _mm256_storeu_ps( dst + cnt, d0 );
+    }
+
+    axpy_scalar( dst + cnt, src + cnt, w, n - cnt );
+}
+
+TARGET_AVX2
+static void scale_avx2( float* dst, float s, unsigned n )
+{
+    __m256   vs  = _mm256_set1_ps( s );
+    unsigned cnt = 0;
+
+    for( ; cnt+8<=n; cnt+=8 )
+    {
+        _mm256_storeu_ps( dst + cnt, _mm256_mul_ps( vs, _mm256_loadu_ps( dst + cnt ) ) );
+    }
+
+    scale_scalar( dst + cnt, s, n - cnt );
+}
+
+TARGET_AVX2
+static inline __m128i quantize16_avx2( const float* src )
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one  = _mm256_set1_ps( 1.f );
+    const __m256 k255 = _mm256_set1_ps( 255.f );
+
+    __m256 v0 = _mm256_loadu_ps( src );
+    __m256 v1 = _mm256_loadu_ps( src + 8 );
+    v0 = _mm256_mul_ps( _mm256_max_ps( zero, _mm256_min_ps( one, v0 ) ), k255 );
+    v1 = _mm256_mul_ps( _mm256_max_ps( zero, _mm256_min_ps( one, v1 ) ), k255 );
+
+    // packs work in 128 bit lanes, so reorder quad words after.
+    __m256i i16 = _mm256_packus_epi32( _mm256_cvttps_epi32( v0 ),
+                                       _mm256_cvttps_epi32( v1 ) );
+    i16 = _mm256_permute4x64_epi64( i16, 0xD8 );
+
+    return _mm_packus_epi16( _mm256_castsi256_si128( i16 ),
+                             _mm256_extracti128_si256( i16, 1 ) );
+}
+
+TARGET_AVX2
+static inline void interleave16_avx2( __m128i r, __m128i g, __m128i b,
+                                      unsigned char* dst )
+{
+    for( unsigned k=0; k<3; k++ )
+    {
+        __m128i o = _mm_shuffle_epi8( r, _mm_load_si128( (const __m128i*)ilmask[0][k] ) );
+        o = _mm_or_si128( o, _mm_shuffle_epi8( g, _mm_load_si128( (const __m128i*)ilmask[1][k] ) ) );
+        o = _mm_or_si128( o, _mm_shuffle_epi8( b, _mm_load_si128( (const __m128i*)ilmask[2][k] ) ) );
+        _mm_storeu_si128( (__m128i*)( dst + k * 16 ), o );
+    }
+}
+
+TARGET_AVX2
+static inline void deinterleave16_avx2( const unsigned char* src, __m128i ch[3] )
+{
+    __m128i in[3];
+
+    for( unsigned k=0; k<3; k++ )
+    {
+        in[k] = _mm_loadu_si128( (const __m128i*)( src + k * 16 ) );
+    }
+
+    for( unsigned c=0; c<3; c++ )
+    {
+        __m128i o = _mm_shuffle_epi8( in[0], _mm_load_si128( (const __m128i*)dlmask[c][0] ) );
+        o = _mm_or_si128( o, _mm_shuffle_epi8( in[1], _mm_load_si128( (const __m128i*)dlmask[c][1] ) ) );
+        o = _mm_or_si128( o, _mm_shuffle_epi8( in[2], _mm_load_si128( (const __m128i*)dlmask[c][2] ) ) );
+        ch[c] = o;
+    }
+}
+
+TARGET_AVX2
+static void unpackRGB_avx2( const unsigned char* src, unsigned d,
+                            float* r, float* g, float* b, unsigned n,
+                            float intensity, float boost )
+{
+    if ( ( d != 1 ) && ( d != 3 ) )
+    {
+        unpackRGB_scalar( src, d, r, g, b, n, intensity, boost );
+        return;
+    }
+
+    const __m256 vt  = _mm256_set1_ps( intensity );
+    const __m256 one = _mm256_set1_ps( 1.f );
+    const __m256 vb  = _mm256_set1_ps( boost );
+    const __m256 inv = _mm256_set1_ps( 1.f / 255.f );
+    unsigned     cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        __m128i ch[3];
+
+        if ( d == 3 )
+        {
+            deinterleave16_avx2( src + cnt * 3, ch );
+        }
+        else
+        {
+            ch[0] = _mm_loadu_si128( (const __m128i*)( src + cnt ) );
+            ch[1] = ch[0];
+            ch[2] = ch[0];
+        }
+
+        for( unsigned q=0; q<2; q++ )
+        {
+            __m256 f[3];
+
+            for( unsigned c=0; c<3; c++ )
+            {
+                __m128i v8 = ( q == 0 ) ? ch[c] : _mm_srli_si128( ch[c], 8 );
+                f[c] = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_cvtepu8_epi32( v8 ) ), inv );
+            }
+
+            __m256 m  = _mm256_and_ps( _mm256_and_ps( _mm256_cmp_ps( f[0], vt, _CMP_GT_OQ ),
+                                                      _mm256_cmp_ps( f[1], vt, _CMP_GT_OQ ) ),
+                                       _mm256_cmp_ps( f[2], vt, _CMP_GT_OQ ) );
+            __m256 fm = _mm256_blendv_ps( one, vb, m );
+
+            _mm256_storeu_ps( r + cnt + q * 8, _mm256_mul_ps( f[0], fm ) );
+            _mm256_storeu_ps( g + cnt + q * 8, _mm256_mul_ps( f[1], fm ) );
+            _mm256_storeu_ps( b + cnt + q * 8, _mm256_mul_ps( f[2], fm ) );
+        }
+    }
+
+    unpackRGB_scalar( src + cnt * d, d, r + cnt, g + cnt, b + cnt, n - cnt,
+                      intensity, boost );
+}
+
+TARGET_AVX2
+static void packRGB_avx2( const float* r, const float* g, const float* b,
+                          unsigned char* dst, unsigned n )
+{
+    unsigned cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        interleave16_avx2( quantize16_avx2( r + cnt ),
+                           quantize16_avx2( g + cnt ),
+                           quantize16_avx2( b + cnt ),
+                           dst + cnt * 3 );
+    }
+
+    packRGB_scalar( r + cnt, g + cnt, b + cnt, dst + cnt * 3, n - cnt );
+}
+
+TARGET_AVX2
+static void packBytes_avx2( const float* src, unsigned char* dst, unsigned n )
+{
+    unsigned cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        _mm_storeu_si128( (__m128i*)( dst + cnt ), quantize16_avx2( src + cnt ) );
+    }
+
+    packBytes_scalar( src + cnt, dst + cnt, n - cnt );
+}
+
+TARGET_AVX2
+static void maddTaps16_avx2( unsigned* acc, const unsigned short* const* src,
+                             const short* q, unsigned ntaps, unsigned n )
+{
+    unsigned cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        __m256i lo = _mm256_setzero_si256();
+        __m256i hi = _mm256_setzero_si256();
+
+        for( unsigned t=0; t<ntaps; t+=2 )
+        {
+            const unsigned short* s1 = src[ min( t + 1, ntaps - 1 ) ];
+            __m256i vq = _mm256_set1_epi32( pairWeight( q, t, ntaps ) );
+            __m256i a  = _mm256_loadu_si256( (const __m256i*)( src[t] + cnt ) );
+            __m256i b  = _mm256_loadu_si256( (const __m256i*)( s1 + cnt ) );
+
+            lo = _mm256_add_epi32( lo, _mm256_madd_epi16( _mm256_unpacklo_epi16( a, b ), vq ) );
+            hi = _mm256_add_epi32( hi, _mm256_madd_epi16( _mm256_unpackhi_epi16( a, b ), vq ) );
+        }
+
+        // unpack works in 128 bit lanes : lo has 0-3 and 8-11, hi has 4-7, 12-15.
+        __m256i* d = (__m256i*)( acc + cnt );
+
+        _mm256_storeu_si256( d, _mm256_add_epi32( _mm256_loadu_si256( d ),
+                                 _mm256_permute2x128_si256( lo, hi, 0x20 ) ) );
+        _mm256_storeu_si256( d + 1, _mm256_add_epi32( _mm256_loadu_si256( d + 1 ),
+                                     _mm256_permute2x128_si256( lo, hi, 0x31 ) ) );
+    }
+
+    if ( cnt < n )
+    {
+        for( unsigned t=0; t<ntaps; t++ )
+        {
+            for( unsigned x=cnt; x<n; x++ )
+            {
+                acc[x] += (unsigned)( q[t] * src[t][x] );
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512 ( F and BW ), byte shuffles are same as AVX2.
+
+TARGET_AVX512
+static void axpy_avx512( float* dst, const float* src, float w, unsigned n )
+{
+    __m512   vw  = _mm512_set1_ps( w );
+    unsigned cnt = 0;
+
+    for( ; cnt+32<=n; cnt+=32 )
+    {
+        __m512 d0 = _mm512_loadu_ps( dst + cnt );
+        __m512 d1 = _mm512_loadu_ps( dst + cnt + 16 );
+        d0 = _mm512_fmadd_ps( vw, _mm512_loadu_ps( src + cnt ), d0 );
+        d1 = _mm512_fmadd_ps( vw, _mm512_loadu_ps( src + cnt + 16 ), d1 );
+        _mm512_storeu_ps( dst + cnt, d0 );
+        _mm512_storeu_ps( dst + cnt + 16, d1 );
+    }
+
+    if ( cnt < n )
+    {
+        // remainder by masked load and store.
+        for( ; cnt<n; cnt+=16 )
+        {
+            unsigned  left = min( 16u, n - cnt );
+            __mmask16 k    = (__mmask16)( ( 1u << left ) - 1u );
+            __m512    d0   = _mm512_maskz_loadu_ps( k, dst + cnt );
+            d0 = _mm512_fmadd_ps( vw, _mm512_maskz_loadu_ps( k, src + cnt ), d0 );
+            _mm512_mask_storeu_ps( dst + cnt, k, d0 );
+        }
+    }
+}
+
+TARGET_AVX512
+static void scale_avx512( float* dst, float s, unsigned n )
+{
+    __m512   vs  = _mm512_set1_ps( s );
+    unsigned cnt = 0;
+
+    for( ; cnt<n; cnt+=16 )
+    {
+        unsigned  left = min( 16u, n - cnt );
+        __mmask16 k    = (__mmask16)( ( 1u << left ) - 1u );
+        __m512    d0   = _mm512_maskz_loadu_ps( k, dst + cnt );
+        _mm512_mask_storeu_ps( dst + cnt, k, _mm512_mul_ps( vs, d0 ) );
+    }
+}
+
+TARGET_AVX512
+static inline __m128i quantize16_avx512( const float* src )
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one  = _mm512_set1_ps( 1.f );
+    const __m512 k255 = _mm512_set1_ps( 255.f );
+
+    __m512 v = _mm512_loadu_ps( src );
+    v = _mm512_mul_ps( _mm512_max_ps( zero, _mm512_min_ps( one, v ) ), k255 );
+
+    return _mm512_cvtepi32_epi8( _mm512_cvttps_epi32( v ) );
+}
+
+TARGET_AVX512
+static void unpackRGB_avx512( const unsigned char* src, unsigned d,
+                              float* r, float* g, float* b, unsigned n,
+                              float intensity, float boost )
+{
+    if ( ( d != 1 ) && ( d != 3 ) )
+    {
+        unpackRGB_scalar( src, d, r, g, b, n, intensity, boost );
+        return;
+    }
+
+    const __m512 vt  = _mm512_set1_ps( intensity );
+    const __m512 vb  = _mm512_set1_ps( boost );
+    const __m512 inv = _mm512_set1_ps( 1.f / 255.f );
+    unsigned     cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        __m128i ch[3];
+
+        if ( d == 3 )
+        {
+            deinterleave16_avx2( src + cnt * 3, ch );
+        }
+        else
+        {
+            ch[0] = _mm_loadu_si128( (const __m128i*)( src + cnt ) );
+            ch[1] = ch[0];
+            ch[2] = ch[0];
+        }
+
+        __m512 f[3];
+
+        for( unsigned c=0; c<3; c++ )
+        {
+            f[c] = _mm512_mul_ps( _mm512_cvtepi32_ps( _mm512_cvtepu8_epi32( ch[c] ) ), inv );
+        }
+
+        __mmask16 m = _mm512_cmp_ps_mask( f[0], vt, _CMP_GT_OQ )
+                      & _mm512_cmp_ps_mask( f[1], vt, _CMP_GT_OQ )
+                      & _mm512_cmp_ps_mask( f[2], vt, _CMP_GT_OQ );
+
+        _mm512_storeu_ps( r + cnt, _mm512_mask_mul_ps( f[0], m, f[0], vb ) );
+        _mm512_storeu_ps( g + cnt, _mm512_mask_mul_ps( f[1], m, f[1], vb ) );
+        _mm512_storeu_ps( b + cnt, _mm512_mask_mul_ps( f[2], m, f[2], vb ) );
+    }
+
+    unpackRGB_scalar( src + cnt * d, d, r + cnt, g + cnt, b + cnt, n - cnt,
+                      intensity, boost );
+}
+
+TARGET_AVX512
+static void packRGB_avx512( const float* r, const float* g, const float* b,
+                            unsigned char* dst, unsigned n )
+{
+    unsigned cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        interleave16_avx2( quantize16_avx512( r + cnt ),
+                           quantize16_avx512( g + cnt ),
+                           quantize16_avx512( b + cnt ),
+                           dst + cnt * 3 );
+    }
+
+    packRGB_scalar( r + cnt, g + cnt, b + cnt, dst + cnt * 3, n - cnt );
+}
+
+TARGET_AVX512
+static void packBytes_avx512( const float* src, unsigned char* dst, unsigned n )
+{
+    unsigned cnt = 0;
+
+    for( ; cnt+16<=n; cnt+=16 )
+    {
+        _mm_storeu_si128( (__m128i*)( dst + cnt ), quantize16_avx512( src + cnt ) );
+    }
+
+    packBytes_scalar( src + cnt, dst + cnt, n - cnt );
+}
+
+TARGET_AVX512
+static void maddTaps16_avx512( unsigned* acc, const unsigned short* const* src,
+                               const short* q, unsigned ntaps, unsigned n )
+{
+    // 128 bit lane order of unpacked pairs, to 0-15 and 16-31.
+    const __m512i ilo = _mm512_set_epi64( 11, 10, 3, 2, 9, 8, 1, 0 );
+    const __m512i ihi = _mm512_set_epi64( 15, 14, 7, 6, 13, 12, 5, 4 );
+    unsigned      cnt = 0;
+
+    for( ; cnt+32<=n; cnt+=32 )
+    {
+        __m512i lo = _mm512_setzero_si512();
+        __m512i hi = _mm512_setzero_si512();
+
+        for( unsigned t=0; t<ntaps; t+=2 )
+        {
+            const unsigned short* s1 = src[ min( t + 1, ntaps - 1 ) ];
+            __m512i vq = _mm512_set1_epi32( pairWeight( q, t, ntaps ) );
+            __m512i a  = _mm512_loadu_si512( (const void*)( src[t] + cnt ) );
+            __m512i b  = _mm512_loadu_si512( (const void*)( s1 + cnt ) );
+
+            lo = _mm512_add_epi32( lo, _mm512_madd_epi16( _mm512_unpacklo_epi16( a, b ), vq ) );
+            hi = _mm512_add_epi32( hi, _mm512_madd_epi16( _mm512_unpackhi_epi16( a, b ), vq ) );
+        }
+
+        unsigned* d = acc + cnt;
+
+        _mm512_storeu_si512( (void*)d, 
+            _mm512_add_epi32( _mm512_loadu_si512( (const void*)d ),
+                              _mm512_permutex2var_epi64( lo, ilo, hi ) ) );
+        _mm512_storeu_si512( (void*)( d + 16 ),
+            _mm512_add_epi32( _mm512_loadu_si512( (const void*)( d + 16 ) ),
+                              _mm512_permutex2var_epi64( lo, ihi, hi ) ) );
+    }
+
+    if ( cnt < n )
+    {
+        for( unsigned t=0; t<ntaps; t++ )
+        {
+            for( unsigned x=cnt; x<n; x++ )
+            {
+                acc[x] += (unsigned)( q[t] * src[t][x] );
+            }
+        }
+    }
+}
+
+#endif /// of SIMD_X86
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct Kernels
+{
+    void (*axpy)( float*, const float*, float, unsigned );
+    void (*scale)( float*, float, unsigned );
+    void (*unpackRGB)( const unsigned char*, unsigned,
+                       float*, float*, float*, unsigned, float, float );
+    void (*packRGB)( const float*, const float*, const float*,
+                     unsigned char*, unsigned );
+    void (*packBytes)( const float*, unsigned char*, unsigned );
+    void (*maddTaps16)( unsigned*, const unsigned short* const*, const short*,
+                        unsigned, unsigned );
+};
+
+static const Kernels kernelTable[ LEVEL_MAX ] =
+{
+    { axpy_scalar, scale_scalar, unpackRGB_scalar, packRGB_scalar, packBytes_scalar,
+      maddTaps16_scalar },
+#ifdef SIMD_X86
+    { axpy_sse2, scale_sse2, unpackRGB_sse2, packRGB_sse2, packBytes_sse2,
+      maddTaps16_sse2 },
+    { axpy_avx2, scale_avx2, unpackRGB_avx2, packRGB_avx2, packBytes_avx2,
+      maddTaps16_avx2 },
+    { axpy_avx512, scale_avx512, unpackRGB_avx512, packRGB_avx512, packBytes_avx512,
+      maddTaps16_avx512 },
+#else
+    { axpy_scalar, scale_scalar, unpackRGB_scalar, packRGB_scalar, packBytes_scalar,
+      maddTaps16_scalar },
+    { axpy_scalar, scale_scalar, unpackRGB_scalar, packRGB_scalar, packBytes_scalar,
+      maddTaps16_scalar },
+    { axpy_scalar, scale_scalar, unpackRGB_scalar, packRGB_scalar, packBytes_scalar,
+      maddTaps16_scalar },
+#endif /// of SIMD_X86
+};
+
+static const char* levelNames[ LEVEL_MAX ] =
+{
+    "scalar", "sse2", "avx2", "avx512"
+};
+
+namespace
+{
+    // Detects CPU once at start up, as tick does for its start time.
+    class __SIMD_DISPATCH
+    {
+        public:
+            __SIMD_DISPATCH()
+            : best( SCALAR ), current( SCALAR )
+            {
+#ifdef SIMD_X86
+                buildMasks();
+
+                __builtin_cpu_init();
+
+                if ( __builtin_cpu_supports( "sse2" ) )
+                    best = SSE2;
+
+                if ( __builtin_cpu_supports( "avx2" )
+                     && __builtin_cpu_supports( "fma" ) )
+                    best = AVX2;
+
+                if ( __builtin_cpu_supports( "avx512f" )
+                     && __builtin_cpu_supports( "avx512bw" ) )
+                    best = AVX512;
+#endif /// of SIMD_X86
+                current = best;
+
+                const char* envlv = getenv( "BOKEH_SIMD" );
+
+                if ( envlv != NULL )
+                {
+                    Level lv = levelByName( envlv );
+
+                    if ( lv < LEVEL_MAX )
+                    {
+                        current = min( lv, best );
+                    }
+                }
+
+                table = &kernelTable[ current ];
+            }
+
+        public:
+            Level          best;
+            Level          current;
+            const Kernels* table;
+    };
+
+    __SIMD_DISPATCH dispatch;
+}
+
+Level detected()
+{
+    return dispatch.best;
+}
+
+Level level()
+{
+    return dispatch.current;
+}
+
+Level setLevel( Level lv )
+{
+    if ( lv >= LEVEL_MAX )
+        lv = dispatch.best;
+
+    dispatch.current = min( lv, dispatch.best );
+    dispatch.table   = &kernelTable[ dispatch.current ];
+
+    return dispatch.current;
+}
+
+const char* levelName( Level lv )
+{
+    if ( lv < LEVEL_MAX )
+        return levelNames[ lv ];
+
+    return "unknown";
+}
+
+Level levelByName( const char* name )
+{
+    if ( name != NULL )
+    {
+        for( unsigned cnt=0; cnt<LEVEL_MAX; cnt++ )
+        {
+            if ( strcmp( name, levelNames[cnt] ) == 0 )
+                return (Level)cnt;
+        }
+    }
+
+    return LEVEL_MAX;
+}
+
+void axpy( float* dst, const float* src, float w, unsigned n )
+{
+    dispatch.table->axpy( dst, src, w, n );
+}
+
+void scale( float* dst, float s, unsigned n )
+{
+    dispatch.table->scale( dst, s, n );
+}
+
+void unpackRGB( const unsigned char* src, unsigned d,
+                float* r, float* g, float* b, unsigned n,
+                float intensity, float boost )
+{
+    dispatch.table->unpackRGB( src, d, r, g, b, n, intensity, boost );
+}
+
+void packRGB( const float* r, const float* g, const float* b,
+              unsigned char* dst, unsigned n )
+{
+    dispatch.table->packRGB( r, g, b, dst, n );
+}
+
+void packBytes( const float* src, unsigned char* dst, unsigned n )
+{
+    dispatch.table->packBytes( src, dst, n );
+}
+
+void maddTaps16( unsigned* acc, const unsigned short* const* src,
+                 const short* q, unsigned ntaps, unsigned n )
+{
+    dispatch.table->maddTaps16( acc, src, q, ntaps, n );
+}
+
+}; /// of namespace simd
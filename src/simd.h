@@ -0,0 +1,51 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+/// Vectorized inner loops of libbokeh.
+/// Each function has scalar, SSE2, AVX2 and AVX-512 version in one binary,
+/// and the best one CPU supports is selected at start up.
+/// Environment variable BOKEH_SIMD ( scalar, sse2, avx2, avx512 ) limits
+/// selection, scalar is reference for verification.
+namespace simd {
+
+enum Level
+{
+    SCALAR = 0,
+    SSE2,
+    AVX2,
+    AVX512,
+    LEVEL_MAX
+};
+
+/// Best level supported by CPU and OS.
+Level detected();
+/// Level in use.
+Level level();
+/// Selects level, limited to detected(). Not thread safe to processing.
+Level setLevel( Level lv );
+const char* levelName( Level lv );
+/// Returns LEVEL_MAX for unknown name.
+Level levelByName( const char* name );
+
+/// dst[i] += w * src[i]
+void axpy( float* dst, const float* src, float w, unsigned n );
+/// dst[i] *= s
+void scale( float* dst, float s, unsigned n );
+/// 8 bit pixels of depth d ( 1, 3, 4 ) to float planes of [0,1],
+/// all channels multiplied by boost when all of them over intensity.
+void unpackRGB( const unsigned char* src, unsigned d,
+                float* r, float* g, float* b, unsigned n,
+                float intensity, float boost );
+/// float planes clamped to [0,1], to interleaved 8 bit RGB.
+void packRGB( const float* r, const float* g, const float* b,
+              unsigned char* dst, unsigned n );
+/// contiguous floats clamped to [0,1], to 8 bit.
+void packBytes( const float* src, unsigned char* dst, unsigned n );
+/// acc[i] += sum( q[t] * src[t][i] ), t < ntaps, for fixed point convolution.
+/// samples and weights must be in 15 bits, acc wraps as unsigned 32 bit.
+void maddTaps16( unsigned* acc, const unsigned short* const* src,
+                 const short* q, unsigned ntaps, unsigned n );
+
+}; /// of namespace simd
+
+#endif /// of __SIMD_H__
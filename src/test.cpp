@@ -11,10 +11,14 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <cmath>
 
 #include <FL/Fl.H>
 #include <FL/Fl_Window.H>
 #include <FL/Fl_Box.H>
+#include <FL/Fl_Double_Window.H>
+#include <FL/Fl_Value_Slider.H>
+#include <FL/Fl_Choice.H>
 #include <FL/Fl_Image.H>
 #include <FL/Fl_RGB_Image.H>
 #include <FL/Fl_BMP_Image.H>
@@ -23,13 +27,28 @@
 
 #if defined(__linux__)
 #include <png.h>
+#include <jpeglib.h>
 #else
 #include <FL/images/png.h>
+#include <FL/images/jpeglib.h>
 #endif
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if !defined(_WIN32) && !defined(WIN32)
+#include <glob.h>
+#include <sys/stat.h>
+#endif
 
 #include "libbokeh.h"
+#include "rawimage.h"
 #include "fl_imgtk.h"
 #include "tick.h"
 
@@ -427,6 +446,251 @@ bool save2png( Fl_RGB_Image* imgcached, const char* fpath )
     return false;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Streaming mode : source decoded and output encoded by scanlines.
+
+struct StreamJPEGError
+{
+    jpeg_error_mgr  pub;
+    jmp_buf         jmp;
+};
+
+static void streamJPEGErrorExit( j_common_ptr cinfo )
+{
+    StreamJPEGError* err = (StreamJPEGError*)cinfo->err;
+    longjmp( err->jmp, 1 );
+}
+
+struct StreamSource
+{
+    FILE*                   fp;
+    int                     type;   /// 1 = JPEG, 2 = PNG.
+    unsigned                w;
+    unsigned                h;
+    unsigned                d;
+    png_structp             png_ptr;
+    png_infop               info_ptr;
+    jpeg_decompress_struct  jinfo;
+    StreamJPEGError         jerr;
+};
+
+struct StreamSink
+{
+    FILE*       fp;
+    png_structp png_ptr;
+    png_infop   info_ptr;
+};
+
+void closeStreamSource( StreamSource &ss )
+{
+    if ( ss.type == 1 )
+    {
+        jpeg_destroy_decompress( &ss.jinfo );
+    }
+    else
+    if ( ss.type == 2 )
+    {
+        png_destroy_read_struct( &ss.png_ptr, &ss.info_ptr, NULL );
+    }
+
+    if ( ss.fp != NULL )
+    {
+        fclose( ss.fp );
+    }
+
+    ss.fp   = NULL;
+    ss.type = 0;
+}
+
+bool openStreamSource( const char* fpath, StreamSource &ss )
+{
+    memset( &ss, 0, sizeof( StreamSource ) );
+
+    ss.fp = fopen( fpath, "rb" );
+    if ( ss.fp == NULL )
+        return false;
+
+    uchar testbuff[4] = {0,};
+
+    fread( testbuff, 1, 4, ss.fp );
+    fseek( ss.fp, 0, SEEK_SET );
+
+    if ( ( testbuff[0] == 0xFF ) && ( testbuff[1] == 0xD8 ) && ( testbuff[2] == 0xFF ) )
+    {
+        ss.type = 1;
+        ss.jinfo.err = jpeg_std_error( &ss.jerr.pub );
+        ss.jerr.pub.error_exit = streamJPEGErrorExit;
+
+        if ( setjmp( ss.jerr.jmp ) != 0 )
+        {
+            closeStreamSource( ss );
+            return false;
+        }
+
+        jpeg_create_decompress( &ss.jinfo );
+        jpeg_stdio_src( &ss.jinfo, ss.fp );
+        jpeg_read_header( &ss.jinfo, TRUE );
+
+        if ( ss.jinfo.jpeg_color_space != JCS_GRAYSCALE )
+        {
+            ss.jinfo.out_color_space = JCS_RGB;
+        }
+
+        jpeg_start_decompress( &ss.jinfo );
+
+        ss.w = ss.jinfo.output_width;
+        ss.h = ss.jinfo.output_height;
+        ss.d = ss.jinfo.output_components;
+
+        return true;
+    }
+    else
+    if ( strncmp( (const char*)&testbuff[1], "PNG", 3 ) == 0 )
+    {
+        ss.type = 2;
+        ss.png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+        if ( ss.png_ptr != NULL )
+        {
+            ss.info_ptr = png_create_info_struct( ss.png_ptr );
+        }
+
+        if ( ( ss.info_ptr == NULL ) || ( setjmp( png_jmpbuf( ss.png_ptr ) ) != 0 ) )
+        {
+            closeStreamSource( ss );
+            return false;
+        }
+
+        png_init_io( ss.png_ptr, ss.fp );
+        png_read_info( ss.png_ptr, ss.info_ptr );
+
+        // Interlaced rows can not be read one time.
+        if ( png_get_interlace_type( ss.png_ptr, ss.info_ptr ) != PNG_INTERLACE_NONE )
+        {
+            printf( "(interlaced PNG not supported in streaming) " );
+            closeStreamSource( ss );
+            return false;
+        }
+
+        // palette, low bits and 16 bits are converted to 8 bit gray or RGB(A).
+        png_set_expand( ss.png_ptr );
+        png_set_strip_16( ss.png_ptr );
+
+        // gray with alpha, or with tRNS expanded to alpha, to RGBA as loader does.
+        png_byte ctype = png_get_color_type( ss.png_ptr, ss.info_ptr );
+
+        if ( ( ctype == PNG_COLOR_TYPE_GRAY_ALPHA ) 
+             || ( ( ctype == PNG_COLOR_TYPE_GRAY ) 
+                  && ( png_get_valid( ss.png_ptr, ss.info_ptr, PNG_INFO_tRNS ) != 0 ) ) )
+        {
+            png_set_gray_to_rgb( ss.png_ptr );
+        }
+
+        png_read_update_info( ss.png_ptr, ss.info_ptr );
+
+        ss.w = png_get_image_width( ss.png_ptr, ss.info_ptr );
+        ss.h = png_get_image_height( ss.png_ptr, ss.info_ptr );
+        ss.d = png_get_channels( ss.png_ptr, ss.info_ptr );
+
+        return true;
+    }
+
+    closeStreamSource( ss );
+    return false;
+}
+
+bool readStreamRow( unsigned y, unsigned char* row, void* param )
+{
+    StreamSource* ss = (StreamSource*)param;
+
+    if ( ss->type == 1 )
+    {
+        if ( setjmp( ss->jerr.jmp ) != 0 )
+            return false;
+
+        JSAMPROW jrow = row;
+        return jpeg_read_scanlines( &ss->jinfo, &jrow, 1 ) == 1;
+    }
+    else
+    if ( ss->type == 2 )
+    {
+        if ( setjmp( png_jmpbuf( ss->png_ptr ) ) != 0 )
+            return false;
+
+        png_read_row( ss->png_ptr, row, NULL );
+        return true;
+    }
+
+    return false;
+}
+
+bool openStreamSink( const char* fpath, unsigned w, unsigned h, StreamSink &sk )
+{
+    memset( &sk, 0, sizeof( StreamSink ) );
+
+    sk.fp = fopen( fpath, "wb" );
+    if ( sk.fp == NULL )
+        return false;
+
+    sk.png_ptr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+    if ( sk.png_ptr != NULL )
+    {
+        sk.info_ptr = png_create_info_struct( sk.png_ptr );
+        if ( sk.info_ptr != NULL )
+        {
+            if ( setjmp( png_jmpbuf( sk.png_ptr ) ) == 0 )
+            {
+                png_init_io( sk.png_ptr, sk.fp );
+                png_set_IHDR( sk.png_ptr,
+                              sk.info_ptr,
+                              w,
+                              h,
+                              8,
+                              PNG_COLOR_TYPE_RGB,
+                              PNG_INTERLACE_NONE,
+                              PNG_COMPRESSION_TYPE_BASE,
+                              PNG_FILTER_TYPE_BASE);
+
+                png_write_info( sk.png_ptr, sk.info_ptr );
+
+                return true;
+            }
+        }
+
+        png_destroy_write_struct( &sk.png_ptr, &sk.info_ptr );
+    }
+
+    fclose( sk.fp );
+    sk.fp = NULL;
+
+    return false;
+}
+
+bool writeStreamRow( unsigned y, const unsigned char* row, void* param )
+{
+    StreamSink* sk = (StreamSink*)param;
+
+    if ( setjmp( png_jmpbuf( sk->png_ptr ) ) != 0 )
+        return false;
+
+    png_write_row( sk->png_ptr, (png_const_bytep)row );
+    return true;
+}
+
+void closeStreamSink( StreamSink &sk, bool finish )
+{
+    if ( sk.fp == NULL )
+        return;
+
+    if ( ( finish == true ) && ( setjmp( png_jmpbuf( sk.png_ptr ) ) == 0 ) )
+    {
+        png_write_end( sk.png_ptr, NULL );
+    }
+
+    png_destroy_write_struct( &sk.png_ptr, &sk.info_ptr );
+    fclose( sk.fp );
+    sk.fp = NULL;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -438,6 +702,31 @@ static string   file_bokeh;
 static string   file_dst;
 static string   file_cov;
 static bool     opt_legacy = false;
+static bool     opt_gather = false;
+static bool     opt_fft    = false;
+static bool     opt_sep    = false;
+static bool     opt_fixed  = false;
+static bool     opt_stream = false;
+static bool     opt_batch  = false;
+static string   path_out;
+static bool     opt_tune   = false;
+static int      opt_threads = -1;
+static bool     opt_pin    = false;
+static bool     opt_scale  = false;
+static bool     opt_retouch = false;
+static bool     opt_context = false;
+static bool     opt_huge   = false;
+static bool     opt_pyramid = false;
+static bool     opt_hybrid = false;
+static float    opt_quality = 0.5f;
+static string   file_depth;
+static float    opt_focus  = 0.5f;
+static bool     opt_view   = false;
+static unsigned opt_border = BOKEH_BORDER_CLAMP;
+static unsigned opt_bcolor = 0;
+static int      opt_anchor_x = -1;
+static int      opt_anchor_y = -1;
+static bool     opt_stats  = false;
 
 bool parseArgs( int argc, char** argv )
 {
@@ -472,6 +761,153 @@ bool parseArgs( int argc, char** argv )
                 opt_legacy = true;
             }
             else
+            if ( ( strtmp == "--gather" ) || ( strtmp == "-G" ) )
+            {
+                opt_gather = true;
+            }
+            else
+            if ( ( strtmp == "--fft" ) || ( strtmp == "-F" ) )
+            {
+                opt_fft = true;
+            }
+            else
+            if ( ( strtmp == "--separable" ) || ( strtmp == "-S" ) )
+            {
+                opt_sep = true;
+            }
+            else
+            if ( ( strtmp == "--fixed" ) || ( strtmp == "-X" ) )
+            {
+                opt_fixed = true;
+            }
+            else
+            if ( ( strtmp == "--batch" ) || ( strtmp == "-B" ) )
+            {
+                opt_batch = true;
+            }
+            else
+            if ( ( strtmp == "--stream" ) || ( strtmp == "-M" ) )
+            {
+                opt_stream = true;
+            }
+            else
+            if ( ( strtmp == "--autotune" ) || ( strtmp == "-T" ) )
+            {
+                opt_tune = true;
+            }
+            else
+            if ( ( strtmp == "--threads" ) || ( strtmp == "-j" ) )
+            {
+                if ( cnt + 1 < argc )
+                {
+                    opt_threads = atoi( argv[ ++cnt ] );
+                }
+            }
+            else
+            if ( ( strtmp == "--pin" ) || ( strtmp == "-P" ) )
+            {
+                opt_pin = true;
+            }
+            else
+            if ( ( strtmp == "--scaling" ) || ( strtmp == "-C" ) )
+            {
+                opt_scale = true;
+            }
+            else
+            if ( ( strtmp == "--retouch" ) || ( strtmp == "-U" ) )
+            {
+                opt_retouch = true;
+            }
+            else
+            if ( ( strtmp == "--context" ) || ( strtmp == "-K" ) )
+            {
+                opt_context = true;
+            }
+            else
+            if ( ( strtmp == "--hugepages" ) || ( strtmp == "-H" ) )
+            {
+                opt_huge = true;
+            }
+            else
+            if ( ( strtmp == "--pyramid" ) || ( strtmp == "-Y" ) )
+            {
+                opt_pyramid = true;
+            }
+            else
+            if ( ( strtmp == "--hybrid" ) || ( strtmp == "-Z" ) )
+            {
+                opt_hybrid = true;
+            }
+            else
+            if ( ( strtmp == "--quality" ) || ( strtmp == "-Q" ) )
+            {
+                if ( cnt + 1 < argc )
+                {
+                    opt_quality = atof( argv[ ++cnt ] );
+                }
+            }
+            else
+            if ( ( strtmp == "--border" ) || ( strtmp == "-E" ) )
+            {
+                if ( cnt + 1 < argc )
+                {
+                    string mode = argv[ ++cnt ];
+
+                    if ( mode == "wrap" )
+                        opt_border = BOKEH_BORDER_WRAP;
+                    else
+                    if ( mode == "mirror" )
+                        opt_border = BOKEH_BORDER_MIRROR;
+                    else
+                    if ( mode == "constant" )
+                        opt_border = BOKEH_BORDER_CONSTANT;
+                    else
+                        opt_border = BOKEH_BORDER_CLAMP;
+                }
+            }
+            else
+            if ( strtmp == "--bordercolor" )
+            {
+                if ( cnt + 1 < argc )
+                {
+                    opt_bcolor = strtoul( argv[ ++cnt ], NULL, 16 );
+                }
+            }
+            else
+            if ( ( strtmp == "--anchor" ) || ( strtmp == "-A" ) )
+            {
+                if ( cnt + 1 < argc )
+                {
+                    sscanf( argv[ ++cnt ], "%d,%d", &opt_anchor_x, &opt_anchor_y );
+                }
+            }
+            else
+            if ( ( strtmp == "--view" ) || ( strtmp == "-V" ) )
+            {
+                opt_view = true;
+            }
+            else
+            if ( ( strtmp == "--stats" ) || ( strtmp == "-I" ) )
+            {
+                opt_stats = true;
+            }
+            else
+            if ( ( strtmp == "--depth" ) || ( strtmp == "-D" ) )
+            {
+                if ( cnt + 1 < argc )
+                {
+                    file_depth = argv[ ++cnt ];
+                }
+            }
+            else
+            if ( ( strtmp == "--focus" ) || ( strtmp == "-O" ) )
+            {
+                if ( cnt + 1 < argc )
+                {
+                    opt_focus = atof( argv[ ++cnt ] );
+                }
+            }
+            else
             if ( file_src.size() == 0 )
             {
                 file_src = strtmp;
@@ -489,6 +925,14 @@ bool parseArgs( int argc, char** argv )
         }
     }
     
+    // batch : source is manifest or glob, output is directory.
+    if ( opt_batch == true )
+    {
+        path_out = file_dst;
+
+        return ( file_src.size() > 0 ) && ( file_bokeh.size() > 0 );
+    }
+
     if ( ( file_src.size() > 0 ) && ( file_bokeh.size() > 0 ) 
 		  && ( file_dst.size() == 0 ) )
     {
@@ -570,6 +1014,47 @@ void printUsage()
     printf( "\n" );
     printf( "  option:\n" );
     printf( "      --legacy | -L    : doing legacy bokeh effoect.\n" );
+    printf( "      --gather | -G    : doing bokeh effect with direct gather engine.\n" );
+    printf( "      --fft | -F       : doing bokeh effect with FFT convolution engine.\n" );
+    printf( "      --separable | -S : doing bokeh effect with separable mask approximation.\n" );
+    printf( "      --fixed | -X     : doing bokeh effect with fixed point gather engine.\n" );
+    printf( "      --stream | -M    : doing bokeh effect by row bands, decoding and\n" );
+    printf( "                         encoding scanlines in bounded memory.\n" );
+    printf( "                         source is not expanded, borders wrap around.\n" );
+    printf( "      --autotune | -T  : find best tile size before gather engine.\n" );
+    printf( "      --threads | -j N : using N threads, 0 for all cores.\n" );
+    printf( "      --pin | -P       : pinning threads to cores.\n" );
+    printf( "      --scaling | -C   : reports speed by 1 to 32 threads, after processing.\n" );
+    printf( "      --retouch | -U   : reports re-rendering by cache for changes of intensity\n" );
+    printf( "                         and a small area, after processing.\n" );
+    printf( "      --context | -K   : reports frames of two contexts running at once,\n" );
+    printf( "                         limited to half of threads each, after processing.\n" );
+    printf( "      --hugepages | -H : backing large image buffers by huge pages.\n" );
+    printf( "      --pyramid | -Y   : doing bokeh effect at reduced scale for large mask,\n" );
+    printf( "                         and reports PSNR against normal bokeh effect.\n" );
+    printf( "      --hybrid | -Z    : doing bokeh effect by splatting highlights, and\n" );
+    printf( "                         reduced scale for others, for night shots.\n" );
+    printf( "      --quality | -Q Q : quality of pyramid or hybrid, 0 to 1 ( default 0.5 ).\n" );
+    printf( "      --depth | -D F   : doing depth of field by depth map image F,\n" );
+    printf( "                         bright is far. source is not expanded.\n" );
+    printf( "      --focus | -O Z   : depth in focus, 0 to 1 ( default 0.5 ).\n" );
+    printf( "      --border | -E B  : border of default and gather engine, as clamp ( default ),\n" );
+    printf( "                         mirror, wrap or constant. other engines expand source.\n" );
+    printf( "      --bordercolor C  : color of constant border as RRGGBB.\n" );
+    printf( "      --anchor | -A X,Y: pixel of mask placed on each pixel, center as default.\n" );
+    printf( "      --view | -V      : interactive preview, refined progressively,\n" );
+    printf( "                         by sliders of intensity, aperture and mask.\n" );
+    printf( "      --stats | -I     : reports time of decode, encode and each stage of\n" );
+    printf( "                         library, with hardware counters if available,\n" );
+    printf( "                         and same as a line of JSON.\n" );
+    printf( "      --batch | -B     : doing bokeh effect for many images, as\n" );
+    printf( "                         %s -B [manifest|directory|glob] [bokeh file] (output directory)\n",
+            file_me.c_str() );
+    printf( "                         manifest has lines of 'source (bokeh) (output)'.\n" );
+    printf( "                         sources are not expanded, borders wrap around.\n" );
+    printf( "\n" );
+    printf( "  PPM, PGM ( 8/16 bit ) and PFM source is mapped to memory as is,\n" );
+    printf( "  and written to PPM, or PFM for float source or .pfm output.\n" );
     printf( "\n" );
 }
 
@@ -631,63 +1116,1643 @@ Fl_RGB_Image* loadImg( string fname )
 	return NULL;
 }
 
-int main( int argc, char** argv )
-{   
-    if ( parseArgs( argc, argv ) == false )
-    {
-        printAbout();
-        printUsage();
-        return -1;
-    }
+////////////////////////////////////////////////////////////////////////////////
+// Batch mode : decode, bokeh and encode stages by threads,
+// connected with bounded queues.
 
-    printAbout();
-    
-    Fl_RGB_Image* imgSrc   = loadImg( file_src );
-	Fl_RGB_Image* imgBokeh = loadImg( file_bokeh );    
-    
-    if ( ( imgSrc != NULL ) && ( imgBokeh != NULL ) ) 
-    {
-        unsigned origin_w = imgSrc->w();
-        unsigned origin_h = imgSrc->h();
+// Bounded queue between stages. Occupancy is sampled at every push and pop.
+template <typename T>
+class BatchQueue
+{
+    public:
+        BatchQueue( unsigned cap )
+        : capacity( cap ), closed( false ),
+          samples( 0 ), occsum( 0 ), occmax( 0 ), fullwaits( 0 ), emptywaits( 0 )
+        {
+        }
 
-        Fl_RGB_Image* imgRGB = NULL;
-		Fl_RGB_Image* imgMask = NULL;
-                
-		printf( "- Converting common images ... " );
+    public:
+        // Blocks while full, false when closed.
+        bool push( T item )
+        {
+            unique_lock<mutex> lock( mtx );
 
-        unsigned mask_w = imgBokeh->w();
-        unsigned mask_h = imgBokeh->h();        
-        unsigned expand_sz_w = origin_w + ( mask_w * 2 );
-        unsigned expand_sz_h = origin_h + ( mask_h * 2 );
-
-        // Expand soruce image -
-        Fl_RGB_Image* imgTmpSrc = imgSrc;
-        imgSrc = fl_imgtk::rescale( imgTmpSrc,
-                                    expand_sz_w,
-                                    expand_sz_h,
-                                    fl_imgtk::BILINEAR );
-        //fl_imgtk::brightness_ex( imgSrc, -50 );
-        fl_imgtk::drawonimage( imgSrc, 
-                               imgTmpSrc,
-                               ( expand_sz_w - origin_w ) / 2,
-                               ( expand_sz_h - origin_h ) / 2 );
+            if ( ( items.size() >= capacity ) && ( closed == false ) )
+            {
+                fullwaits++;
+                cvpush.wait( lock, [this]
+                             { return ( items.size() < capacity ) || closed; } );
+            }
 
-        fl_imgtk::discard_user_rgb_image( imgTmpSrc );
+            if ( closed == true )
+                return false;
 
-        convImage2RGB( imgSrc, imgRGB );
-        
-        if ( ( imgBokeh->w() <= imgSrc->w() ) 
-              && ( imgBokeh->h() <= imgSrc->h() ) )
+            items.push_back( item );
+            sample();
+            cvpop.notify_one();
+
+            return true;
+        }
+
+        // Blocks while empty, false when closed and empty.
+        bool pop( T &item )
         {
-            if ( opt_legacy == true )
+            unique_lock<mutex> lock( mtx );
+
+            if ( ( items.size() == 0 ) && ( closed == false ) )
             {
-                Fl_RGB_Image* imgTmp = imgBokeh;
-                imgBokeh= fl_imgtk::makeanempty( imgSrc->w(), imgSrc->h(), 3, 0x0 );
-                int put_x = 0;
-                int put_y = imgSrc->h() - imgTmp->h();
-                fl_imgtk::drawonimage( imgBokeh, imgTmp, put_x, put_y );
-                
-                fl_imgtk::discard_user_rgb_image( imgTmp );
+                emptywaits++;
+                cvpop.wait( lock, [this]
+                            { return ( items.size() > 0 ) || closed; } );
+            }
+
+            if ( items.size() == 0 )
+                return false;
+
+            item = items.front();
+            items.pop_front();
+            sample();
+            cvpush.notify_one();
+
+            return true;
+        }
+
+        void close()
+        {
+            lock_guard<mutex> lock( mtx );
+
+            closed = true;
+            cvpush.notify_all();
+            cvpop.notify_all();
+        }
+
+        void report( const char* name )
+        {
+            printf( "- Queue %-16s : capacity %u, average %.2f, max %u, "
+                    "waits full %u / empty %u\n",
+                    name, capacity, 
+                    samples > 0 ? (double)occsum / samples : 0.0,
+                    occmax, fullwaits, emptywaits );
+        }
+
+    private:
+        void sample()
+        {
+            samples++;
+            occsum += items.size();
+            occmax  = max( occmax, (unsigned)items.size() );
+        }
+
+    private:
+        unsigned            capacity;
+        bool                closed;
+        deque<T>            items;
+        mutex               mtx;
+        condition_variable  cvpush;
+        condition_variable  cvpop;
+        unsigned long long  samples;
+        unsigned long long  occsum;
+        unsigned            occmax;
+        unsigned            fullwaits;
+        unsigned            emptywaits;
+};
+
+struct BatchJob
+{
+    string              src;
+    string              dst;
+    BokehKernel*        kernel;
+    rawimage::Mapped    mapped;     /// raw source.
+    vector<uchar>       pixels;     /// decoded source.
+    BokehRaster         raster;
+    vector<uchar>       output;
+    BokehRaster         outraster;
+    bool                failed;
+};
+
+static bool hasExtension( const string &fname, const char* const* exts )
+{
+    size_t posdot = fname.find_last_of( "." );
+
+    if ( posdot == string::npos )
+        return false;
+
+    string ext = fname.substr( posdot + 1 );
+
+    for( size_t cnt=0; cnt<ext.size(); cnt++ )
+    {
+        ext[cnt] = tolower( ext[cnt] );
+    }
+
+    for( ; *exts != NULL; exts++ )
+    {
+        if ( ext == *exts )
+            return true;
+    }
+
+    return false;
+}
+
+static const char* const batch_exts[] = 
+    { "jpg", "jpeg", "png", "ppm", "pgm", "pfm", NULL };
+static const char* const raw_exts[]   = { "ppm", "pgm", NULL };
+static const char* const float_exts[] = { "pfm", NULL };
+
+// Output name of source, beside source or in path_out.
+static string batchOutputName( const string &src )
+{
+    string name   = src;
+    string ext    = ".png";
+    size_t posdir = name.find_last_of( "/\\" );
+
+    if ( ( path_out.size() > 0 ) && ( posdir != string::npos ) )
+    {
+        name = name.substr( posdir + 1 );
+    }
+
+    if ( hasExtension( src, raw_exts ) == true )
+    {
+        ext = ".ppm";
+    }
+    else
+    if ( hasExtension( src, float_exts ) == true )
+    {
+        ext = ".pfm";
+    }
+
+    size_t posdot = name.find_last_of( "." );
+
+    if ( ( posdot != string::npos ) && ( name.find_first_of( "/\\", posdot ) == string::npos ) )
+    {
+        name = name.substr( 0, posdot );
+    }
+
+    if ( path_out.size() > 0 )
+    {
+        name = path_out + "/" + name;
+    }
+
+    return name + "_bokeh" + ext;
+}
+
+// Mask is loaded once per file, and shared by jobs.
+static BokehKernel* batchKernel( const string &fname, 
+                                 map<string,BokehKernel*> &kernels )
+{
+    map<string,BokehKernel*>::iterator it = kernels.find( fname );
+
+    if ( it != kernels.end() )
+        return it->second;
+
+    BokehKernel* kernel = NULL;
+
+    if ( rawimage::isRawFile( fname.c_str() ) == true )
+    {
+        rawimage::Mapped mapmask;
+
+        if ( rawimage::mapFile( fname.c_str(), mapmask ) == true )
+        {
+            kernel = CompileRasterKernel( mapmask.raster );
+            rawimage::unmap( mapmask );
+        }
+    }
+    else
+    {
+        Fl_RGB_Image* imgBokeh = loadImg( fname );
+        Fl_RGB_Image* imgMask  = NULL;
+
+        if ( imgBokeh != NULL )
+        {
+            convImage2Mono( imgBokeh, imgMask );
+
+            if ( imgMask != NULL )
+            {
+                kernel = CompileBokehKernel( (const uchar*)imgMask->data()[0],
+                                             imgMask->w(), imgMask->h() );
+                delete imgMask;
+            }
+
+            fl_imgtk::discard_user_rgb_image( imgBokeh );
+        }
+    }
+
+    kernels[ fname ] = kernel;
+
+    return kernel;
+}
+
+static void addBatchJob( const string &src, const string &mask, const string &dst,
+                         map<string,BokehKernel*> &kernels, vector<BatchJob*> &jobs )
+{
+    BokehKernel* kernel = batchKernel( mask, kernels );
+
+    if ( kernel == NULL )
+    {
+        printf( "- Skipped %s : failed to load mask %s.\n", src.c_str(), mask.c_str() );
+        return;
+    }
+
+    BatchJob* job = new BatchJob;
+
+    job->src    = src;
+    job->dst    = dst.size() > 0 ? dst : batchOutputName( src );
+    job->kernel = kernel;
+    job->failed = false;
+    job->mapped.base   = NULL;
+    job->mapped.length = 0;
+    job->mapped.fd     = -1;
+
+    jobs.push_back( job );
+}
+
+// Jobs from directory, glob pattern, or manifest file.
+static void listBatchJobs( const string &spec, map<string,BokehKernel*> &kernels,
+                           vector<BatchJob*> &jobs )
+{
+#if !defined(_WIN32) && !defined(WIN32)
+    struct stat st;
+    string      pattern;
+
+    if ( ( stat( spec.c_str(), &st ) == 0 ) && ( S_ISDIR( st.st_mode ) ) )
+    {
+        pattern = spec + "/*";
+    }
+    else
+    if ( spec.find_first_of( "*?[" ) != string::npos )
+    {
+        pattern = spec;
+    }
+
+    if ( pattern.size() > 0 )
+    {
+        glob_t gl;
+
+        if ( glob( pattern.c_str(), 0, NULL, &gl ) == 0 )
+        {
+            for( size_t cnt=0; cnt<gl.gl_pathc; cnt++ )
+            {
+                string fname = gl.gl_pathv[cnt];
+
+                if ( hasExtension( fname, batch_exts ) == true )
+                {
+                    addBatchJob( fname, file_bokeh, "", kernels, jobs );
+                }
+            }
+
+            globfree( &gl );
+        }
+
+        return;
+    }
+#endif /// of !WIN32
+
+    FILE* fp = fopen( spec.c_str(), "r" );
+
+    if ( fp == NULL )
+        return;
+
+    char line[4096];
+
+    while( fgets( line, sizeof(line), fp ) != NULL )
+    {
+        char* comment = strchr( line, '#' );
+
+        if ( comment != NULL )
+        {
+            *comment = 0;
+        }
+
+        char   toks[3][1024] = {{0,},};
+        int    ntoks = sscanf( line, "%1023s %1023s %1023s", toks[0], toks[1], toks[2] );
+
+        if ( ntoks <= 0 )
+            continue;
+
+        addBatchJob( toks[0], 
+                     ntoks > 1 ? toks[1] : file_bokeh,
+                     ntoks > 2 ? toks[2] : "",
+                     kernels, jobs );
+    }
+
+    fclose( fp );
+}
+
+static bool decodeBatchJob( BatchJob* job )
+{
+    if ( rawimage::isRawFile( job->src.c_str() ) == true )
+    {
+        if ( rawimage::mapFile( job->src.c_str(), job->mapped ) == false )
+            return false;
+
+        job->raster = job->mapped.raster;
+
+        return true;
+    }
+
+    StreamSource ss;
+
+    if ( openStreamSource( job->src.c_str(), ss ) == false )
+        return false;
+
+    size_t rowbytes = (size_t)ss.w * ss.d;
+    bool   retb     = true;
+
+    job->pixels.resize( rowbytes * ss.h );
+
+    for( unsigned y=0; ( y<ss.h ) && ( retb == true ); y++ )
+    {
+        retb = readStreamRow( y, &job->pixels[ rowbytes * y ], &ss );
+    }
+
+    BokehRaster &r = job->raster;
+
+    r.pixels    = &job->pixels[0];
+    r.w         = ss.w;
+    r.h         = ss.h;
+    r.d         = ss.d;
+    r.format    = BOKEH_RASTER_U8;
+    r.rowstride = rowbytes;
+    r.range     = 255.f;
+
+    closeStreamSource( ss );
+
+    return retb;
+}
+
+static bool bokehBatchJob( BatchJob* job )
+{
+    const BokehRaster &src = job->raster;
+    BokehRaster       &dst = job->outraster;
+    bool               pfm = hasExtension( job->dst, float_exts );
+    unsigned           ssz = pfm == true ? 4 : 1;
+
+    job->output.resize( (size_t)src.w * src.h * 3 * ssz );
+
+    dst.pixels    = &job->output[0];
+    dst.w         = src.w;
+    dst.h         = src.h;
+    dst.d         = 3;
+    dst.format    = pfm == true ? BOKEH_RASTER_F32LE : BOKEH_RASTER_U8;
+    dst.rowstride = (long)src.w * 3 * ssz;
+    dst.range     = pfm == true ? 1.f : 255.f;
+
+    bool retb = ProcessRasterBokeh( src, job->kernel, dst );
+
+    // source is no more needed.
+    rawimage::unmap( job->mapped );
+    vector<uchar>().swap( job->pixels );
+
+    return retb;
+}
+
+static bool encodeBatchJob( BatchJob* job )
+{
+    const BokehRaster &r = job->outraster;
+
+    if ( hasExtension( job->dst, raw_exts ) || hasExtension( job->dst, float_exts ) )
+    {
+        rawimage::Mapped mapdst;
+        size_t           rowbytes = r.rowstride;
+
+        if ( rawimage::createFile( job->dst.c_str(), r.w, r.h, 
+                                   r.format == BOKEH_RASTER_F32LE, mapdst ) == false )
+            return false;
+
+        for( unsigned y=0; y<r.h; y++ )
+        {
+            memcpy( (uchar*)mapdst.raster.pixels + (ptrdiff_t)y * mapdst.raster.rowstride,
+                    &job->output[ rowbytes * y ], rowbytes );
+        }
+
+        rawimage::unmap( mapdst );
+
+        return true;
+    }
+
+    StreamSink sk;
+    bool       retb = true;
+
+    if ( openStreamSink( job->dst.c_str(), r.w, r.h, sk ) == false )
+        return false;
+
+    for( unsigned y=0; ( y<r.h ) && ( retb == true ); y++ )
+    {
+        retb = writeStreamRow( y, &job->output[ (size_t)r.rowstride * y ], &sk );
+    }
+
+    closeStreamSink( sk, retb );
+
+    return retb;
+}
+
+void printMemoryStats()
+{
+    BokehMemoryStats ms;
+
+    GetBokehMemoryStats( ms );
+
+    printf( "- Memory : %llu buffers, %llu allocated, %llu recycled, "
+            "peak %.1f MB, huge pages %.1f MB\n",
+            ms.requests, ms.allocs, ms.reuses,
+            ms.peakbytes / 1048576.0, ms.hugebytes / 1048576.0 );
+    fflush( stdout );
+}
+
+// Stats of library taken after processing, with decode and encode of
+// program. Last line is JSON for dashboards.
+void reportStats( const BokehStats &st, unsigned long long decodens,
+                  unsigned long long bokehns, unsigned long long encodens )
+{
+    printf( "- Stats : decode %.3f ms, bokeh %.3f ms, encode %.3f ms, "
+            "%.1f MB allocated\n",
+            decodens / 1e6, bokehns / 1e6, encodens / 1e6, st.bytes / 1048576.0 );
+
+    for( unsigned cnt=0; cnt<BOKEH_STAGE_MAX; cnt++ )
+    {
+        const BokehStageStats &ss = st.stages[cnt];
+
+        printf( "  %-8s : %llu calls, %.3f ms, %.1f MB, %llu taps, %u threads",
+                GetBokehStageName( cnt ), ss.calls, ss.ns / 1e6, 
+                ss.bytes / 1048576.0, ss.taps, ss.threads );
+
+        if ( st.counters == true )
+        {
+            printf( ", %llu cycles, IPC %.2f, %llu LLC misses",
+                    ss.cycles, 
+                    ss.cycles > 0 ? (double)ss.instructions / ss.cycles : 0.0,
+                    ss.llcmisses );
+        }
+
+        printf( "\n" );
+    }
+
+    printf( "{\"decode_ns\":%llu,\"bokeh_ns\":%llu,\"encode_ns\":%llu,"
+            "\"bytes\":%llu,\"threads\":%u,\"counters\":%s,\"stages\":{",
+            decodens, bokehns, encodens, st.bytes, GetBokehThreads(),
+            st.counters == true ? "true" : "false" );
+
+    for( unsigned cnt=0; cnt<BOKEH_STAGE_MAX; cnt++ )
+    {
+        const BokehStageStats &ss = st.stages[cnt];
+
+        printf( "%s\"%s\":{\"calls\":%llu,\"ns\":%llu,\"bytes\":%llu,"
+                "\"taps\":%llu,\"threads\":%u,\"cycles\":%llu,"
+                "\"instructions\":%llu,\"llc_misses\":%llu}",
+                cnt > 0 ? "," : "", GetBokehStageName( cnt ),
+                ss.calls, ss.ns, ss.bytes, ss.taps, ss.threads,
+                ss.cycles, ss.instructions, ss.llcmisses );
+    }
+
+    printf( "}}\n" );
+    fflush( stdout );
+}
+
+int processBatch()
+{
+    map<string,BokehKernel*> kernels;
+    vector<BatchJob*>        jobs;
+
+    listBatchJobs( file_src, kernels, jobs );
+
+    printf( "- Batch : %u jobs, %u masks from %s\n", 
+            (unsigned)jobs.size(), (unsigned)kernels.size(), file_src.c_str() );
+    fflush( stdout );
+
+    if ( jobs.size() > 0 )
+    {
+        // Codec stages share cores with convolution,
+        // bokeh stage uses all cores by itself.
+        unsigned cores    = max( 1u, thread::hardware_concurrency() );
+        unsigned decoders = max( 1u, min( 4u, cores / 2 ) );
+        unsigned encoders = decoders;
+
+        BatchQueue<BatchJob*> qdecoded( decoders * 2 );
+        BatchQueue<BatchJob*> qdone( encoders * 2 );
+        atomic<unsigned>      nextjob( 0 );
+        atomic<unsigned>      failed( 0 );
+        atomic<unsigned>      activedec( decoders );
+        atomic<unsigned long> busydec( 0 );
+        atomic<unsigned long> busybokeh( 0 );
+        atomic<unsigned long> busyenc( 0 );
+        vector<thread>        workers;
+
+        unsigned perf0 = tick::getTickCount();
+
+        for( unsigned cnt=0; cnt<decoders; cnt++ )
+        {
+            workers.push_back( thread( [&]
+            {
+                for( unsigned idx=nextjob++; idx<jobs.size(); idx=nextjob++ )
+                {
+                    unsigned t0 = tick::getTickCount();
+
+                    jobs[idx]->failed = ( decodeBatchJob( jobs[idx] ) == false );
+                    busydec += tick::getTickCount() - t0;
+
+                    qdecoded.push( jobs[idx] );
+                }
+
+                if ( --activedec == 0 )
+                {
+                    qdecoded.close();
+                }
+            } ) );
+        }
+
+        workers.push_back( thread( [&]
+        {
+            BatchJob* job = NULL;
+
+            while( qdecoded.pop( job ) == true )
+            {
+                unsigned t0 = tick::getTickCount();
+
+                if ( job->failed == false )
+                {
+                    job->failed = ( bokehBatchJob( job ) == false );
+                }
+
+                busybokeh += tick::getTickCount() - t0;
+
+                qdone.push( job );
+            }
+
+            qdone.close();
+        } ) );
+
+        for( unsigned cnt=0; cnt<encoders; cnt++ )
+        {
+            workers.push_back( thread( [&]
+            {
+                BatchJob* job = NULL;
+
+                while( qdone.pop( job ) == true )
+                {
+                    unsigned t0 = tick::getTickCount();
+
+                    if ( ( job->failed == true ) || ( encodeBatchJob( job ) == false ) )
+                    {
+                        printf( "- Failed : %s\n", job->src.c_str() );
+                        failed++;
+                    }
+
+                    busyenc += tick::getTickCount() - t0;
+
+                    vector<uchar>().swap( job->output );
+                }
+            } ) );
+        }
+
+        for( size_t cnt=0; cnt<workers.size(); cnt++ )
+        {
+            workers[cnt].join();
+        }
+
+        unsigned perf1 = tick::getTickCount();
+        unsigned elapsed = max( 1u, perf1 - perf0 );
+
+        printf( "- Batch : %u images ( %u failed ) in %u ms, %.2f images/s\n",
+                (unsigned)jobs.size(), (unsigned)failed, elapsed,
+                jobs.size() * 1000.0 / elapsed );
+        printf( "- Stages busy : decode %lu ms ( %u threads ), bokeh %lu ms, "
+                "encode %lu ms ( %u threads )\n",
+                (unsigned long)busydec, decoders, (unsigned long)busybokeh,
+                (unsigned long)busyenc, encoders );
+        qdecoded.report( "decode -> bokeh" );
+        qdone.report( "bokeh -> encode" );
+        printMemoryStats();
+
+        if ( opt_stats == true )
+        {
+            BokehStats st;
+
+            GetBokehStats( st );
+            reportStats( st, (unsigned long long)busydec * 1000000, 
+                         (unsigned long long)busybokeh * 1000000,
+                         (unsigned long long)busyenc * 1000000 );
+        }
+    }
+
+    for( size_t cnt=0; cnt<jobs.size(); cnt++ )
+    {
+        delete jobs[cnt];
+    }
+
+    for( map<string,BokehKernel*>::iterator it=kernels.begin(); 
+         it!=kernels.end(); ++it )
+    {
+        DiscardBokehKernel( it->second );
+    }
+
+    return 0;
+}
+
+// Raw mode : PPM, PGM and PFM mapped to memory, from source to output
+// without decoding nor FLTK images. Source is not expanded.
+int processRaw()
+{
+    rawimage::Mapped mapsrc;
+    rawimage::Mapped mapmask;
+    rawimage::Mapped mapdst;
+    BokehKernel*     kernel = NULL;
+
+    printf( "- Mapping raw image : %s -> ", file_src.c_str() );
+
+    if ( rawimage::mapFile( file_src.c_str(), mapsrc ) == false )
+    {
+        printf( "Failed.\n" );
+        return 0;
+    }
+
+    printf( "%ux%ux%u\n", mapsrc.raster.w, mapsrc.raster.h, mapsrc.raster.d );
+
+    if ( rawimage::isRawFile( file_bokeh.c_str() ) == true )
+    {
+        if ( rawimage::mapFile( file_bokeh.c_str(), mapmask ) == true )
+        {
+            kernel = CompileRasterKernel( mapmask.raster );
+            rawimage::unmap( mapmask );
+        }
+    }
+    else
+    {
+        Fl_RGB_Image* imgBokeh = loadImg( file_bokeh );
+        Fl_RGB_Image* imgMask  = NULL;
+
+        if ( imgBokeh != NULL )
+        {
+            convImage2Mono( imgBokeh, imgMask );
+
+            if ( imgMask != NULL )
+            {
+                kernel = CompileBokehKernel( (const uchar*)imgMask->data()[0],
+                                             imgMask->w(), imgMask->h() );
+                delete imgMask;
+            }
+
+            fl_imgtk::discard_user_rgb_image( imgBokeh );
+        }
+    }
+
+    if ( kernel == NULL )
+    {
+        printf( "- Failed to load mask.\n" );
+        rawimage::unmap( mapsrc );
+        return 0;
+    }
+
+    // output is PFM by extension or float source, otherwise PPM.
+    string dstext;
+    size_t posdot = file_dst.find_last_of( "." );
+
+    if ( posdot != string::npos )
+    {
+        dstext = file_dst.substr( posdot );
+    }
+
+    bool pfm = ( dstext == ".pfm" ) || ( dstext == ".PFM" );
+
+    if ( ( pfm == false ) && ( dstext != ".ppm" ) && ( dstext != ".PPM" ) )
+    {
+        pfm = ( mapsrc.raster.format == BOKEH_RASTER_F32LE ) 
+              || ( mapsrc.raster.format == BOKEH_RASTER_F32BE );
+
+        file_dst = file_dst.substr( 0, posdot ) + ( pfm == true ? ".pfm" : ".ppm" );
+    }
+
+    if ( rawimage::createFile( file_dst.c_str(), mapsrc.raster.w, mapsrc.raster.h,
+                               pfm, mapdst ) == false )
+    {
+        printf( "- Failed to write : %s\n", file_dst.c_str() );
+        DiscardBokehKernel( kernel );
+        rawimage::unmap( mapsrc );
+        return 0;
+    }
+
+    printf( "- Processing raw bokeh effect ( %u taps ) -> %s ... ", 
+            BokehKernelTaps( kernel ), file_dst.c_str() );
+    fflush( stdout );
+
+    unsigned long long tick0 = tick::getTickNs();
+    unsigned perf0 = tick::getTickCount();
+
+    bool retb = ProcessRasterBokeh( mapsrc.raster, kernel, mapdst.raster );
+
+    unsigned perf1 = tick::getTickCount();
+    unsigned long long tick1 = tick::getTickNs();
+
+    printf( "done ( %d ) in %u ms.\n", (int)retb, perf1 - perf0 );
+    fflush( stdout );
+    printMemoryStats();
+
+    if ( opt_stats == true )
+    {
+        BokehStats st;
+
+        // mapped files, no decode nor encode.
+        GetBokehStats( st );
+        reportStats( st, 0, tick1 - tick0, 0 );
+    }
+
+    rawimage::unmap( mapdst );
+    rawimage::unmap( mapsrc );
+    DiscardBokehKernel( kernel );
+
+    return 0;
+}
+
+// Streaming mode keeps only mask and row bands in memory,
+// so source is processed as is without expanding borders.
+int processStream()
+{
+    Fl_RGB_Image* imgBokeh = loadImg( file_bokeh );
+    Fl_RGB_Image* imgMask  = NULL;
+
+    if ( imgBokeh == NULL )
+    {
+        printf( "- Failed to load image.\n" );
+        return 0;
+    }
+
+    unsigned mask_w = imgBokeh->w();
+    unsigned mask_h = imgBokeh->h();
+
+    convImage2Mono( imgBokeh, imgMask );
+    fl_imgtk::discard_user_rgb_image( imgBokeh );
+
+    if ( imgMask == NULL )
+    {
+        printf( "- Error: Unsupported image.\n" );
+        return 0;
+    }
+
+    BokehKernel* kernel = CompileBokehKernel( (const uchar*)imgMask->data()[0],
+                                              mask_w, mask_h );
+    delete imgMask;
+
+    StreamSource ss;
+    StreamSink   sk;
+
+    printf( "- Opening stream : %s -> ", file_src.c_str() );
+
+    if ( openStreamSource( file_src.c_str(), ss ) == false )
+    {
+        printf( "Failed.\n" );
+        DiscardBokehKernel( kernel );
+        return 0;
+    }
+
+    printf( "%ux%ux%u\n", ss.w, ss.h, ss.d );
+
+    if ( openStreamSink( file_dst.c_str(), ss.w, ss.h, sk ) == false )
+    {
+        printf( "- Failed to write : %s\n", file_dst.c_str() );
+        closeStreamSource( ss );
+        DiscardBokehKernel( kernel );
+        return 0;
+    }
+
+    printf( "- Processing streaming bokeh effect ( %u taps ) -> %s ... ", 
+            BokehKernelTaps( kernel ), file_dst.c_str() );
+    fflush( stdout );
+
+    unsigned long long tick0 = tick::getTickNs();
+    unsigned perf0 = tick::getTickCount();
+
+    bool retb = ProcessStreamBokeh( ss.w, ss.h, ss.d,
+                                    readStreamRow, &ss,
+                                    kernel,
+                                    writeStreamRow, &sk );
+
+    unsigned perf1 = tick::getTickCount();
+    unsigned long long tick1 = tick::getTickNs();
+
+    closeStreamSink( sk, retb );
+    closeStreamSource( ss );
+    DiscardBokehKernel( kernel );
+
+    printf( "done ( %d ) in %u ms.\n", (int)retb, perf1 - perf0 );
+    fflush( stdout );
+    printMemoryStats();
+
+    if ( opt_stats == true )
+    {
+        BokehStats st;
+
+        // rows are decoded and encoded inside, as part of bokeh.
+        GetBokehStats( st );
+        reportStats( st, 0, tick1 - tick0, 0 );
+    }
+
+    return 0;
+}
+
+// Depth mode blurs source of its own size by depth, mask is largest aperture.
+int processDepth()
+{
+    unsigned long long tickdec = tick::getTickNs();
+
+    Fl_RGB_Image* imgSrc   = loadImg( file_src );
+    Fl_RGB_Image* imgBokeh = loadImg( file_bokeh );
+    Fl_RGB_Image* imgDepth = loadImg( file_depth );
+    Fl_RGB_Image* imgRGB   = NULL;
+    Fl_RGB_Image* imgMask  = NULL;
+    Fl_RGB_Image* imgZ     = NULL;
+
+    if ( ( imgSrc != NULL ) && ( imgBokeh != NULL ) && ( imgDepth != NULL ) )
+    {
+        convImage2RGB( imgSrc, imgRGB );
+        convImage2Mono( imgBokeh, imgMask );
+        convImage2Mono( imgDepth, imgZ );
+    }
+
+    fl_imgtk::discard_user_rgb_image( imgSrc );
+    fl_imgtk::discard_user_rgb_image( imgBokeh );
+    fl_imgtk::discard_user_rgb_image( imgDepth );
+
+    tickdec = tick::getTickNs() - tickdec;
+
+    if ( ( imgRGB == NULL ) || ( imgMask == NULL ) || ( imgZ == NULL ) )
+    {
+        printf( "- Failed to load image.\n" );
+    }
+    else
+    if ( ( imgZ->w() != imgRGB->w() ) || ( imgZ->h() != imgRGB->h() ) )
+    {
+        printf( "- Error: Depth map is not size of source image.\n" );
+    }
+    else
+    {
+        unsigned img_w   = imgRGB->w();
+        unsigned img_h   = imgRGB->h();
+        uchar*   outbuff = NULL;
+
+        printf( "- Processing depth bokeh effect ( focus %.2f ) ... ", opt_focus );
+        fflush( stdout );
+
+        unsigned long long tick0 = tick::getTickNs();
+        unsigned perf0 = tick::getTickCount();
+
+        bool retb = ProcessDepthBokeh( (const uchar*)imgRGB->data()[0],
+                                       img_w, img_h, imgRGB->d(),
+                                       imgZ->data()[0], 8,
+                                       (const uchar*)imgMask->data()[0],
+                                       imgMask->w(), imgMask->h(),
+                                       opt_focus, outbuff );
+
+        unsigned perf1 = tick::getTickCount();
+        unsigned long long tick1 = tick::getTickNs();
+        unsigned long long tickenc = 0;
+
+        printf( "done ( %d ) in %u ms.\n", (int)retb, perf1 - perf0 );
+        fflush( stdout );
+        printMemoryStats();
+
+        if ( retb == true )
+        {
+            Fl_RGB_Image* imgWrite = new Fl_RGB_Image( outbuff, img_w, img_h, 3 );
+
+            printf( "- Writing : %s ... ", file_dst.c_str() );
+            fflush( stdout );
+
+            tickenc = tick::getTickNs();
+            save2png( imgWrite, file_dst.c_str() );
+            tickenc = tick::getTickNs() - tickenc;
+
+            printf( "Done.\n" );
+            fflush( stdout );
+
+            delete imgWrite;
+            delete[] outbuff;
+        }
+
+        if ( opt_stats == true )
+        {
+            BokehStats st;
+
+            GetBokehStats( st );
+            reportStats( st, tickdec, tick1 - tick0, tickenc );
+        }
+    }
+
+    delete imgRGB;
+    delete imgMask;
+    delete imgZ;
+
+    return 0;
+}
+
+// Interactive preview : a worker renders passes coarse to fine into
+// back buffer, and shows it by swapping images of box, without copy.
+// Each change of controls counts up generation, which cancels passes
+// of older generation in flight.
+struct ViewState
+{
+    Fl_Box*             box;
+    Fl_Value_Slider*    sldIntensity;
+    Fl_Value_Slider*    sldAperture;
+    Fl_Choice*          chsMask;
+    const uchar*        srcbuff;
+    unsigned            src_w;
+    unsigned            src_h;
+    vector<uchar>       filemask;
+    unsigned            mask_w;
+    unsigned            mask_h;
+    uchar*              buffers[2];
+    Fl_RGB_Image*       images[2];
+    unsigned            front;
+    atomic<unsigned>    generation;
+    mutex               lock;
+    condition_variable  cond;
+    bool                quit;
+    float               intensity;
+    float               aperture;
+    int                 shape;
+};
+
+static ViewState view;
+
+static bool viewCancelled( void* param )
+{
+    return view.generation != *(unsigned*)param;
+}
+
+// Mask of shape scaled by aperture, file mask by nearest pixels.
+static void makeViewMask( int shape, float aperture, 
+                          vector<uchar> &mask, unsigned &mw, unsigned &mh )
+{
+    mw = max( 3u, min( (unsigned)( view.mask_w * aperture ), view.src_w ) );
+    mh = max( 3u, min( (unsigned)( view.mask_h * aperture ), view.src_h ) );
+
+    mask.assign( mw * mh, 0 );
+
+    for( unsigned y=0; y<mh; y++ )
+    {
+        for( unsigned x=0; x<mw; x++ )
+        {
+            // -1 to 1 from center.
+            float u = ( x + 0.5f ) * 2.f / mw - 1.f;
+            float v = ( y + 0.5f ) * 2.f / mh - 1.f;
+            bool  in = false;
+
+            switch( shape )
+            {
+                case 1: /// disc
+                    in = ( u * u + v * v ) <= 1.f;
+                    break;
+
+                case 2: /// hexagon
+                    in = ( fabs( v ) <= 0.866f ) 
+                         && ( fabs( u ) * 0.866f + fabs( v ) * 0.5f <= 0.866f );
+                    break;
+
+                default: /// file
+                    mask[ y * mw + x ] = view.filemask[ ( y * view.mask_h / mh ) * view.mask_w 
+                                                        + x * view.mask_w / mw ];
+                    break;
+            }
+
+            if ( in == true )
+            {
+                mask[ y * mw + x ] = 255;
+            }
+        }
+    }
+}
+
+static void viewWorker()
+{
+    unsigned done = 0;
+
+    while( true )
+    {
+        unique_lock<mutex> lk( view.lock );
+
+        view.cond.wait( lk, [&]{ return ( view.quit == true ) 
+                                        || ( view.generation != done ); } );
+
+        if ( view.quit == true )
+            break;
+
+        unsigned gen      = view.generation;
+        float    inten    = view.intensity;
+        float    aperture = view.aperture;
+        int      shape    = view.shape;
+
+        lk.unlock();
+        done = gen;
+
+        vector<uchar> mask;
+        unsigned      mw = 0;
+        unsigned      mh = 0;
+
+        makeViewMask( shape, aperture, mask, mw, mh );
+        SetBokehIntensity( inten );
+
+        unsigned passes = PreviewBokehPasses( mw, mh );
+
+        for( unsigned pass=0; pass<passes; pass++ )
+        {
+            unsigned back  = view.front ^ 1;
+            unsigned perf0 = tick::getTickCount();
+
+            if ( ProcessPreviewBokeh( view.srcbuff, view.src_w, view.src_h, 3,
+                                      &mask[0], mw, mh,
+                                      pass, view.buffers[back],
+                                      viewCancelled, &gen ) == false )
+                break;
+
+            unsigned perf1 = tick::getTickCount();
+
+            Fl::lock();
+            view.images[back]->uncache();
+            view.box->image( view.images[back] );
+            view.box->redraw();
+            view.front = back;
+            Fl::unlock();
+            Fl::awake();
+
+            printf( "- Preview pass %u/%u ( mask %ux%u ) in %u ms.\n",
+                    pass + 1, passes, mw, mh, perf1 - perf0 );
+            fflush( stdout );
+        }
+    }
+}
+
+static void viewChanged( Fl_Widget*, void* )
+{
+    {
+        lock_guard<mutex> lk( view.lock );
+
+        view.intensity = view.sldIntensity->value();
+        view.aperture  = view.sldAperture->value();
+        view.shape     = view.chsMask->value();
+        view.generation++;
+    }
+
+    view.cond.notify_one();
+}
+
+int processView()
+{
+    Fl_RGB_Image* imgSrc   = loadImg( file_src );
+    Fl_RGB_Image* imgBokeh = loadImg( file_bokeh );
+    Fl_RGB_Image* imgRGB   = NULL;
+    Fl_RGB_Image* imgMask  = NULL;
+
+    if ( ( imgSrc == NULL ) || ( imgBokeh == NULL ) )
+    {
+        printf( "- Failed to load image.\n" );
+        fl_imgtk::discard_user_rgb_image( imgSrc );
+        fl_imgtk::discard_user_rgb_image( imgBokeh );
+        return 0;
+    }
+
+    // fits in 1280 x 800, mask reduced as same.
+    float fit = min( 1.f, min( 1280.f / imgSrc->w(), 800.f / imgSrc->h() ) );
+
+    if ( fit < 1.f )
+    {
+        Fl_RGB_Image* imgTmp = imgSrc;
+        imgSrc = fl_imgtk::rescale( imgTmp, 
+                                    imgTmp->w() * fit, imgTmp->h() * fit,
+                                    fl_imgtk::BILINEAR );
+        fl_imgtk::discard_user_rgb_image( imgTmp );
+
+        imgTmp   = imgBokeh;
+        imgBokeh = fl_imgtk::rescale( imgTmp,
+                                      max( 1.f, imgTmp->w() * fit ), 
+                                      max( 1.f, imgTmp->h() * fit ),
+                                      fl_imgtk::BILINEAR );
+        fl_imgtk::discard_user_rgb_image( imgTmp );
+    }
+
+    convImage2RGB( imgSrc, imgRGB );
+    convImage2Mono( imgBokeh, imgMask );
+
+    fl_imgtk::discard_user_rgb_image( imgSrc );
+    fl_imgtk::discard_user_rgb_image( imgBokeh );
+
+    if ( ( imgRGB == NULL ) || ( imgMask == NULL ) )
+    {
+        printf( "- Error: Unsupported image.\n" );
+        delete imgRGB;
+        delete imgMask;
+        return 0;
+    }
+
+    const uchar* mbuff = (const uchar*)imgMask->data()[0];
+
+    view.srcbuff   = (const uchar*)imgRGB->data()[0];
+    view.src_w     = imgRGB->w();
+    view.src_h     = imgRGB->h();
+    view.mask_w    = imgMask->w();
+    view.mask_h    = imgMask->h();
+    view.filemask.assign( mbuff, mbuff + view.mask_w * view.mask_h );
+    view.front     = 0;
+    view.generation = 0;
+    view.quit      = false;
+    view.intensity = GetBokehIntensity();
+    view.aperture  = 1.f;
+    view.shape     = 0;
+
+    for( unsigned cnt=0; cnt<2; cnt++ )
+    {
+        view.buffers[cnt] = new uchar[ view.src_w * view.src_h * 3 ];
+        memcpy( view.buffers[cnt], view.srcbuff, view.src_w * view.src_h * 3 );
+        view.images[cnt]  = new Fl_RGB_Image( view.buffers[cnt], 
+                                              view.src_w, view.src_h, 3 );
+    }
+
+    const int ctrl_h = 30;
+    const int win_w  = max( (int)view.src_w, 600 );
+    const int win_h  = view.src_h + ctrl_h * 3;
+
+    Fl_Double_Window* window = new Fl_Double_Window( win_w, win_h, "libbokeh preview" );
+
+    view.box = new Fl_Box( 0, 0, win_w, view.src_h );
+    view.box->image( view.images[0] );
+
+    view.sldIntensity = new Fl_Value_Slider( 100, view.src_h, win_w - 110, ctrl_h, 
+                                             "intensity" );
+    view.sldIntensity->type( FL_HORIZONTAL );
+    view.sldIntensity->align( FL_ALIGN_LEFT );
+    view.sldIntensity->bounds( 0.5, 1.0 );
+    view.sldIntensity->step( 0.01 );
+    view.sldIntensity->value( view.intensity );
+
+    view.sldAperture = new Fl_Value_Slider( 100, view.src_h + ctrl_h, win_w - 110, ctrl_h,
+                                            "aperture" );
+    view.sldAperture->type( FL_HORIZONTAL );
+    view.sldAperture->align( FL_ALIGN_LEFT );
+    view.sldAperture->bounds( 0.25, 2.0 );
+    view.sldAperture->step( 0.05 );
+    view.sldAperture->value( view.aperture );
+
+    view.chsMask = new Fl_Choice( 100, view.src_h + ctrl_h * 2, 150, ctrl_h, "mask" );
+    view.chsMask->add( "file" );
+    view.chsMask->add( "disc" );
+    view.chsMask->add( "hexagon" );
+    view.chsMask->value( 0 );
+
+    view.sldIntensity->when( FL_WHEN_CHANGED );
+    view.sldAperture->when( FL_WHEN_CHANGED );
+    view.sldIntensity->callback( viewChanged );
+    view.sldAperture->callback( viewChanged );
+    view.chsMask->callback( viewChanged );
+
+    window->end();
+    window->show();
+
+    Fl::lock();
+
+    thread worker( viewWorker );
+
+    viewChanged( NULL, NULL );
+    Fl::run();
+
+    // worker may wait for lock of FLTK to show a pass.
+    {
+        lock_guard<mutex> lk( view.lock );
+
+        view.quit = true;
+        view.generation++;
+    }
+
+    view.cond.notify_one();
+    Fl::unlock();
+    worker.join();
+
+    delete window;
+
+    for( unsigned cnt=0; cnt<2; cnt++ )
+    {
+        delete view.images[cnt];
+        delete[] view.buffers[cnt];
+    }
+
+    delete imgRGB;
+    delete imgMask;
+
+    return 0;
+}
+
+// Engine selected by options, processes source of expanded size.
+bool processBuffer( const uchar* refbuff,
+                    unsigned ref_w, unsigned ref_h, unsigned ref_d,
+                    const uchar* refmbuf, unsigned mask_w, unsigned mask_h,
+                    BokehKernel* kernel, uchar* &outbuff )
+{
+    bool retb = false;
+
+    if ( opt_legacy == true )
+    {
+        retb = ProcessBokeh( refbuff,
+                             ref_w, ref_h, ref_d,
+                             refmbuf,
+                             outbuff );
+    }
+    else
+    if ( opt_fixed == true )
+    {
+        retb = ProcessFixedBokeh( refbuff,
+                                  ref_w, ref_h, ref_d,
+                                  kernel,
+                                  outbuff );
+    }
+    else
+    if ( opt_gather == true )
+    {
+        retb = ProcessBorderBokeh( refbuff,
+                                   ref_w, ref_h, ref_d,
+                                   kernel, opt_border,
+                                   outbuff,
+                                   opt_anchor_x, opt_anchor_y, opt_bcolor );
+    }
+    else
+    if ( opt_fft == true )
+    {
+        retb = ProcessFFTBokeh( refbuff,
+                                ref_w, ref_h, ref_d,
+                                refmbuf,
+                                mask_w, mask_h,
+                                outbuff );
+    }
+    else
+    if ( opt_pyramid == true )
+    {
+        retb = ProcessPyramidBokeh( refbuff,
+                                    ref_w, ref_h, ref_d,
+                                    refmbuf,
+                                    mask_w, mask_h,
+                                    outbuff,
+                                    opt_quality );
+    }
+    else
+    if ( opt_hybrid == true )
+    {
+        retb = ProcessHybridBokeh( refbuff,
+                                   ref_w, ref_h, ref_d,
+                                   refmbuf,
+                                   mask_w, mask_h,
+                                   outbuff,
+                                   opt_quality );
+    }
+    else
+    if ( opt_sep == true )
+    {
+        retb = ProcessSeparableBokeh( refbuff,
+                                      ref_w, ref_h, ref_d,
+                                      refmbuf,
+                                      mask_w, mask_h,
+                                      outbuff );
+    }
+    else
+    {
+        retb = ProcessBorderBokeh( refbuff,
+                                   ref_w, ref_h, ref_d,
+                                   kernel, opt_border,
+                                   outbuff,
+                                   opt_anchor_x, opt_anchor_y, opt_bcolor );
+    }
+
+    return retb;
+}
+
+// Runs same engine by 1 to 32 threads, output must be same to bits.
+void reportScaling( const uchar* refbuff,
+                    unsigned ref_w, unsigned ref_h, unsigned ref_d,
+                    const uchar* refmbuf, unsigned mask_w, unsigned mask_h,
+                    BokehKernel* kernel )
+{
+    const unsigned counts[] = { 1, 2, 4, 8, 16, 32 };
+    unsigned       prev     = GetBokehThreads();
+    unsigned       base     = 0;
+    unsigned       hash0    = 0;
+
+    printf( "- Scaling ( %u cores ) :\n", 
+            max( 1u, (unsigned)thread::hardware_concurrency() ) );
+
+    for( unsigned cnt=0; cnt<sizeof( counts ) / sizeof( unsigned ); cnt++ )
+    {
+        uchar* outbuff = NULL;
+
+        SetBokehThreads( counts[cnt] );
+
+        unsigned perf0 = tick::getTickCount();
+        bool     retb  = processBuffer( refbuff, ref_w, ref_h, ref_d,
+                                        refmbuf, mask_w, mask_h,
+                                        kernel, outbuff );
+        unsigned perf1 = tick::getTickCount();
+
+        if ( retb == false )
+        {
+            printf( "  %2u threads : failure.\n", counts[cnt] );
+            break;
+        }
+
+        // FNV-1a of output.
+        unsigned hash = 2166136261u;
+
+        for( size_t pos=0; pos<(size_t)ref_w * ref_h * 3; pos++ )
+        {
+            hash = ( hash ^ outbuff[pos] ) * 16777619u;
+        }
+
+        delete[] outbuff;
+
+        unsigned elapsed = max( 1u, perf1 - perf0 );
+
+        if ( cnt == 0 )
+        {
+            base  = elapsed;
+            hash0 = hash;
+        }
+
+        double speedup = (double)base / elapsed;
+
+        printf( "  %2u threads : %6u ms, x%.2f, efficiency %3.0f%%, output %08X%s\n",
+                counts[cnt], elapsed, speedup, 
+                speedup * 100.0 / counts[cnt], hash,
+                hash == hash0 ? "" : " ( differs ! )" );
+        fflush( stdout );
+    }
+
+    SetBokehThreads( prev );
+}
+
+// Edits of cache against full processing : intensity steps,
+// then a square of 1/16 size painted at center.
+void reportRetouch( const uchar* refbuff,
+                    unsigned ref_w, unsigned ref_h, unsigned ref_d,
+                    const uchar* refmbuf, unsigned mask_w, unsigned mask_h )
+{
+    BokehKernel* kernel  = CompileBokehKernel( refmbuf, mask_w, mask_h );
+    BokehCache*  cache   = CreateBokehCache( refbuff, ref_w, ref_h, ref_d, kernel );
+    float        level   = GetBokehIntensity();
+    uchar*       outbuff = NULL;
+
+    if ( cache == NULL )
+    {
+        printf( "- Retouch : failure.\n" );
+        DiscardBokehKernel( kernel );
+        return;
+    }
+
+    printf( "- Retouch :\n" );
+
+    unsigned perf0 = tick::getTickCount();
+    RenderBokehCache( cache, 0, 0, ref_w, ref_h, outbuff );
+    unsigned perf1 = tick::getTickCount();
+
+    delete[] outbuff;
+
+    printf( "  first render     : %6u ms\n", perf1 - perf0 );
+
+    const float steps[] = { -0.01f, -0.05f, 0.05f };
+
+    for( unsigned cnt=0; cnt<sizeof( steps ) / sizeof( float ); cnt++ )
+    {
+        perf0 = tick::getTickCount();
+        SetBokehCacheIntensity( cache, level + steps[cnt] );
+        RenderBokehCache( cache, 0, 0, ref_w, ref_h, outbuff );
+        perf1 = tick::getTickCount();
+
+        delete[] outbuff;
+
+        printf( "  intensity %.2f   : %6u ms\n", level + steps[cnt], perf1 - perf0 );
+    }
+
+    SetBokehCacheIntensity( cache, level );
+
+    unsigned      area_w = max( 1u, ref_w / 4 );
+    unsigned      area_h = max( 1u, ref_h / 4 );
+    unsigned      area_x = ( ref_w - area_w ) / 2;
+    unsigned      area_y = ( ref_h - area_h ) / 2;
+    vector<uchar> painted( refbuff, refbuff + (size_t)ref_w * ref_h * ref_d );
+
+    for( unsigned y=area_y; y<area_y+area_h; y++ )
+    {
+        memset( &painted[ ( (size_t)y * ref_w + area_x ) * ref_d ], 0xFF, area_w * ref_d );
+    }
+
+    perf0 = tick::getTickCount();
+    UpdateBokehCache( cache, &painted[0], ref_d, area_x, area_y, area_w, area_h );
+    RenderBokehCache( cache, 0, 0, ref_w, ref_h, outbuff );
+    perf1 = tick::getTickCount();
+
+    delete[] outbuff;
+
+    printf( "  area %ux%u : %6u ms\n", area_w, area_h, perf1 - perf0 );
+    fflush( stdout );
+
+    DiscardBokehCache( cache );
+    DiscardBokehKernel( kernel );
+}
+
+// Two contexts of same settings process frames in their own threads,
+// outputs must be same, and buffers recycled after first frame.
+void reportContext( const uchar* refbuff,
+                    unsigned ref_w, unsigned ref_h, unsigned ref_d,
+                    const uchar* refmbuf, unsigned mask_w, unsigned mask_h )
+{
+    const unsigned frames = 8;
+    BokehConfig    config;
+
+    InitBokehConfig( config );
+
+    config.threads = max( 1u, GetBokehThreads() / 2 );
+    config.border  = opt_border;
+    config.anchorx = opt_anchor_x;
+    config.anchory = opt_anchor_y;
+    config.color   = opt_bcolor;
+
+    BokehContext*  ctxs[2]  = { NULL, NULL };
+    vector<uchar>  outs[2];
+    unsigned       busy[2]  = { 0, 0 };
+    bool           fails[2] = { false, false };
+    vector<thread> workers;
+
+    for( unsigned cnt=0; cnt<2; cnt++ )
+    {
+        ctxs[cnt] = CreateBokehContext( config, refmbuf, mask_w, mask_h );
+        outs[cnt].resize( (size_t)ref_w * ref_h * 3 );
+
+        if ( ctxs[cnt] == NULL )
+        {
+            printf( "- Context : failure.\n" );
+            DiscardBokehContext( ctxs[0] );
+            return;
+        }
+    }
+
+    for( unsigned cnt=0; cnt<2; cnt++ )
+    {
+        workers.push_back( thread( [&, cnt]
+        {
+            unsigned perf0 = tick::getTickCount();
+
+            for( unsigned frm=0; frm<frames; frm++ )
+            {
+                if ( ProcessBokehContext( ctxs[cnt], refbuff, ref_w, ref_h, ref_d, 0,
+                                          &outs[cnt][0], 0, 3 ) == false )
+                {
+                    fails[cnt] = true;
+                    break;
+                }
+            }
+
+            busy[cnt] = tick::getTickCount() - perf0;
+        } ) );
+    }
+
+    for( size_t cnt=0; cnt<workers.size(); cnt++ )
+    {
+        workers[cnt].join();
+    }
+
+    printf( "- Context : 2 x %u frames limited to %u threads each\n", frames, config.threads );
+
+    for( unsigned cnt=0; cnt<2; cnt++ )
+    {
+        BokehMemoryStats ms;
+        BokehStats       st;
+
+        GetBokehContextMemoryStats( ctxs[cnt], ms );
+        // workers of pool actually taken by loops of context.
+        GetBokehContextStats( ctxs[cnt], st );
+
+        printf( "  context %u : %s, %6.1f ms per frame, up to %u threads, "
+                "%llu buffers allocated of %llu\n",
+                cnt, fails[cnt] == true ? "failure" : "done",
+                (float)busy[cnt] / frames, st.stages[ BOKEH_STAGE_CONVOLVE ].threads,
+                ms.allocs, ms.requests );
+
+        DiscardBokehContext( ctxs[cnt] );
+    }
+
+    printf( "  outputs %s\n", outs[0] == outs[1] ? "same" : "DIFFER" );
+    fflush( stdout );
+}
+
+int main( int argc, char** argv )
+{   
+    if ( parseArgs( argc, argv ) == false )
+    {
+        printAbout();
+        printUsage();
+        return -1;
+    }
+
+    printAbout();
+
+    if ( opt_threads >= 0 )
+    {
+        SetBokehThreads( opt_threads );
+    }
+
+    if ( opt_pin == true )
+    {
+        SetBokehPinning( true );
+    }
+
+    if ( opt_huge == true )
+    {
+        SetBokehHugePages( true );
+    }
+    
+    printf( "- SIMD : %s, threads : %u\n", GetBokehSIMD(), GetBokehThreads() );
+
+    if ( opt_stats == true )
+    {
+        printf( "- Stats : hardware counters %s\n",
+                SetBokehCounters( true ) == true ? "enabled" : "not available" );
+    }
+
+    if ( opt_batch == true )
+    {
+        return processBatch();
+    }
+
+    if ( opt_stream == true )
+    {
+        return processStream();
+    }
+
+    if ( file_depth.size() > 0 )
+    {
+        return processDepth();
+    }
+
+    if ( opt_view == true )
+    {
+        return processView();
+    }
+
+    if ( rawimage::isRawFile( file_src.c_str() ) == true )
+    {
+        return processRaw();
+    }
+
+    // decode counts loading, expanding and converting of images.
+    unsigned long long tickdec = tick::getTickNs();
+
+    Fl_RGB_Image* imgSrc   = loadImg( file_src );
+	Fl_RGB_Image* imgBokeh = loadImg( file_bokeh );    
+    
+    if ( ( imgSrc != NULL ) && ( imgBokeh != NULL ) ) 
+    {
+        unsigned origin_w = imgSrc->w();
+        unsigned origin_h = imgSrc->h();
+
+        Fl_RGB_Image* imgRGB = NULL;
+		Fl_RGB_Image* imgMask = NULL;
+                
+		printf( "- Converting common images ... " );
+
+        unsigned mask_w = imgBokeh->w();
+        unsigned mask_h = imgBokeh->h();        
+
+        // Default and gather engine handle borders by themselves,
+        // others wrap around, so source is expanded by mask size.
+        bool expand = ( opt_legacy == true ) || ( opt_fixed == true )
+                      || ( opt_fft == true ) || ( opt_sep == true )
+                      || ( opt_pyramid == true ) || ( opt_hybrid == true );
+
+        if ( expand == true )
+        {
+            unsigned expand_sz_w = origin_w + ( mask_w * 2 );
+            unsigned expand_sz_h = origin_h + ( mask_h * 2 );
+
+            // Expand soruce image -
+            Fl_RGB_Image* imgTmpSrc = imgSrc;
+            imgSrc = fl_imgtk::rescale( imgTmpSrc,
+                                        expand_sz_w,
+                                        expand_sz_h,
+                                        fl_imgtk::BILINEAR );
+            //fl_imgtk::brightness_ex( imgSrc, -50 );
+            fl_imgtk::drawonimage( imgSrc, 
+                                   imgTmpSrc,
+                                   ( expand_sz_w - origin_w ) / 2,
+                                   ( expand_sz_h - origin_h ) / 2 );
+
+            fl_imgtk::discard_user_rgb_image( imgTmpSrc );
+        }
+
+        convImage2RGB( imgSrc, imgRGB );
+        
+        if ( ( imgBokeh->w() <= imgSrc->w() ) 
+              && ( imgBokeh->h() <= imgSrc->h() ) )
+        {
+            if ( opt_legacy == true )
+            {
+                Fl_RGB_Image* imgTmp = imgBokeh;
+                imgBokeh= fl_imgtk::makeanempty( imgSrc->w(), imgSrc->h(), 3, 0x0 );
+                int put_x = 0;
+                int put_y = imgSrc->h() - imgTmp->h();
+                fl_imgtk::drawonimage( imgBokeh, imgTmp, put_x, put_y );
+                
+                fl_imgtk::discard_user_rgb_image( imgTmp );
             }
         }
         else
@@ -701,6 +2766,8 @@ int main( int argc, char** argv )
 		convImage2Mono( imgBokeh, imgMask );
 		printf( "Ok.\n" );
 		fflush( stdout );
+
+        tickdec = tick::getTickNs() - tickdec;
         
         fl_imgtk::discard_user_rgb_image( imgSrc );
 		fl_imgtk::discard_user_rgb_image( imgBokeh );
@@ -715,42 +2782,138 @@ int main( int argc, char** argv )
 			
             uchar*       outbuff = NULL;
             unsigned     outsz   = 0;
+            BokehKernel* kernel  = NULL;
 
             if ( opt_legacy == true )
             {
     			printf( "- Processing legacy bokeh effect ... " );
             }
             else
+            if ( ( opt_gather == true ) || ( opt_fixed == true ) )
             {
-                printf( "- Processing bokeh effect ... " );
-            }
-			fflush( stdout );
-	    
-            unsigned perf0   = tick::getTickCount();
- 		
-            bool retb = false;
+                kernel = CompileBokehKernel( refmbuf, mask_w, mask_h );
 
-            if ( opt_legacy == true )
+                if ( opt_tune == true )
+                {
+                    unsigned tile_w = 0;
+                    unsigned tile_h = 0;
+
+                    printf( "- Tuning tile size ... " );
+                    fflush( stdout );
+
+                    AutotuneBokehTiles( kernel, tile_w, tile_h );
+
+                    printf( "%ux%u\n", tile_w, tile_h );
+                }
+
+                printf( "- Processing %s bokeh effect ( %u taps ) ... ",
+                        opt_fixed == true ? "fixed point gather" : "gather",
+                        BokehKernelTaps( kernel ) );
+            }
+            else
+            if ( opt_fft == true )
+            {
+                printf( "- Processing FFT bokeh effect ... " );
+            }
+            else
+            if ( opt_pyramid == true )
+            {
+                printf( "- Processing pyramid bokeh effect ( 1/%u scale, quality %.2f ) ... ",
+                        PyramidBokehScale( mask_w, mask_h, opt_quality ),
+                        opt_quality );
+            }
+            else
+            if ( opt_hybrid == true )
+            {
+                printf( "- Processing hybrid bokeh effect ( 1/%u scale, quality %.2f ) ... ",
+                        HybridBokehScale( mask_w, mask_h, opt_quality ),
+                        opt_quality );
+            }
+            else
+            if ( opt_sep == true )
             {
-			    retb = ProcessBokeh( refbuff,
-			                          ref_w, ref_h, ref_d,
-									  refmbuf,
-									  outbuff );
+                unsigned rank = AnalyseBokehMask( refmbuf, mask_w, mask_h );
+                printf( "- Processing separable bokeh effect ( rank %u ) ... ",
+                        rank );
             }
             else
             {
-                retb = ProcessFastBokeh( refbuff,
-                                          ref_w, ref_h, ref_d,
-                                          refmbuf,
-                                          mask_w, mask_h,
-                                          outbuff );
+                kernel = CompileBokehKernel( refmbuf, mask_w, mask_h );
+
+                printf( "- Processing bokeh effect ( %u taps ) ... ",
+                        BokehKernelTaps( kernel ) );
             }
+			fflush( stdout );
+	    
+            unsigned long long tick0 = tick::getTickNs();
+            unsigned perf0   = tick::getTickCount();
+ 		
+            bool retb = processBuffer( refbuff, ref_w, ref_h, ref_d,
+                                       refmbuf, mask_w, mask_h,
+                                       kernel, outbuff );
 
 	        unsigned perf1    = tick::getTickCount();
+            unsigned long long tick1 = tick::getTickNs();
 
             printf( "done ( %d ) in %u ms.\n", 
                     (int)retb, perf1 - perf0 );
 			fflush( stdout );
+            printMemoryStats();
+
+            // taken before reports below, processing again.
+            BokehStats stats;
+            GetBokehStats( stats );
+
+            unsigned long long tickenc = 0;
+
+            if ( ( retb == true ) 
+                 && ( ( opt_pyramid == true ) || ( opt_hybrid == true ) ) )
+            {
+                uchar* refout = NULL;
+
+                printf( "- Processing reference bokeh effect ... " );
+                fflush( stdout );
+
+                unsigned perf2 = tick::getTickCount();
+
+                if ( ProcessFastBokeh( refbuff, ref_w, ref_h, ref_d,
+                                       refmbuf, mask_w, mask_h,
+                                       refout ) == true )
+                {
+                    unsigned perf3 = tick::getTickCount();
+
+                    printf( "done in %u ms, PSNR %.2f dB.\n", 
+                            perf3 - perf2,
+                            BokehPSNR( refout, outbuff, ref_w, ref_h ) );
+
+                    delete[] refout;
+                }
+                else
+                {
+                    printf( "failure.\n" );
+                }
+                fflush( stdout );
+            }
+
+            if ( ( retb == true ) && ( opt_scale == true ) )
+            {
+                reportScaling( refbuff, ref_w, ref_h, ref_d,
+                               refmbuf, mask_w, mask_h, kernel );
+            }
+
+            if ( ( retb == true ) && ( opt_retouch == true ) )
+            {
+                reportRetouch( refbuff, ref_w, ref_h, ref_d,
+                               refmbuf, mask_w, mask_h );
+            }
+
+            if ( ( retb == true ) && ( opt_context == true ) )
+            {
+                reportContext( refbuff, ref_w, ref_h, ref_d,
+                               refmbuf, mask_w, mask_h );
+            }
+
+            DiscardBokehKernel( kernel );
 
 
 			if ( retb == true )
@@ -760,6 +2923,11 @@ int main( int argc, char** argv )
                                                               ref_w, 
                                                               ref_h, 
                                                               3 );
+                if ( ( imgWriteSrc != NULL ) && ( expand == false ) )
+                {
+                    imgWrite = imgWriteSrc;
+                }
+                else
                 if ( imgWriteSrc != NULL )
                 {
                     unsigned crop_l = mask_w + ( mask_w * 0.55f );
@@ -780,15 +2948,29 @@ int main( int argc, char** argv )
 					printf( "- Writing : %s ... ", file_dst.c_str() );
 					fflush(stdout);
 					
+					tickenc = tick::getTickNs();
 					save2png( imgWrite, file_dst.c_str() );
+					tickenc = tick::getTickNs() - tickenc;
 
                     printf( "Done.\n" );
                     fflush( stdout );
 					
-					delete imgWrite;
+                    if ( expand == true )
+                    {
+                        delete imgWrite;
+                    }
+                    else
+                    {
+                        fl_imgtk::discard_user_rgb_image( imgWrite );
+                    }
 				}
 			}
 			
+            if ( opt_stats == true )
+            {
+                reportStats( stats, tickdec, tick1 - tick0, tickenc );
+            }
+
             delete imgRGB;
 			delete imgMask;			
         }
@@ -3,6 +3,7 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <iostream>
+#include <chrono>
 #include "tick.h"
 
 namespace
@@ -36,6 +37,12 @@ unsigned long getTickCount()
 	return (tv.tv_sec - secStart) * 1000 + (tv.tv_usec - usecStart) / 1000;
 }
 
+unsigned long long getTickNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	           std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
 };
 
 #endif /// of _MSC_VER
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 namespace tick{
 unsigned long getTickCount();
+/// Monotonic clock in ns, for stats.
+unsigned long long getTickNs();
 };
 
 #endif /// of __TICK_H__
\ No newline at end of file